@@ -0,0 +1,131 @@
+#ifndef __EMISSION_TABLE_HPP
+#define __EMISSION_TABLE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <vector>
+
+#include "Pore_Model.hpp"
+#include "Event.hpp"
+
+/**
+ * Log emission probabilities of a block of consecutive events, for all states.
+ *
+ * The table is the product of the event emission feature matrix (rows x 6) and the pore model
+ * emission coefficient matrix (6 x n_states), computed in blocks of states that keep the
+ * coefficients in cache.
+ */
+template < typename Float_Type, unsigned Kmer_Size >
+class Emission_Table
+{
+public:
+    typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
+    typedef Event_Sequence< Float_Type, Kmer_Size > Event_Sequence_Type;
+
+    static const unsigned n_states = Pore_Model_Type::n_states;
+    static const unsigned n_features = Pore_Model_Type::n_emission_features;
+    static_assert(n_features == 6, "fill_states() assumes 6 emission features");
+    // states per cache block
+    static const unsigned state_block_size = 256;
+
+    // number of events per table used by the dynamic programs
+    static unsigned& block_rows() { static unsigned _block_rows = 64; return _block_rows; }
+
+    Emission_Table() : _pm_ptr(nullptr), _row_begin(0), _row_end(0) {}
+
+    unsigned row_begin() const { return _row_begin; }
+    unsigned row_end() const { return _row_end; }
+    bool has_row(unsigned i) const { return _row_begin <= i and i < _row_end; }
+
+    // i: event index, in [row_begin(), row_end())
+    // j: state/kmer index
+    const Float_Type* row(unsigned i) const
+    {
+        assert(has_row(i));
+        return &_v[static_cast< size_t >(i - _row_begin) * n_states];
+    }
+    Float_Type at(unsigned i, unsigned j) const { return row(i)[j]; }
+
+    // drop the events; the storage is kept for the next reset()
+    void clear()
+    {
+        _row_begin = 0;
+        _row_end = 0;
+        _feature_v.clear();
+        _v.clear();
+    }
+
+    // prepare the table for events [i_begin, i_end); the entries are computed by fill_states()
+    // drift: drift correction not yet applied to the events
+    void reset(const Pore_Model_Type& pm, const Event_Sequence_Type& ev, unsigned i_begin, unsigned i_end,
+               Float_Type drift = 0)
+    {
+        reset_features(pm, ev, i_begin, i_end, drift);
+        _v.resize(static_cast< size_t >(i_end - i_begin) * n_states);
+    }
+
+    // like reset(), but without room for the entries: only compute() may be used
+    void reset_features(const Pore_Model_Type& pm, const Event_Sequence_Type& ev, unsigned i_begin, unsigned i_end,
+                        Float_Type drift = 0)
+    {
+        assert(i_begin <= i_end and i_end <= ev.size());
+        _pm_ptr = &pm;
+        _row_begin = i_begin;
+        _row_end = i_end;
+        _feature_v = ev.get_emission_features(pm.emission_center(), i_begin, i_end, drift);
+        _v.clear();
+    }
+
+    // entry (i, j) computed on its own, for users that need a few states per event; same value as at(i, j)
+    Float_Type compute(unsigned i, unsigned j) const
+    {
+        assert(_pm_ptr and _row_begin <= i and i < _row_end);
+        const double* f = &_feature_v[static_cast< size_t >(i - _row_begin) * n_features];
+        return (f[0] * _pm_ptr->emission_coefficients(0)[j] + f[1] * _pm_ptr->emission_coefficients(1)[j]
+                + f[2] * _pm_ptr->emission_coefficients(2)[j] + f[3] * _pm_ptr->emission_coefficients(3)[j]
+                + f[4] * _pm_ptr->emission_coefficients(4)[j] + f[5] * _pm_ptr->emission_coefficients(5)[j]);
+    }
+
+    // compute the entries of states [j_begin, j_end); disjoint ranges may be filled concurrently
+    void fill_states(unsigned j_begin, unsigned j_end)
+    {
+        assert(_pm_ptr);
+        std::array< const double*, n_features > coef;
+        for (unsigned f = 0; f < n_features; ++f)
+        {
+            coef[f] = _pm_ptr->emission_coefficients(f);
+        }
+        unsigned n_rows = _row_end - _row_begin;
+        for (unsigned j0 = j_begin; j0 < j_end; j0 += state_block_size)
+        {
+            unsigned j1 = std::min(j_end, j0 + state_block_size);
+            for (unsigned r = 0; r < n_rows; ++r)
+            {
+                const double* f = &_feature_v[static_cast< size_t >(r) * n_features];
+                Float_Type* out = &_v[static_cast< size_t >(r) * n_states];
+                for (unsigned j = j0; j < j1; ++j)
+                {
+                    out[j] = (f[0] * coef[0][j] + f[1] * coef[1][j] + f[2] * coef[2][j]
+                              + f[3] * coef[3][j] + f[4] * coef[4][j] + f[5] * coef[5][j]);
+                }
+            }
+        }
+    }
+
+    void fill(const Pore_Model_Type& pm, const Event_Sequence_Type& ev, unsigned i_begin, unsigned i_end,
+              Float_Type drift = 0)
+    {
+        reset(pm, ev, i_begin, i_end, drift);
+        fill_states(0, n_states);
+    }
+
+private:
+    const Pore_Model_Type* _pm_ptr;
+    std::vector< double > _feature_v;
+    std::vector< Float_Type > _v;
+    unsigned _row_begin;
+    unsigned _row_end;
+}; // class Emission_Table
+
+#endif
@@ -37,6 +37,26 @@ public:
         log_stdv = std::log(stdv);
         log_start = std::log(start);
     }
+    // features in which log emission probabilities are linear, see Pore_Model::emission_coefficients():
+    // (x^2, x, 1, y, 1/y, log y), with x := corrected_mean - center, y := stdv
+    // drift: additional drift correction, applied as by Event_Sequence::apply_drift_correction()
+    static const unsigned n_emission_features = 6;
+    void get_emission_features(double center, double* f, Float_Type drift = 0) const
+    {
+        Float_Type m = corrected_mean;
+        if (drift != 0)
+        {
+            m -= drift * start;
+        }
+        double x = m - center;
+        double y = stdv;
+        f[0] = x * x;
+        f[1] = x;
+        f[2] = 1.0;
+        f[3] = y;
+        f[4] = 1.0 / y;
+        f[5] = log_stdv;
+    }
     void set_model_state(const std::string& s)
     {
         assert(s.size() == Kmer_Size);
@@ -67,6 +87,7 @@ struct Event_Sequence
     : std::vector< Event< Float_Type, Kmer_Size > >
 {
     typedef std::vector< Event< Float_Type, Kmer_Size > > Base;
+    typedef Event< Float_Type, Kmer_Size > Event_Type;
     using Base::Base;
     void apply_drift_correction(Float_Type drift)
     {
@@ -76,6 +97,23 @@ struct Event_Sequence
             e.log_corrected_mean = std::log(e.corrected_mean);
         }
     }
+    // emission feature matrix of events [i_begin, i_end), row-major
+    std::vector< double > get_emission_features(double center, unsigned i_begin, unsigned i_end,
+                                                Float_Type drift = 0) const
+    {
+        const Base& v = *this;
+        std::vector< double > res(static_cast< size_t >(i_end - i_begin) * Event_Type::n_emission_features);
+        for (unsigned i = i_begin; i < i_end; ++i)
+        {
+            v[i].get_emission_features(center, &res[static_cast< size_t >(i - i_begin) * Event_Type::n_emission_features],
+                                       drift);
+        }
+        return res;
+    }
+    std::vector< double > get_emission_features(double center) const
+    {
+        return get_emission_features(center, 0, this->size());
+    }
     std::string get_base_seq() const
     {
         std::string res;
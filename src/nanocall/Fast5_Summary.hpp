@@ -30,6 +30,8 @@ public:
     std::string file_name;
     std::string base_file_name;
     std::string read_id;
+    std::string run_id;
+    std::string channel_id;
     std::string bc_grp;
     std::array< std::array< std::string, 2 >, 3 > preferred_model;
     std::map< std::array< std::string, 2 >, Pore_Model_Parameters_Type > pm_params_m;
@@ -89,6 +91,20 @@ public:
         return _eventdetection_group;
     }
 
+    // run and channel from an ONT file name of the form <run>_ch<channel>_read<n>_...;
+    // both empty if the name is not of that form
+    static void parse_run_channel(const std::string& name, std::string& run, std::string& channel)
+    {
+        run.clear();
+        channel.clear();
+        auto pos = name.rfind("_ch");
+        if (pos == std::string::npos or pos == 0) return;
+        auto end = name.find_first_not_of("0123456789", pos + 3);
+        if (end == pos + 3 or end == std::string::npos or name.compare(end, 5, "_read") != 0) return;
+        run = name.substr(0, pos);
+        channel = name.substr(pos + 3, end - pos - 3);
+    }
+
     Fast5_Summary() : valid(false) {}
     Fast5_Summary(const std::string fn, const Pore_Model_Dict_Type& models, bool sst)
         : valid(false) { summarize(fn, models, sst); }
@@ -105,6 +121,7 @@ public:
             base_file_name.resize(base_file_name.size() - 6);
         }
         read_id = base_file_name;
+        parse_run_channel(base_file_name, run_id, channel_id);
         strand_bounds = {{ 0, 0, 0, 0 }};
         time_length = {{ 0.0, 0.0 }};
         num_ed_events = 0;
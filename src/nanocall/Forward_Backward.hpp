@@ -1,14 +1,23 @@
 #ifndef __FORWARD_BACKWARD_HPP
 #define __FORWARD_BACKWARD_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
 #include <cmath>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <utility>
 #include <vector>
 #include <set>
 
 #include "Pore_Model.hpp"
+#include "Emission_Table.hpp"
 #include "State_Transitions.hpp"
-#include "logsumset.hpp"
+#include "Thread_Team.hpp"
+#include "Log_Sum.hpp"
 #include "logger.hpp"
 
 template < typename Float_Type, unsigned Kmer_Size = 6 >
@@ -20,137 +29,1374 @@ public:
     typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
     typedef Event< Float_Type, Kmer_Size > Event_Type;
     typedef Event_Sequence< Float_Type, Kmer_Size > Event_Sequence_Type;
-    typedef logsum::logsumset< Float_Type > LogSumSet_Type;
-
-    struct Matrix_Entry
-    {
-        Float_Type alpha; // := Pr[ E_1 ... E_i, S_i = j ]
-        Float_Type beta;  // := Pr[ E_{i+1} ... E_n | S_i = j ]
-    }; // struct Matrix_Entry
+    typedef typename Log_Sum< Float_Type >::Set LogSumSet_Type;
+    typedef Emission_Table< Float_Type, Kmer_Size > Emission_Table_Type;
 
     static const unsigned n_states = Pore_Model_Type::n_states;
 
-    void clear() { _m.clear(); }
-    unsigned n_events() const { return _m.size() / n_states; }
+    Forward_Backward()
+        : _n_events(0), _alpha_rows(0), _beta_rows(0), _is_scaled(false), _is_sparse(false),
+          _pm_ptr(nullptr), _ev_ptr(nullptr) {}
+
+    void clear()
+    {
+        _alpha.clear();
+        _beta.clear();
+        _checkpoint_v.clear();
+        _emission.clear();
+        _sparse_begin.clear();
+        _sparse_state.clear();
+        _sparse_alpha.clear();
+        _sparse_beta.clear();
+        _sparse_emission.clear();
+        _n_events = 0;
+        _alpha_rows = 0;
+        _beta_rows = 0;
+    }
+    unsigned n_events() const { return _n_events; }
 
     // i: event index
     // j: state/kmer index
-    const Matrix_Entry& cell(unsigned i, unsigned j) const { return _m[i * n_states + j]; }
-    Matrix_Entry& cell(unsigned i, unsigned j) { return _m[i * n_states + j]; }
-
-    Float_Type log_posterior(unsigned i, unsigned j) const { return cell(i, j).alpha + cell(i, j).beta - _log_pr_data; }
+    // log_alpha := log Pr[ E_1 ... E_i, S_i = j ]
+    // log_beta  := log Pr[ E_{i+1} ... E_n | S_i = j ]
+    Float_Type log_alpha(unsigned i, unsigned j) const
+    {
+        return (not _is_scaled
+                ? alpha_row(i)[j]
+                : std::log(scaled_alpha(i, j)) + _log_alpha_offset_v[i]);
+    }
+    Float_Type log_beta(unsigned i, unsigned j) const
+    {
+        return (not _is_scaled
+                ? beta_row(i)[j]
+                : std::log(scaled_beta(i, j)) + _log_beta_offset_v[i]);
+    }
+    Float_Type log_posterior(unsigned i, unsigned j) const
+    {
+        return (not _is_scaled
+                ? alpha_row(i)[j] + beta_row(i)[j] - _log_pr_data
+                : std::log(scaled_alpha(i, j)) + std::log(scaled_beta(i, j)) - _log_row_sum_v.back());
+    }
+    // := Pr[ S_i = j | E ]; no transcendentals with the scaled engine
+    Float_Type posterior(unsigned i, unsigned j) const
+    {
+        return (not _is_scaled
+                ? std::exp(log_posterior(i, j))
+                : scaled_alpha(i, j) * scaled_beta(i, j) * _posterior_factor);
+    }
+    // call fn(j, posterior(i, j)) for every state j; with the sparse engine, only for the states kept at event i
+    template < typename Fn >
+    void for_each_posterior(unsigned i, Fn&& fn) const
+    {
+        if (_is_sparse)
+        {
+            for (unsigned k = _sparse_begin[i]; k < _sparse_begin[i + 1]; ++k)
+            {
+                fn(_sparse_state[k], _sparse_alpha[k] * _sparse_beta[k] * _posterior_factor);
+            }
+            return;
+        }
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            fn(j, posterior(i, j));
+        }
+    }
+    // p[j - j_begin] := posterior(i, j) for the states j in [j_begin, j_end); dense engines only
+    void posterior_block(unsigned i, unsigned j_begin, unsigned j_end, Float_Type* p) const
+    {
+        assert(not _is_sparse);
+        const Float_Type* a = alpha_row(i) + j_begin;
+        const Float_Type* b = beta_row(i) + j_begin;
+        unsigned n = j_end - j_begin;
+        if (_is_scaled)
+        {
+            for (unsigned k = 0; k < n; ++k)
+            {
+                p[k] = a[k] * b[k] * _posterior_factor;
+            }
+        }
+        else
+        {
+            for (unsigned k = 0; k < n; ++k)
+            {
+                p[k] = std::exp(a[k] + b[k] - _log_pr_data);
+            }
+        }
+    }
+    // := log Pr[ S_i = j1, S_{i+1} = j2 | E ], given the log transition probability j1->j2
+    Float_Type log_joint_posterior(unsigned i, unsigned j1, unsigned j2, Float_Type log_pr_transition) const
+    {
+        if (_is_sparse)
+        {
+            unsigned k1 = sparse_find(i, j1);
+            unsigned k2 = sparse_find(i + 1, j2);
+            if (k1 == npos or k2 == npos)
+            {
+                return -INFINITY;
+            }
+            return std::log(_sparse_alpha[k1]) + std::log(_sparse_emission[k2]) + std::log(_sparse_beta[k2])
+                + log_pr_transition - _log_row_sum_v[i] - _log_row_sum_v.back();
+        }
+        Float_Type log_pr_emission = _emission.at(i + 1, j2);
+        if (not _is_scaled)
+        {
+            return alpha_row(i)[j1] + log_pr_transition + log_pr_emission + beta_row(i + 1)[j2] - _log_pr_data;
+        }
+        // flush the scaled emission as the recursion does, so the result never exceeds log_posterior(i, j1)
+        Float_Type emission_scaled = flush(std::exp(log_pr_emission - _emission_shift_v[i + 1]));
+        return std::log(alpha_row(i)[j1]) + std::log(emission_scaled) + std::log(beta_row(i + 1)[j2])
+            + log_pr_transition - _log_row_sum_v[i] - _log_row_sum_v.back();
+    }
     Float_Type log_pr_data() const { return _log_pr_data; }
+    // log emission probabilities of all events, computed once per fill(); not filled by the sparse engine,
+    // and holding only the current segment with checkpointing
+    const Emission_Table_Type& emission() const { return _emission; }
+    // engine used by the last fill(); the sparse engine is also scaled
+    bool is_scaled() const { return _is_scaled; }
+    bool is_sparse() const { return _is_sparse; }
+
+    // run the recursions in probability space, dividing every event row by its sum (Rabiner scaling);
+    // reads where a row underflows are redone in log space
+    static bool& scaled() { static bool _scaled = false; return _scaled; }
+
+    // sparse engine: at every event, keep only the states whose forward probability is within this
+    // log margin of the largest one, and follow transitions out of those alone (INFINITY: off);
+    // the posteriors of the other states are 0
+    static Float_Type& prune_margin() { static Float_Type _prune_margin = INFINITY; return _prune_margin; }
+
+    // log space engine, fill() and fill_batch() jobs without row_fn: once the team has 2 or more
+    // members, run the forward and backward passes at the same time, each on half of the team
+    static bool& concurrent() { static bool _concurrent = false; return _concurrent; }
+
+    // fill_batch() only: once the team has at least as many members as there are jobs, hand whole
+    // jobs to the members, longest first, each filling them on its own, instead of splitting rows
+    static bool& task_parallel() { static bool _task_parallel = false; return _task_parallel; }
 
+    // dense engines: use the de Bruijn groups of the transitions (see State_Transitions::from_grouped()),
+    // summing over the step and skip predecessors (successors) of a state once per group
+    static bool& factorized() { static bool _factorized = false; return _factorized; }
+
+    // fill_streaming() only: keep alpha rows and emissions only for ~sqrt(n) events at a time, and
+    // recompute each segment from a checkpoint of its first alpha row during the backward pass;
+    // the posteriors are identical, with O(sqrt(n) n_states) memory
+    static bool& checkpointing() { static bool _checkpointing = false; return _checkpointing; }
+
+    // the state loop of every event is split across the threads of a team, see Thread_Team_Handle
     static unsigned& n_threads() { static unsigned _n_threads = 1; return _n_threads; }
+    void set_thread_team(Thread_Team* team_ptr) { _team.set(team_ptr); }
 
     void fill(const Pore_Model_Type& pm,
               const State_Transitions_Type& st,
               const Event_Sequence_Type& ev)
+    {
+        fill_rows(pm, st, ev, ev.size(), [] (unsigned) {});
+    }
+
+    /**
+     * Streaming fill: alpha is kept for all events (with checkpointing(), for one segment), but
+     * beta only for the last few rows of the backward pass. row_fn(i) is called for i from n-1 down to 0, at a point where
+     * log_posterior(i, .), posterior(i, .) and log_joint_posterior(i, ., ., .) are available;
+     * log_beta() and the posteriors of other events are not.
+     * If the scaled engine falls back to log space halfway, the calls restart from i = n-1.
+     */
+    template < typename Row_Fn >
+    void fill_streaming(const Pore_Model_Type& pm,
+                        const State_Transitions_Type& st,
+                        const Event_Sequence_Type& ev,
+                        Row_Fn&& row_fn)
+    {
+        // row_fn(i) reads beta rows i and i+1 while row i-1 is being computed
+        fill_rows(pm, st, ev, 3, row_fn);
+    }
+
+    /**
+     * One fill of a batch: fill() if row_fn is empty, otherwise fill_streaming() with row_fn.
+     */
+    struct Batch_Job
+    {
+        Forward_Backward* fwbw_ptr;
+        const Pore_Model_Type* pm_ptr;
+        const State_Transitions_Type* st_ptr;
+        const Event_Sequence_Type* ev_ptr;
+        std::function< void(unsigned) > row_fn;
+    };
+
+    /**
+     * Batched fill: the jobs advance in lockstep, one event row of every job at a time. The team
+     * of the first job splits the states of each row across its members for all jobs at once,
+     * so it synchronizes once per row instead of once per row and job, and jobs that share their
+     * transitions share the transition tables of the scaled engine. Each job gets the same
+     * results, and the same row_fn calls, as when filled on its own. All emissions are kept for
+     * the whole of each job, so this is meant for short event sequences, such as training windows.
+     * With a finite prune_margin(), or with checkpointing() for streaming jobs, the jobs are
+     * filled one by one; so are log space jobs without row_fn with concurrent(), once the team
+     * has 2 or more members, each with both passes at the same time. With task_parallel(),
+     * see fill_tasks().
+     */
+    static void fill_batch(std::vector< Batch_Job >& job_v)
+    {
+        if (job_v.empty()) return;
+        Thread_Team& team = job_v.front().fwbw_ptr->team();
+        if (task_parallel())
+        {
+            team.grow();
+            if (team.size() > 1 and job_v.size() >= team.size())
+            {
+                fill_tasks(job_v, team);
+                return;
+            }
+        }
+        bool log_concurrent = false;
+        if (concurrent() and not scaled())
+        {
+            team.grow();
+            log_concurrent = team.size() >= 2;
+        }
+        std::vector< Batch_Job* > batch;
+        unsigned max_n_events = 0;
+        for (auto& job : job_v)
+        {
+            Forward_Backward& fwbw = *job.fwbw_ptr;
+            auto row_fn = [&job] (unsigned i) { if (job.row_fn) job.row_fn(i); };
+            unsigned beta_rows = job.row_fn? 3 : job.ev_ptr->size();
+            if (std::isfinite(prune_margin()) or (checkpointing() and beta_rows < job.ev_ptr->size())
+                or (log_concurrent and not job.row_fn) or job.ev_ptr->empty())
+            {
+                fwbw.fill_rows(*job.pm_ptr, *job.st_ptr, *job.ev_ptr, beta_rows, row_fn);
+                continue;
+            }
+            fwbw.clear();
+            fwbw._n_events = job.ev_ptr->size();
+            fwbw._is_scaled = false;
+            fwbw._is_sparse = false;
+            fwbw._pm_ptr = job.pm_ptr;
+            fwbw._ev_ptr = job.ev_ptr;
+            fwbw.prepare_dense(beta_rows);
+            fwbw.fill_emission(0);
+            if (scaled())
+            {
+                fwbw._row_sum_v.assign(fwbw._n_events, 0);
+                fwbw._emission_shift_v.resize(fwbw._n_events);
+                auto it = std::find_if(batch.begin(), batch.end(),
+                                       [&] (const Batch_Job* p) { return p->st_ptr == job.st_ptr; });
+                if (it != batch.end())
+                {
+                    fwbw.copy_transition_pr(*(*it)->fwbw_ptr);
+                }
+                else
+                {
+                    fwbw.fill_transition_pr(*job.st_ptr);
+                }
+                fwbw.fill_emission_shift();
+                fwbw.fill_emission_scaled(0, fwbw._n_events);
+            }
+            batch.push_back(&job);
+            max_n_events = std::max(max_n_events, fwbw._n_events);
+        }
+        if (batch.empty()) return;
+        LOG("Forward_Backward", debug1) << "batch: jobs=" << batch.size() << " max_n_events=" << max_n_events << std::endl;
+        //
+        // forward: alpha
+        //
+        team.for_each_row(
+            max_n_events, n_states, 16,
+            [&] (unsigned i, unsigned j_begin, unsigned j_end) {
+                for (auto job_ptr : batch)
+                {
+                    Forward_Backward& fwbw = *job_ptr->fwbw_ptr;
+                    if (i >= fwbw._n_events) continue;
+                    if (scaled())
+                    {
+                        fwbw.forward_scaled_row(*job_ptr->st_ptr, i, j_begin, j_end);
+                    }
+                    else
+                    {
+                        fwbw.forward_log_row(*job_ptr->st_ptr, i, j_begin, j_end);
+                    }
+                }
+            },
+            [&] (unsigned i) {
+                for (auto job_ptr : batch)
+                {
+                    Forward_Backward& fwbw = *job_ptr->fwbw_ptr;
+                    if (scaled() and i < fwbw._n_events)
+                    {
+                        fwbw._row_sum_v[i] = fwbw.alpha_row_sum(i);
+                    }
+                }
+            });
+        // scaled jobs whose rows went out of range are redone in log space, one by one
+        std::vector< Batch_Job* > fallback;
+        for (auto job_ptr : batch)
+        {
+            Forward_Backward& fwbw = *job_ptr->fwbw_ptr;
+            if (not scaled())
+            {
+                fwbw.fill_log_pr_data();
+            }
+            else if (fwbw.row_sums_ok())
+            {
+                fwbw.fill_scaling_factors();
+                fwbw._is_scaled = true;
+            }
+            else
+            {
+                fallback.push_back(job_ptr);
+            }
+        }
+        //
+        // backward: beta, from the last row of every job; the engines are fixed for the whole pass,
+        // while failures are only seen by row_done
+        //
+        std::vector< char > active_v(batch.size());
+        std::vector< char > failed_v(batch.size(), false);
+        for (unsigned k = 0; k < batch.size(); ++k)
+        {
+            active_v[k] = not scaled() or batch[k]->fwbw_ptr->_is_scaled;
+        }
+        team.for_each_row(
+            max_n_events, n_states, 16,
+            [&] (unsigned r, unsigned j_begin, unsigned j_end) {
+                for (unsigned k = 0; k < batch.size(); ++k)
+                {
+                    Forward_Backward& fwbw = *batch[k]->fwbw_ptr;
+                    if (not active_v[k] or r >= fwbw._n_events) continue;
+                    unsigned i = fwbw._n_events - 1 - r;
+                    if (not scaled())
+                    {
+                        fwbw.backward_log_row(*batch[k]->st_ptr, i, j_begin, j_end);
+                    }
+                    else if (r == 0)
+                    {
+                        std::fill(fwbw.beta_row(i) + j_begin, fwbw.beta_row(i) + j_end, Float_Type(1));
+                    }
+                    else
+                    {
+                        fwbw.backward_scaled_row(*batch[k]->st_ptr, i, j_begin, j_end);
+                    }
+                }
+            },
+            [&] (unsigned r) {
+                for (unsigned k = 0; k < batch.size(); ++k)
+                {
+                    Forward_Backward& fwbw = *batch[k]->fwbw_ptr;
+                    if (not active_v[k] or failed_v[k] or r >= fwbw._n_events) continue;
+                    unsigned i = fwbw._n_events - 1 - r;
+                    // stop streaming at the first bad row
+                    if (scaled() and not fwbw.beta_row_ok(i))
+                    {
+                        LOG("Forward_Backward", debug) << "scaled backward: overflow" << std::endl;
+                        failed_v[k] = true;
+                        continue;
+                    }
+                    if (batch[k]->row_fn)
+                    {
+                        batch[k]->row_fn(i);
+                    }
+                }
+            });
+        for (unsigned k = 0; k < batch.size(); ++k)
+        {
+            if (failed_v[k])
+            {
+                batch[k]->fwbw_ptr->_is_scaled = false;
+                fallback.push_back(batch[k]);
+            }
+        }
+        for (auto job_ptr : fallback)
+        {
+            auto row_fn = [&] (unsigned i) { if (job_ptr->row_fn) job_ptr->row_fn(i); };
+            job_ptr->fwbw_ptr->fill_log(*job_ptr->st_ptr, row_fn);
+        }
+    }
+
+    friend std::ostream& operator << (std::ostream& os, const Forward_Backward& fwbw)
+    {
+        for (unsigned i = 0; i < fwbw.n_events(); ++i)
+        {
+            for (unsigned j = 0; j < fwbw.n_states; ++j)
+            {
+                os << i << '\t' << j << '\t'
+                   << fwbw.log_alpha(i, j) << '\t'
+                   << fwbw.log_beta(i, j) << std::endl;
+            }
+        }
+        return os;
+    }
+
+private:
+    // log probabilities; with the scaled engine, probabilities divided by per-event scaling factors;
+    // rows i % _alpha_rows
+    std::vector< Float_Type > _alpha;
+    // rows i % _beta_rows
+    std::vector< Float_Type > _beta;
+    // checkpointing: alpha row at the start of every segment but the last
+    std::vector< Float_Type > _checkpoint_v;
+    unsigned _n_events;
+    unsigned _alpha_rows;
+    unsigned _beta_rows;
+    Float_Type _log_pr_data;
+    bool _is_scaled;
+    bool _is_sparse;
+    // inputs of the current fill, used to recompute the emissions of each segment
+    const Pore_Model_Type* _pm_ptr;
+    const Event_Sequence_Type* _ev_ptr;
+    Thread_Team_Handle _team;
+    Emission_Table_Type _emission;
+    // scaled engine: emission probabilities of the current block of events, divided by exp(_emission_shift_v[i])
+    std::vector< Float_Type > _emission_scaled;
+    unsigned _emission_scaled_begin;
+    std::vector< double > _emission_shift_v;
+    // scaled engine: sum of alpha row i, its log, and the log factors restoring alpha and beta
+    std::vector< double > _row_sum_v;
+    std::vector< double > _log_row_sum_v;
+    std::vector< double > _log_alpha_offset_v;
+    std::vector< double > _log_beta_offset_v;
+    Float_Type _posterior_factor;
+    // scaled engine: transition probabilities, as (state, probability) lists in CSR layout
+    std::vector< std::pair< unsigned, Float_Type > > _from_pr;
+    std::vector< std::pair< unsigned, Float_Type > > _to_pr;
+    std::vector< unsigned > _from_begin;
+    std::vector< unsigned > _to_begin;
+    // scaled engine, factorized(): stay and group transition probabilities, empty if not used
+    std::vector< Float_Type > _stay_pr;
+    std::vector< Float_Type > _step_group_pr;
+    std::vector< Float_Type > _skip_group_pr;
+    // sparse engine: the states kept at event i are _sparse_state[_sparse_begin[i] .. _sparse_begin[i + 1]),
+    // in increasing order, with their scaled alpha, beta and emission probabilities
+    std::vector< unsigned > _sparse_begin;
+    std::vector< unsigned > _sparse_state;
+    std::vector< Float_Type > _sparse_alpha;
+    std::vector< Float_Type > _sparse_beta;
+    std::vector< Float_Type > _sparse_emission;
+
+    static const unsigned npos = static_cast< unsigned >(-1);
+
+    const Float_Type* alpha_row(unsigned i) const { return &_alpha[static_cast< size_t >(i % _alpha_rows) * n_states]; }
+    Float_Type* alpha_row(unsigned i) { return &_alpha[static_cast< size_t >(i % _alpha_rows) * n_states]; }
+    const Float_Type* beta_row(unsigned i) const { return &_beta[static_cast< size_t >(i % _beta_rows) * n_states]; }
+    Float_Type* beta_row(unsigned i) { return &_beta[static_cast< size_t >(i % _beta_rows) * n_states]; }
+
+    // sparse engine: position of state j among the states kept at event i, or npos
+    unsigned sparse_find(unsigned i, unsigned j) const
+    {
+        auto it_begin = _sparse_state.begin() + _sparse_begin[i];
+        auto it_end = _sparse_state.begin() + _sparse_begin[i + 1];
+        auto it = std::lower_bound(it_begin, it_end, j);
+        return it != it_end and *it == j? it - _sparse_state.begin() : npos;
+    }
+    // scaled engines: alpha'_i(j) and beta'_i(j)
+    Float_Type scaled_alpha(unsigned i, unsigned j) const
+    {
+        if (not _is_sparse) return alpha_row(i)[j];
+        unsigned k = sparse_find(i, j);
+        return k != npos? _sparse_alpha[k] : 0;
+    }
+    Float_Type scaled_beta(unsigned i, unsigned j) const
+    {
+        if (not _is_sparse) return beta_row(i)[j];
+        unsigned k = sparse_find(i, j);
+        return k != npos? _sparse_beta[k] : 0;
+    }
+
+    template < typename Row_Fn >
+    void fill_rows(const Pore_Model_Type& pm,
+                   const State_Transitions_Type& st,
+                   const Event_Sequence_Type& ev,
+                   unsigned beta_rows,
+                   Row_Fn&& row_fn)
     {
         clear();
-        unsigned n_events = ev.size();
-        _m.resize(n_states * n_events);
-        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
-        LogSumSet_Type s(false);
+        _n_events = ev.size();
+        _is_sparse = false;
+        _pm_ptr = &pm;
+        _ev_ptr = &ev;
+        if (std::isfinite(prune_margin()))
+        {
+            _emission.reset_features(pm, ev, 0, ev.size());
+            if (fill_sparse(st, row_fn))
+            {
+                return;
+            }
+            clear();
+            _n_events = ev.size();
+        }
+        prepare_dense(beta_rows);
+        _is_scaled = scaled() and fill_scaled(st, row_fn);
+        if (not _is_scaled)
+        {
+            fill_log(st, row_fn);
+        }
+    }
+
+    // storage of the dense engines
+    void prepare_dense(unsigned beta_rows)
+    {
+        _beta_rows = std::min(beta_rows, _n_events);
+        // segments of ~sqrt(n) events; the forward recursion needs 2 rows
+        _alpha_rows = (checkpointing() and _beta_rows < _n_events
+                       ? std::min(_n_events, std::max(2u, static_cast< unsigned >(std::ceil(std::sqrt(_n_events)))))
+                       : _n_events);
+        _alpha.resize(static_cast< size_t >(_alpha_rows) * n_states);
+        _beta.resize(static_cast< size_t >(_beta_rows) * n_states);
+        _checkpoint_v.resize(static_cast< size_t >(n_segments() - 1) * n_states);
+    }
+
+    // segment c holds events [c * _alpha_rows, (c + 1) * _alpha_rows); without checkpointing, there is one
+    unsigned n_segments() const { return (_n_events + _alpha_rows - 1) / _alpha_rows; }
+    std::pair< unsigned, unsigned > segment(unsigned c) const
+    {
+        return std::make_pair(c * _alpha_rows, std::min(_n_events, (c + 1) * _alpha_rows));
+    }
+    void save_checkpoint(unsigned c)
+    {
+        std::copy_n(alpha_row(segment(c).first), n_states, _checkpoint_v.begin() + static_cast< size_t >(c) * n_states);
+    }
+    void restore_checkpoint(unsigned c)
+    {
+        std::copy_n(_checkpoint_v.begin() + static_cast< size_t >(c) * n_states, n_states, alpha_row(segment(c).first));
+    }
+
+    /**
+     * Log space forward-backward, one segment at a time.
+     *
+     * The forward pass saves the first alpha row of every segment but the last. The backward
+     * pass runs over the segments in reverse order, and recomputes the alpha rows of every
+     * segment but the last from its checkpoint first; the recomputation repeats the same
+     * arithmetic, so the posteriors are identical to those of a single segment.
+     */
+    template < typename Row_Fn >
+    void fill_log(const State_Transitions_Type& st, Row_Fn&& row_fn)
+    {
+        unsigned n_events = _n_events;
+        if (concurrent() and _beta_rows == n_events and n_events > 1)
+        {
+            team().grow();
+            if (team().size() >= 2)
+            {
+                fill_emission(0);
+                fill_log_concurrent(st);
+                for (unsigned i = n_events; i > 0; --i)
+                {
+                    row_fn(i - 1);
+                }
+                return;
+            }
+        }
+        unsigned n_segments = this->n_segments();
         //
-        // forward: alpha, i == 0
+        // forward: alpha
         //
+        for (unsigned c = 0; c < n_segments; ++c)
         {
-            unsigned i = 0;
-            LOG("Forward_Backward", debug1) << "forward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
+            fill_emission(c);
+            forward_log_rows(st, segment(c).first, segment(c).second);
+            if (c + 1 < n_segments)
             {
-                cell(i, j).alpha = pm.log_pr_corrected_emission(j, ev[0]) - log_n_states;
-                LOG("Forward_Backward", debug2)
-                    << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
-                    << " alpha=" << cell(i, j).alpha << std::endl;
+                save_checkpoint(c);
             }
         }
+        fill_log_pr_data();
         //
-        // forward: alpha, i > 0
+        // backward: beta
         //
-        for (unsigned i = 1; i < ev.size(); ++i)
+        for (unsigned c = n_segments; c > 0; --c)
+        {
+            auto seg = segment(c - 1);
+            if (c < n_segments)
+            {
+                LOG("Forward_Backward", debug1) << "recompute: segment [" << seg.first << "," << seg.second << ")" << std::endl;
+                fill_emission(c - 1);
+                restore_checkpoint(c - 1);
+                forward_log_rows(st, seg.first + 1, seg.second);
+            }
+            team().for_each_row(
+                seg.second - seg.first, n_states, 16,
+                [&] (unsigned r, unsigned j_begin, unsigned j_end) {
+                    backward_log_row(st, seg.second - 1 - r, j_begin, j_end);
+                },
+                [&] (unsigned r) {
+                    row_fn(seg.second - 1 - r);
+                });
+        }
+    }
+
+    void forward_log_rows(const State_Transitions_Type& st, unsigned i_begin, unsigned i_end)
+    {
+        team().for_each_row(
+            i_end - i_begin, n_states, 16,
+            [&] (unsigned r, unsigned j_begin, unsigned j_end) {
+                forward_log_row(st, i_begin + r, j_begin, j_end);
+            },
+            [] (unsigned) {});
+    }
+
+    // the passes only share the emissions and transitions: run them on the two halves of the team
+    void fill_log_concurrent(const State_Transitions_Type& st)
+    {
+        unsigned n_events = _n_events;
+        LOG("Forward_Backward", debug1) << "concurrent: team_size=" << team().size() << std::endl;
+        team().run_split(
+            [&] (unsigned tid, unsigned n_members, const std::function< void() >& half_barrier) {
+                auto cols = Thread_Team::range(tid, n_members, n_states, 16);
+                for (unsigned i = 0; i < n_events; ++i)
+                {
+                    forward_log_row(st, i, cols.first, cols.second);
+                    half_barrier();
+                }
+            },
+            [&] (unsigned tid, unsigned n_members, const std::function< void() >& half_barrier) {
+                auto cols = Thread_Team::range(tid, n_members, n_states, 16);
+                for (unsigned i = n_events; i > 0; --i)
+                {
+                    backward_log_row(st, i - 1, cols.first, cols.second);
+                    half_barrier();
+                }
+            });
+        fill_log_pr_data();
+    }
+
+    void forward_log_row(const State_Transitions_Type& st, unsigned i, unsigned j_begin, unsigned j_end)
+    {
+        const Float_Type* emission_row = _emission.row(i);
+        Float_Type* alpha_crt = alpha_row(i);
+        LOG("Forward_Backward", debug1) << "forward: i=" << i << " j=[" << j_begin << "," << j_end << ")" << std::endl;
+        if (i == 0)
+        {
+            Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+            for (unsigned j = j_begin; j < j_end; ++j)
+            {
+                alpha_crt[j] = emission_row[j] - log_n_states;
+                LOG("Forward_Backward", debug2)
+                    << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
+                    << " alpha=" << alpha_crt[j] << std::endl;
+            }
+            return;
+        }
+        const Float_Type* alpha_prev = alpha_row(i - 1);
+        bool grouped = factorized() and st.has_groups();
+        LogSumSet_Type s;
+        // the groups of the states in [j_begin, j_end) hold no other states
+        assert(j_begin % 16 == 0 and j_end % 16 == 0);
+        std::array< Float_Type, State_Transitions_Type::n_step_groups > step_sum;
+        std::array< Float_Type, State_Transitions_Type::n_skip_groups > skip_sum;
+        for (unsigned g = j_begin / 4; grouped and g < j_end / 4; ++g)
         {
-            LOG("Forward_Backward", debug1) << "forward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
+            s.clear();
+            for (unsigned b = 0; b < 4; ++b)
+            {
+                s.add(st.step_group_weights(g)[b] + alpha_prev[State_Transitions_Type::step_group_member(g, b)]);
+            }
+            step_sum[g] = s.val();
+        }
+        for (unsigned g = j_begin / 16; grouped and g < j_end / 16; ++g)
+        {
+            s.clear();
+            for (unsigned b = 0; b < 16; ++b)
+            {
+                s.add(st.skip_group_weights(g)[b] + alpha_prev[State_Transitions_Type::skip_group_member(g, b)]);
+            }
+            skip_sum[g] = s.val();
+        }
+        for (unsigned j = j_begin; j < j_end; ++j)
+        {
+            s.clear();
+            if (grouped and st.from_grouped(j))
+            {
+                s.add(st.pattern_weights(0)[j] + alpha_prev[j]);
+                s.add(step_sum[State_Transitions_Type::step_group(j)]);
+                s.add(skip_sum[State_Transitions_Type::skip_group(j)]);
+            }
+            else
             {
-                s.clear();
                 for (const auto& p : st.neighbours(j).from_v)
                 {
                     const unsigned& j_prev = p.first;
                     const Float_Type& log_pr_transition = p.second;
-                    s.add(log_pr_transition + cell(i - 1, j_prev).alpha);
+                    s.add(log_pr_transition + alpha_prev[j_prev]);
                 }
-                cell(i, j).alpha = pm.log_pr_corrected_emission(j, ev[i]) + s.val();
+            }
+            alpha_crt[j] = emission_row[j] + s.val();
+            LOG("Forward_Backward", debug2)
+                << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
+                << " alpha=" << alpha_crt[j] << std::endl;
+        }
+    }
+
+    // row i < n-1 uses the emissions of event i+1
+    void backward_log_row(const State_Transitions_Type& st, unsigned i, unsigned j_begin, unsigned j_end)
+    {
+        Float_Type* beta_crt = beta_row(i);
+        LOG("Forward_Backward", debug1) << "backward: i=" << i << " j=[" << j_begin << "," << j_end << ")" << std::endl;
+        if (i == _n_events - 1)
+        {
+            for (unsigned j = j_begin; j < j_end; ++j)
+            {
+                beta_crt[j] = 0;
                 LOG("Forward_Backward", debug2)
                     << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
-                    << " alpha=" << cell(i, j).alpha << std::endl;
+                    << " beta=" << beta_crt[j] << std::endl;
+            }
+            return;
+        }
+        const Float_Type* emission_row = _emission.row(i + 1);
+        const Float_Type* beta_next = beta_row(i + 1);
+        bool grouped = factorized() and st.has_groups();
+        LogSumSet_Type s;
+        // sums over the groups of successors: the states [j_begin, j_end) are members of the groups
+        // [j_begin, j_end) modulo the number of groups
+        std::array< Float_Type, State_Transitions_Type::n_step_groups > step_sum;
+        std::array< Float_Type, State_Transitions_Type::n_skip_groups > skip_sum;
+        for (unsigned j = j_begin; grouped and j < std::min(j_end, j_begin + State_Transitions_Type::n_step_groups); ++j)
+        {
+            unsigned g = State_Transitions_Type::step_pred_group(j);
+            s.clear();
+            for (unsigned c = 0; c < 4; ++c)
+            {
+                s.add(emission_row[4 * g + c] + beta_next[4 * g + c]);
+            }
+            step_sum[g] = s.val();
+        }
+        for (unsigned j = j_begin; grouped and j < std::min(j_end, j_begin + State_Transitions_Type::n_skip_groups); ++j)
+        {
+            unsigned g = State_Transitions_Type::skip_pred_group(j);
+            s.clear();
+            for (unsigned c = 0; c < 16; ++c)
+            {
+                s.add(emission_row[16 * g + c] + beta_next[16 * g + c]);
             }
+            skip_sum[g] = s.val();
         }
+        for (unsigned j = j_begin; j < j_end; ++j)
+        {
+            s.clear();
+            if (grouped and st.to_grouped(j))
+            {
+                unsigned g = State_Transitions_Type::step_pred_group(j);
+                unsigned g2 = State_Transitions_Type::skip_pred_group(j);
+                s.add(st.pattern_weights(0)[j] + emission_row[j] + beta_next[j]);
+                s.add(st.step_group_weights(g)[State_Transitions_Type::step_pred_member(j)] + step_sum[g]);
+                s.add(st.skip_group_weights(g2)[State_Transitions_Type::skip_pred_member(j)] + skip_sum[g2]);
+            }
+            else
+            {
+                for (const auto& p : st.neighbours(j).to_v)
+                {
+                    const unsigned& j_next = p.first;
+                    const Float_Type& log_pr_transition = p.second;
+                    s.add(log_pr_transition + emission_row[j_next] + beta_next[j_next]);
+                }
+            }
+            beta_crt[j] = s.val();
+            LOG("Forward_Backward", debug2)
+                << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
+                << " beta=" << beta_crt[j] << std::endl;
+        }
+    }
+
+    void fill_log_pr_data()
+    {
+        _log_pr_data = Log_Sum< Float_Type >::log_sum(alpha_row(_n_events - 1), n_states);
+    }
+
+    /**
+     * Scaled forward-backward.
+     *
+     * With e'_i(j) = Pr[ E_i | S_i = j ] / exp(shift_i) and s_i the sum of row i of alpha':
+     *   alpha'_0(j) = e'_0(j)
+     *   alpha'_i(j) = e'_i(j) * \sum_k Pr[ k -> j ] alpha'_{i-1}(k) / s_{i-1}
+     *   beta'_{n-1}(j) = 1
+     *   beta'_i(j) = \sum_k Pr[ j -> k ] e'_{i+1}(k) beta'_{i+1}(k) / s_i
+     * so that Pr[ S_i = j | E ] = alpha'_i(j) beta'_i(j) / s_{n-1}, and
+     * log Pr[ E ] = \sum_i (shift_i + log s_i) - log n_states.
+     * Returns false if a row underflows or overflows.
+     */
+    template < typename Row_Fn >
+    bool fill_scaled(const State_Transitions_Type& st, Row_Fn&& row_fn)
+    {
+        unsigned n_events = _n_events;
+        unsigned n_segments = this->n_segments();
+        _row_sum_v.assign(n_events, 0);
+        _emission_shift_v.resize(n_events);
+        fill_transition_pr(st);
         //
-        // backward: beta, i == n-1
+        // forward: alpha
         //
+        for (unsigned c = 0; c < n_segments; ++c)
         {
-            unsigned i = ev.size() - 1;
-            LOG("Forward_Backward", debug1) << "backward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
+            if (fill_emission(c))
             {
-                cell(i, j).beta = 0;
-                LOG("Forward_Backward", debug2)
-                    << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
-                    << " beta=" << cell(i, j).beta << std::endl;
+                fill_emission_shift();
             }
+            forward_scaled_rows(st, segment(c).first, segment(c).second);
+            if (c + 1 < n_segments)
+            {
+                save_checkpoint(c);
+            }
+        }
+        if (not row_sums_ok())
+        {
+            return false;
         }
+        fill_scaling_factors();
+        // from here on, the posteriors are exposed to row_fn
+        _is_scaled = true;
         //
-        // backward: beta, i < n-1
+        // backward: beta, as in fill_log()
         //
-        for (unsigned ip1 = ev.size() - 1; ip1 > 0; --ip1)
+        bool beta_ok = true;
+        for (unsigned c = n_segments; c > 0 and beta_ok; --c)
         {
-            unsigned i = ip1 - 1;
-            LOG("Forward_Backward", debug1) << "backward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
+            auto seg = segment(c - 1);
+            if (c < n_segments)
             {
-                s.clear();
-                for (const auto& p : st.neighbours(j).to_v)
+                LOG("Forward_Backward", debug1) << "recompute: segment [" << seg.first << "," << seg.second << ")" << std::endl;
+                if (fill_emission(c - 1))
                 {
-                    const unsigned& j_next = p.first;
-                    const Float_Type& log_pr_transition = p.second;
-                    s.add(log_pr_transition + pm.log_pr_corrected_emission(j_next, ev[ip1]) + cell(ip1, j_next).beta);
+                    fill_emission_shift();
                 }
-                cell(i, j).beta += s.val();
-                LOG("Forward_Backward", debug2)
-                    << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
-                    << " beta=" << cell(i, j).beta << std::endl;
+                restore_checkpoint(c - 1);
+                forward_scaled_rows(st, seg.first + 1, seg.second);
+            }
+            else
+            {
+                for (unsigned j = 0; j < n_states; ++j)
+                {
+                    beta_row(n_events - 1)[j] = 1;
+                }
+                row_fn(n_events - 1);
+            }
+            beta_ok = backward_scaled_rows(st, seg.first + 1, std::min(n_events, seg.second + 1), row_fn);
+        }
+        if (not beta_ok)
+        {
+            LOG("Forward_Backward", debug) << "scaled backward: overflow" << std::endl;
+            _is_scaled = false;
+            return false;
+        }
+        return true;
+    }
+
+    // scaled alpha rows [i_begin, i_end), and their sums
+    void forward_scaled_rows(const State_Transitions_Type& st, unsigned i_begin, unsigned i_end)
+    {
+        for (unsigned i_block = i_begin; i_block < i_end; i_block += Emission_Table_Type::block_rows())
+        {
+            unsigned i_block_end = std::min(i_end, i_block + Emission_Table_Type::block_rows());
+            fill_emission_scaled(i_block, i_block_end);
+            team().for_each_row(
+                i_block_end - i_block, n_states, 16,
+                [&] (unsigned r, unsigned j_begin, unsigned j_end) {
+                    forward_scaled_row(st, i_block + r, j_begin, j_end);
+                },
+                [&] (unsigned r) {
+                    _row_sum_v[i_block + r] = alpha_row_sum(i_block + r);
+                });
+        }
+    }
+
+    // scaled alpha row i; the scaled emissions of event i must be cached
+    void forward_scaled_row(const State_Transitions_Type& st, unsigned i, unsigned j_begin, unsigned j_end)
+    {
+        const Float_Type* emission_row = emission_scaled_row(i);
+        Float_Type* alpha_crt = alpha_row(i);
+        LOG("Forward_Backward", debug1) << "forward: i=" << i << " j=[" << j_begin << "," << j_end << ")" << std::endl;
+        if (i == 0)
+        {
+            for (unsigned j = j_begin; j < j_end; ++j)
+            {
+                alpha_crt[j] = emission_row[j];
+            }
+            return;
+        }
+        const Float_Type* alpha_prev = alpha_row(i - 1);
+        bool grouped = not _stay_pr.empty();
+        // every member sums the full previous row, in the same order
+        Float_Type inv_s = 1.0 / alpha_row_sum(i - 1);
+        // as in forward_log_row()
+        std::array< Float_Type, State_Transitions_Type::n_step_groups > step_sum;
+        std::array< Float_Type, State_Transitions_Type::n_skip_groups > skip_sum;
+        for (unsigned g = j_begin / 4; grouped and g < j_end / 4; ++g)
+        {
+            Float_Type v = 0;
+            for (unsigned b = 0; b < 4; ++b)
+            {
+                v += _step_group_pr[4 * g + b] * alpha_prev[State_Transitions_Type::step_group_member(g, b)];
+            }
+            step_sum[g] = v;
+        }
+        for (unsigned g = j_begin / 16; grouped and g < j_end / 16; ++g)
+        {
+            Float_Type v = 0;
+            for (unsigned b = 0; b < 16; ++b)
+            {
+                v += _skip_group_pr[16 * g + b] * alpha_prev[State_Transitions_Type::skip_group_member(g, b)];
+            }
+            skip_sum[g] = v;
+        }
+        for (unsigned j = j_begin; j < j_end; ++j)
+        {
+            Float_Type v = 0;
+            if (grouped and st.from_grouped(j))
+            {
+                v = (_stay_pr[j] * alpha_prev[j] + step_sum[State_Transitions_Type::step_group(j)]
+                     + skip_sum[State_Transitions_Type::skip_group(j)]);
+            }
+            else
+            {
+                for (unsigned k = _from_begin[j]; k < _from_begin[j + 1]; ++k)
+                {
+                    v += _from_pr[k].second * alpha_prev[_from_pr[k].first];
+                }
+            }
+            alpha_crt[j] = flush(emission_row[j] * v * inv_s);
+        }
+    }
+
+    // scaled beta rows i, for i + 1 in [ip1_begin, ip1_end), last first;
+    // returns false at the first row that overflows, without calling row_fn on it
+    template < typename Row_Fn >
+    bool backward_scaled_rows(const State_Transitions_Type& st, unsigned ip1_begin, unsigned ip1_end, Row_Fn&& row_fn)
+    {
+        bool beta_ok = true;
+        for (unsigned ip1_block_end = ip1_end; ip1_block_end > ip1_begin and beta_ok; )
+        {
+            unsigned ip1_block = std::max(ip1_begin, ip1_block_end - std::min(ip1_block_end, Emission_Table_Type::block_rows()));
+            fill_emission_scaled(ip1_block, ip1_block_end);
+            team().for_each_row(
+                ip1_block_end - ip1_block, n_states, 16,
+                [&] (unsigned r, unsigned j_begin, unsigned j_end) {
+                    backward_scaled_row(st, ip1_block_end - 2 - r, j_begin, j_end);
+                },
+                [&] (unsigned r) {
+                    unsigned i = ip1_block_end - 2 - r;
+                    beta_ok = beta_ok and beta_row_ok(i);
+                    // stop streaming at the first bad row
+                    if (beta_ok)
+                    {
+                        row_fn(i);
+                    }
+                });
+            ip1_block_end = ip1_block;
+        }
+        return beta_ok;
+    }
+
+    // scaled beta row i < n-1; uses the cached scaled emissions of event i+1
+    void backward_scaled_row(const State_Transitions_Type& st, unsigned i, unsigned j_begin, unsigned j_end)
+    {
+        const Float_Type* emission_row = emission_scaled_row(i + 1);
+        const Float_Type* beta_next = beta_row(i + 1);
+        Float_Type* beta_crt = beta_row(i);
+        LOG("Forward_Backward", debug1) << "backward: i=" << i << " j=[" << j_begin << "," << j_end << ")" << std::endl;
+        bool grouped = not _stay_pr.empty();
+        Float_Type inv_s = 1.0 / _row_sum_v[i];
+        // as in backward_log_row()
+        std::array< Float_Type, State_Transitions_Type::n_step_groups > step_sum;
+        std::array< Float_Type, State_Transitions_Type::n_skip_groups > skip_sum;
+        for (unsigned j = j_begin; grouped and j < std::min(j_end, j_begin + State_Transitions_Type::n_step_groups); ++j)
+        {
+            unsigned g = State_Transitions_Type::step_pred_group(j);
+            Float_Type v = 0;
+            for (unsigned c = 0; c < 4; ++c)
+            {
+                v += emission_row[4 * g + c] * beta_next[4 * g + c];
+            }
+            step_sum[g] = v;
+        }
+        for (unsigned j = j_begin; grouped and j < std::min(j_end, j_begin + State_Transitions_Type::n_skip_groups); ++j)
+        {
+            unsigned g = State_Transitions_Type::skip_pred_group(j);
+            Float_Type v = 0;
+            for (unsigned c = 0; c < 16; ++c)
+            {
+                v += emission_row[16 * g + c] * beta_next[16 * g + c];
+            }
+            skip_sum[g] = v;
+        }
+        for (unsigned j = j_begin; j < j_end; ++j)
+        {
+            Float_Type v = 0;
+            if (grouped and st.to_grouped(j))
+            {
+                unsigned g = State_Transitions_Type::step_pred_group(j);
+                unsigned g2 = State_Transitions_Type::skip_pred_group(j);
+                v = (_stay_pr[j] * emission_row[j] * beta_next[j]
+                     + _step_group_pr[4 * g + State_Transitions_Type::step_pred_member(j)] * step_sum[g]
+                     + _skip_group_pr[16 * g2 + State_Transitions_Type::skip_pred_member(j)] * skip_sum[g2]);
+            }
+            else
+            {
+                for (unsigned k = _to_begin[j]; k < _to_begin[j + 1]; ++k)
+                {
+                    const unsigned& j_next = _to_pr[k].first;
+                    v += _to_pr[k].second * emission_row[j_next] * beta_next[j_next];
+                }
+            }
+            beta_crt[j] = flush(v * inv_s);
+        }
+    }
+
+    // false if scaled beta row i overflows
+    bool beta_row_ok(unsigned i) const
+    {
+        double s = 0;
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            s += beta_row(i)[j];
+        }
+        return std::isfinite(s);
+    }
+
+    /**
+     * Sparse forward-backward: the scaled recursions, restricted to the states kept at each event.
+     *
+     * Alpha is pushed from the states kept at event i-1 to their successors; of those, the states
+     * with alpha'_i(j) >= exp(-prune_margin()) * max_j alpha'_i(j) are kept. Emissions are computed
+     * for the states reached alone, and shift_i is their maximum. Beta is computed for the kept
+     * states, from the kept states of the next event. Runs on the calling thread: the rows are
+     * short, and the work per event does not grow with n_states.
+     * Returns false if a row underflows or overflows.
+     */
+    template < typename Row_Fn >
+    bool fill_sparse(const State_Transitions_Type& st, Row_Fn&& row_fn)
+    {
+        unsigned n_events = _n_events;
+        Float_Type min_ratio = std::exp(-prune_margin());
+        fill_transition_pr(st);
+        _row_sum_v.assign(n_events, 0);
+        _emission_shift_v.resize(n_events);
+        _sparse_begin.assign(1, 0);
+        // indexed by state: incoming mass, and whether the state was reached
+        std::vector< Float_Type > v(n_states, 0);
+        std::vector< bool > reached(n_states, false);
+        // the states reached at event i, with their log emission and alpha
+        std::vector< unsigned > crt_state;
+        std::vector< Float_Type > crt_emission;
+        std::vector< Float_Type > crt_alpha;
+        //
+        // forward: alpha
+        //
+        for (unsigned i = 0; i < n_events; ++i)
+        {
+            crt_state.clear();
+            Float_Type inv_s = 1;
+            if (i == 0)
+            {
+                for (unsigned j = 0; j < n_states; ++j)
+                {
+                    crt_state.push_back(j);
+                    v[j] = 1;
+                }
+            }
+            else
+            {
+                inv_s = 1.0 / _row_sum_v[i - 1];
+                for (unsigned k = _sparse_begin[i - 1]; k < _sparse_begin[i]; ++k)
+                {
+                    unsigned j_prev = _sparse_state[k];
+                    for (unsigned t = _to_begin[j_prev]; t < _to_begin[j_prev + 1]; ++t)
+                    {
+                        unsigned j = _to_pr[t].first;
+                        if (not reached[j])
+                        {
+                            reached[j] = true;
+                            crt_state.push_back(j);
+                        }
+                        v[j] += _to_pr[t].second * _sparse_alpha[k];
+                    }
+                }
+                std::sort(crt_state.begin(), crt_state.end());
+            }
+            unsigned n_crt = crt_state.size();
+            crt_emission.resize(n_crt);
+            crt_alpha.resize(n_crt);
+            for (unsigned r = 0; r < n_crt; ++r)
+            {
+                crt_emission[r] = _emission.compute(i, crt_state[r]);
+            }
+            Float_Type shift = *std::max_element(crt_emission.begin(), crt_emission.end());
+            _emission_shift_v[i] = shift;
+            Float_Type alpha_max = 0;
+            for (unsigned r = 0; r < n_crt; ++r)
+            {
+                unsigned j = crt_state[r];
+                crt_emission[r] = flush(std::exp(crt_emission[r] - shift));
+                crt_alpha[r] = (i == 0? crt_emission[r] : flush(crt_emission[r] * v[j] * inv_s));
+                alpha_max = std::max(alpha_max, crt_alpha[r]);
+                v[j] = 0;
+                reached[j] = false;
+            }
+            Float_Type alpha_min = alpha_max * min_ratio;
+            double s = 0;
+            for (unsigned r = 0; r < n_crt; ++r)
+            {
+                if (crt_alpha[r] > 0 and crt_alpha[r] >= alpha_min)
+                {
+                    _sparse_state.push_back(crt_state[r]);
+                    _sparse_alpha.push_back(crt_alpha[r]);
+                    _sparse_emission.push_back(crt_emission[r]);
+                    s += crt_alpha[r];
+                }
+            }
+            _sparse_begin.push_back(_sparse_state.size());
+            _row_sum_v[i] = s;
+            LOG("Forward_Backward", debug1) << "sparse forward: i=" << i << " reached=" << n_crt
+                                            << " kept=" << _sparse_begin[i + 1] - _sparse_begin[i] << std::endl;
+            if (not (s >= std::numeric_limits< Float_Type >::min() and s <= std::numeric_limits< Float_Type >::max()))
+            {
+                LOG("Forward_Backward", debug) << "sparse forward: row sum out of range at i=" << i
+                                               << " s=" << s << std::endl;
+                return false;
             }
         }
+        fill_scaling_factors();
         //
-        // pr_data
+        // backward: beta; v holds e'_{i+1}(j) beta'_{i+1}(j) for the states kept at event i+1, and 0 elsewhere
         //
-        s.clear();
+        _sparse_beta.assign(_sparse_state.size(), 0);
+        for (unsigned k = _sparse_begin[n_events - 1]; k < _sparse_begin[n_events]; ++k)
+        {
+            _sparse_beta[k] = 1;
+        }
+        for (unsigned i = n_events - 1; i > 0; --i)
+        {
+            for (unsigned k = _sparse_begin[i]; k < _sparse_begin[i + 1]; ++k)
+            {
+                v[_sparse_state[k]] = _sparse_emission[k] * _sparse_beta[k];
+            }
+            Float_Type inv_s = 1.0 / _row_sum_v[i - 1];
+            double s = 0;
+            for (unsigned k = _sparse_begin[i - 1]; k < _sparse_begin[i]; ++k)
+            {
+                unsigned j = _sparse_state[k];
+                Float_Type b = 0;
+                for (unsigned t = _to_begin[j]; t < _to_begin[j + 1]; ++t)
+                {
+                    b += _to_pr[t].second * v[_to_pr[t].first];
+                }
+                _sparse_beta[k] = flush(b * inv_s);
+                s += _sparse_beta[k];
+            }
+            for (unsigned k = _sparse_begin[i]; k < _sparse_begin[i + 1]; ++k)
+            {
+                v[_sparse_state[k]] = 0;
+            }
+            if (not std::isfinite(s))
+            {
+                LOG("Forward_Backward", debug) << "sparse backward: overflow at i=" << i - 1 << std::endl;
+                return false;
+            }
+        }
+        _is_scaled = true;
+        _is_sparse = true;
+        for (unsigned i = n_events; i > 0; --i)
+        {
+            row_fn(i - 1);
+        }
+        return true;
+    }
+
+    // scaled engine: false if a row sum is out of range
+    bool row_sums_ok() const
+    {
+        for (unsigned i = 0; i < _n_events; ++i)
+        {
+            if (not (_row_sum_v[i] >= std::numeric_limits< Float_Type >::min()
+                     and _row_sum_v[i] <= std::numeric_limits< Float_Type >::max()))
+            {
+                LOG("Forward_Backward", debug) << "scaled forward: row sum out of range at i=" << i
+                                               << " s=" << _row_sum_v[i] << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // scaled engines: log factors restoring alpha, beta and pr_data from the row sums and emission shifts
+    void fill_scaling_factors()
+    {
+        unsigned n_events = _n_events;
+        _log_row_sum_v.resize(n_events);
+        _log_alpha_offset_v.resize(n_events);
+        _log_beta_offset_v.resize(n_events);
+        for (unsigned i = 0; i < n_events; ++i)
+        {
+            _log_row_sum_v[i] = std::log(_row_sum_v[i]);
+            _log_alpha_offset_v[i] = (i == 0
+                                      ? -std::log(static_cast< double >(n_states))
+                                      : _log_alpha_offset_v[i - 1] + _log_row_sum_v[i - 1])
+                + _emission_shift_v[i];
+        }
+        _log_beta_offset_v[n_events - 1] = 0;
+        for (unsigned i = n_events - 1; i > 0; --i)
+        {
+            _log_beta_offset_v[i - 1] = _log_beta_offset_v[i] + _log_row_sum_v[i - 1] + _emission_shift_v[i];
+        }
+        _log_pr_data = _log_alpha_offset_v.back() + _log_row_sum_v.back();
+        _posterior_factor = 1.0 / _row_sum_v.back();
+    }
+
+    // values below the normal range are flushed to 0: their relative mass is below exp(-87),
+    // and denormal arithmetic is slow
+    static Float_Type flush(Float_Type x) { return x >= std::numeric_limits< Float_Type >::min()? x : 0; }
+
+    double alpha_row_sum(unsigned i) const
+    {
+        const Float_Type* a = alpha_row(i);
+        double s = 0;
         for (unsigned j = 0; j < n_states; ++j)
         {
-            s.add(cell(ev.size() - 1, j).alpha);
+            s += a[j];
         }
-        _log_pr_data = s.val();
+        return s;
     }
 
-    friend std::ostream& operator << (std::ostream& os, const Forward_Backward& fwbw)
+    void fill_transition_pr(const State_Transitions_Type& st)
     {
-        for (unsigned i = 0; i < fwbw.n_events(); ++i)
+        _from_pr.clear();
+        _to_pr.clear();
+        _from_begin.assign(1, 0);
+        _to_begin.assign(1, 0);
+        for (unsigned j = 0; j < n_states; ++j)
         {
-            for (unsigned j = 0; j < fwbw.n_states; ++j)
+            for (const auto& p : st.neighbours(j).from_v)
             {
-                os << i << '\t' << j << '\t'
-                   << fwbw.cell(i, j).alpha << '\t'
-                   << fwbw.cell(i, j).beta << std::endl;
+                _from_pr.emplace_back(p.first, std::exp(p.second));
+            }
+            _from_begin.push_back(_from_pr.size());
+            for (const auto& p : st.neighbours(j).to_v)
+            {
+                _to_pr.emplace_back(p.first, std::exp(p.second));
+            }
+            _to_begin.push_back(_to_pr.size());
+        }
+        _stay_pr.clear();
+        _step_group_pr.clear();
+        _skip_group_pr.clear();
+        if (not (factorized() and st.has_groups())) return;
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            _stay_pr.push_back(std::exp(st.pattern_weights(0)[j]));
+        }
+        for (unsigned g = 0; g < State_Transitions_Type::n_step_groups; ++g)
+        {
+            for (unsigned b = 0; b < 4; ++b)
+            {
+                _step_group_pr.push_back(std::exp(st.step_group_weights(g)[b]));
+            }
+        }
+        for (unsigned g = 0; g < State_Transitions_Type::n_skip_groups; ++g)
+        {
+            for (unsigned b = 0; b < 16; ++b)
+            {
+                _skip_group_pr.push_back(std::exp(st.skip_group_weights(g)[b]));
             }
         }
-        return os;
     }
 
-private:
-    std::vector< Matrix_Entry > _m;
-    Float_Type _log_pr_data;
+    void copy_transition_pr(const Forward_Backward& other)
+    {
+        _from_pr = other._from_pr;
+        _to_pr = other._to_pr;
+        _from_begin = other._from_begin;
+        _to_begin = other._to_begin;
+        _stay_pr = other._stay_pr;
+        _step_group_pr = other._step_group_pr;
+        _skip_group_pr = other._skip_group_pr;
+    }
+
+    const Float_Type* emission_scaled_row(unsigned i) const
+    {
+        return &_emission_scaled[static_cast< size_t >(i - _emission_scaled_begin) * n_states];
+    }
+
+    // row maxima of the cached emissions, splitting the events across the team
+    void fill_emission_shift()
+    {
+        unsigned i_begin = _emission.row_begin();
+        team().run([&] (unsigned tid) {
+                auto rows = team().range(tid, _emission.row_end() - i_begin);
+                for (unsigned i = i_begin + rows.first; i < i_begin + rows.second; ++i)
+                {
+                    const Float_Type* e = _emission.row(i);
+                    _emission_shift_v[i] = *std::max_element(e, e + n_states);
+                }
+            });
+    }
+
+    // scale the cached emissions of events [i_begin, i_end), splitting the states across the team
+    void fill_emission_scaled(unsigned i_begin, unsigned i_end)
+    {
+        _emission_scaled_begin = i_begin;
+        _emission_scaled.resize(static_cast< size_t >(i_end - i_begin) * n_states);
+        team().run([&] (unsigned tid) {
+                auto r = team().range(tid, n_states, 16);
+                for (unsigned i = i_begin; i < i_end; ++i)
+                {
+                    const Float_Type* e = _emission.row(i);
+                    Float_Type shift = _emission_shift_v[i];
+                    Float_Type* out = &_emission_scaled[static_cast< size_t >(i - i_begin) * n_states];
+                    for (unsigned j = r.first; j < r.second; ++j)
+                    {
+                        out[j] = flush(std::exp(e[j] - shift));
+                    }
+                }
+            });
+    }
+
+    // compute the emissions of the events of segment c and the first event of the next one,
+    // splitting the states across the team; returns false if the table already holds them
+    bool fill_emission(unsigned c)
+    {
+        auto seg = segment(c);
+        unsigned i_end = std::min(_n_events, seg.second + 1);
+        if (_emission.row_begin() == seg.first and _emission.row_end() == i_end)
+        {
+            return false;
+        }
+        _emission.reset(*_pm_ptr, *_ev_ptr, seg.first, i_end);
+        team().run([&] (unsigned tid) {
+                auto r = team().range(tid, n_states, 16);
+                _emission.fill_states(r.first, r.second);
+            });
+        return true;
+    }
+
+    /**
+     * Task-parallel fill of a batch: the jobs are taken from a shared queue, longest first, by
+     * the members of the team, which fill each of them with a team of their own thread only.
+     * A member that is done with a job takes the next one, so short jobs fill in behind long
+     * ones. Each job gets the same results, and the same row_fn calls, as when filled on its own.
+     */
+    static void fill_tasks(std::vector< Batch_Job >& job_v, Thread_Team& team)
+    {
+        std::vector< Batch_Job* > task_v;
+        for (auto& job : job_v)
+        {
+            task_v.push_back(&job);
+        }
+        std::stable_sort(task_v.begin(), task_v.end(), [] (const Batch_Job* lhs, const Batch_Job* rhs) {
+                return lhs->ev_ptr->size() > rhs->ev_ptr->size();
+            });
+        LOG("Forward_Backward", debug1) << "tasks: jobs=" << task_v.size() << " threads=" << team.size() << std::endl;
+        std::atomic< unsigned > next_task(0);
+        team.run([&] (unsigned) {
+                Thread_Team solo;
+                for (unsigned k = next_task++; k < task_v.size(); k = next_task++)
+                {
+                    Batch_Job& job = *task_v[k];
+                    Forward_Backward& fwbw = *job.fwbw_ptr;
+                    Thread_Team* team_ptr = fwbw._team.given();
+                    fwbw._team.set(&solo);
+                    auto row_fn = [&job] (unsigned i) { if (job.row_fn) job.row_fn(i); };
+                    fwbw.fill_rows(*job.pm_ptr, *job.st_ptr, *job.ev_ptr, job.row_fn? 3 : job.ev_ptr->size(), row_fn);
+                    fwbw._team.set(team_ptr);
+                }
+            });
+    }
+
+    Thread_Team& team() { return _team.get(n_threads()); }
 }; // class Forward_Backward
 
 #endif
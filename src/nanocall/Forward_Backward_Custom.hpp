@@ -8,7 +8,7 @@
 
 #include "Pore_Model.hpp"
 #include "State_Transitions.hpp"
-#include "logsumset.hpp"
+#include "Log_Sum.hpp"
 #include "logger.hpp"
 
 template < typename Float_Type, unsigned Kmer_Size = 6 >
@@ -20,7 +20,7 @@ public:
     typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
     typedef Event< Float_Type, Kmer_Size > Event_Type;
     typedef Event_Sequence< Float_Type, Kmer_Size > Event_Sequence_Type;
-    typedef logsum::logsumset< Float_Type > LogSumSet_Type;
+    typedef typename Log_Sum< Float_Type >::Set LogSumSet_Type;
 
     struct Matrix_Entry
     {
@@ -51,8 +51,8 @@ public:
         unsigned n_events = ev.size();
         _m.resize(n_states * n_events);
         Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
-        LogSumSet_Type s1(false);
-        LogSumSet_Type s2(false);
+        LogSumSet_Type s1;
+        LogSumSet_Type s2;
         //
         // forward: alpha, beta; i == 0
         //
@@ -0,0 +1,389 @@
+#ifndef __LOG_SUM_HPP
+#define __LOG_SUM_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NANOCALL_X86_LOG_SUM
+#include <immintrin.h>
+#endif
+
+/**
+ * Log-sum-exp of small sets of log probabilities, such as the 21 predecessors of a 6-mer.
+ *
+ * log_sum(x, n) := log \sum_{k < n} exp(x[k]), computed as m + log \sum_k exp(x[k] - m)
+ * with m the largest value; -INFINITY if n == 0 or all values are -INFINITY. For float,
+ * the maximum and the sum are reduced in registers, 16 (8) values at a time with AVX-512 (AVX2).
+ *
+ * With fast(), exp and log are replaced by polynomial approximations:
+ *   exp(y), y <= 0: Cody-Waite reduction to [-ln2/2, ln2/2] and the degree 7 Cephes polynomial,
+ *     with relative error below 2.5e-7; 0 for y < -87.33, where exp(y) < 1.2e-38
+ *   log(s), s >= 1: reduction to [sqrt(1/2), sqrt(2)) and the atanh series up to degree 9,
+ *     with absolute error below 1e-9
+ * which adds less than 5e-7 to the error of log_sum() for sets of up to 4096 values
+ * (bench-log-sum measures both the error and the speed).
+ *
+ * Set is a drop-in replacement for logsum::logsumset: add() buffers values, and sets of
+ * up to block_size values are reduced by a single call to log_sum().
+ */
+template < typename Float_Type >
+struct Log_Sum
+{
+    static const unsigned block_size = 64;
+
+    // use the polynomial exp and log
+    static bool& fast() { static bool _fast = false; return _fast; }
+
+    // 0: none; 1: AVX2; 2: AVX-512
+    // defaults to the best level supported by the cpu; may be lowered for testing
+    static unsigned& simd_level() { static unsigned _simd_level = detect_simd_level(); return _simd_level; }
+
+    static unsigned detect_simd_level()
+    {
+#ifdef NANOCALL_X86_LOG_SUM
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return 2;
+        if (__builtin_cpu_supports("avx2")) return 1;
+#endif
+        return 0;
+    }
+
+    static Float_Type log_sum(const Float_Type* x, unsigned n)
+    {
+        Float_Type m = max_value(x, n);
+        if (not (m > -INFINITY))
+        {
+            return m;
+        }
+        return m + log(sum_exp(x, n, m));
+    }
+
+    // full blocks are folded into a running maximum m and sum s = \sum exp(x - m)
+    class Set
+    {
+    public:
+        Set() : _m(-INFINITY), _s(0), _n(0) {}
+        void clear() { _m = -INFINITY; _s = 0; _n = 0; }
+        void add(Float_Type x)
+        {
+            if (_n == block_size)
+            {
+                fold(_m, _s);
+                _n = 0;
+            }
+            _buf[_n++] = x;
+        }
+        Float_Type val() const
+        {
+            Float_Type m = _m;
+            double s = _s;
+            fold(m, s);
+            return m > -INFINITY? m + log(s) : m;
+        }
+    private:
+        void fold(Float_Type& m, double& s) const
+        {
+            Float_Type m_buf = max_value(_buf.data(), _n);
+            if (not (m_buf > -INFINITY)) return;
+            double s_buf = sum_exp(_buf.data(), _n, m_buf);
+            if (m_buf > m)
+            {
+                s = s * exp(m - m_buf) + s_buf;
+                m = m_buf;
+            }
+            else
+            {
+                s += s_buf * exp(m_buf - m);
+            }
+        }
+
+        std::array< Float_Type, block_size > _buf;
+        Float_Type _m;
+        double _s;
+        unsigned _n;
+    }; // class Set
+
+    static Float_Type max_value(const Float_Type* x, unsigned n)
+    {
+        Float_Type m;
+        if (max_value_simd(x, n, m))
+        {
+            return m;
+        }
+        m = -INFINITY;
+        for (unsigned k = 0; k < n; ++k)
+        {
+            m = std::max(m, x[k]);
+        }
+        return m;
+    }
+
+    // \sum_k exp(x[k] - m)
+    static double sum_exp(const Float_Type* x, unsigned n, Float_Type m)
+    {
+        double s = 0;
+        if (fast())
+        {
+            if (sum_exp_simd(x, n, m, s))
+            {
+                return s;
+            }
+            for (unsigned k = 0; k < n; ++k)
+            {
+                s += fast_exp(x[k] - m);
+            }
+            return s;
+        }
+        for (unsigned k = 0; k < n; ++k)
+        {
+            s += std::exp(x[k] - m);
+        }
+        return s;
+    }
+
+    static double exp(double y) { return fast()? fast_exp(y) : std::exp(y); }
+    static double log(double s) { return fast()? fast_log(s) : std::log(s); }
+
+    // exp(y), for y <= 0
+    static float fast_exp(float y)
+    {
+        if (y < exp_min()) return 0;
+        float fn = std::floor(y * 1.44269504088896341f + .5f);
+        float r = y - fn * 0.693359375f - fn * -2.12194440e-4f;
+        float p = exp_poly(r);
+        int32_t bits = (static_cast< int32_t >(fn) + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return p * scale;
+    }
+
+    // log(s), for s >= 1
+    static double fast_log(double s)
+    {
+        int e;
+        double f = std::frexp(s, &e);
+        if (f < 0.70710678118654752)
+        {
+            f *= 2;
+            --e;
+        }
+        double z = (f - 1) / (f + 1);
+        double z2 = z * z;
+        return e * 0.69314718055994531
+            + 2 * z * (1 + z2 * (1.0 / 3 + z2 * (1.0 / 5 + z2 * (1.0 / 7 + z2 * (1.0 / 9)))));
+    }
+
+private:
+    static float exp_min() { return -87.33f; }
+    static float exp_poly(float r)
+    {
+        float p = 1.9875691500e-4f;
+        p = p * r + 1.3981999507e-3f;
+        p = p * r + 8.3334519073e-3f;
+        p = p * r + 4.1665795894e-2f;
+        p = p * r + 1.6666665459e-1f;
+        p = p * r + 5.0000001201e-1f;
+        return p * r * r + r + 1;
+    }
+
+    // return false if no kernel is available; there are no kernels for types other than float
+    template < typename T >
+    static bool max_value_simd(const T*, unsigned, T&) { return false; }
+    template < typename T >
+    static bool sum_exp_simd(const T*, unsigned, T, double&) { return false; }
+
+    static bool max_value_simd(const float* x, unsigned n, float& m)
+    {
+#ifdef NANOCALL_X86_LOG_SUM
+        if (simd_level() >= 2)
+        {
+            m = max_value_avx512(x, n);
+            return true;
+        }
+        if (simd_level() >= 1)
+        {
+            m = max_value_avx2(x, n);
+            return true;
+        }
+#else
+        (void)x; (void)n; (void)m;
+#endif
+        return false;
+    }
+
+    static bool sum_exp_simd(const float* x, unsigned n, float m, double& s)
+    {
+#ifdef NANOCALL_X86_LOG_SUM
+        if (simd_level() >= 2)
+        {
+            s = sum_exp_avx512(x, n, m);
+            return true;
+        }
+        if (simd_level() >= 1)
+        {
+            s = sum_exp_avx2(x, n, m);
+            return true;
+        }
+#else
+        (void)x; (void)n; (void)m; (void)s;
+#endif
+        return false;
+    }
+
+#ifdef NANOCALL_X86_LOG_SUM
+    //
+    // AVX2: 8 values per instruction; the tail is loaded under a mask, with -INFINITY elsewhere
+    //
+    __attribute__((target("avx2")))
+    static __m256 load_avx2(const float* x, unsigned n_left)
+    {
+        if (n_left >= 8)
+        {
+            return _mm256_loadu_ps(x);
+        }
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n_left), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        return _mm256_blendv_ps(_mm256_set1_ps(-INFINITY), _mm256_maskload_ps(x, mask), _mm256_castsi256_ps(mask));
+    }
+
+    __attribute__((target("avx2,fma")))
+    static __m256 exp_avx2(__m256 y)
+    {
+        __m256 is_small = _mm256_cmp_ps(y, _mm256_set1_ps(exp_min()), _CMP_LT_OQ);
+        y = _mm256_max_ps(y, _mm256_set1_ps(exp_min()));
+        __m256 fn = _mm256_floor_ps(_mm256_fmadd_ps(y, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(.5f)));
+        __m256 r = _mm256_fnmadd_ps(fn, _mm256_set1_ps(0.693359375f), y);
+        r = _mm256_fnmadd_ps(fn, _mm256_set1_ps(-2.12194440e-4f), r);
+        __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1)));
+        __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fn), _mm256_set1_epi32(127)), 23);
+        return _mm256_andnot_ps(is_small, _mm256_mul_ps(p, _mm256_castsi256_ps(bits)));
+    }
+
+    // horizontal maximum and sum of the 8 values of v
+    __attribute__((target("avx2")))
+    static float reduce_max_avx2(__m256 v)
+    {
+        __m128 h = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+        h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+        return _mm_cvtss_f32(h);
+    }
+
+    __attribute__((target("avx2")))
+    static float reduce_add_avx2(__m256 v)
+    {
+        __m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+        h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+        return _mm_cvtss_f32(h);
+    }
+
+    __attribute__((target("avx2")))
+    static float max_value_avx2(const float* x, unsigned n)
+    {
+        __m256 v = _mm256_set1_ps(-INFINITY);
+        for (unsigned k = 0; k < n; k += 8)
+        {
+            v = _mm256_max_ps(v, load_avx2(x + k, n - k));
+        }
+        return reduce_max_avx2(v);
+    }
+
+    __attribute__((target("avx2,fma")))
+    static double sum_exp_avx2(const float* x, unsigned n, float m)
+    {
+        __m256 vm = _mm256_set1_ps(m);
+        __m256 s = _mm256_setzero_ps();
+        for (unsigned k = 0; k < n; k += 8)
+        {
+            s = _mm256_add_ps(s, exp_avx2(_mm256_sub_ps(load_avx2(x + k, n - k), vm)));
+        }
+        return reduce_add_avx2(s);
+    }
+
+    //
+    // AVX-512: 16 values per instruction; the tail is loaded under a mask, with -INFINITY elsewhere.
+    // Intrinsics whose results start out undefined are used in their maskz_ forms with a full mask,
+    // as in Viterbi_Kernel, so that GCC does not warn about uninitialized values.
+    //
+    __attribute__((target("avx512f")))
+    static __m512 load_avx512(const float* x, unsigned n_left)
+    {
+        if (n_left >= 16)
+        {
+            return _mm512_loadu_ps(x);
+        }
+        __mmask16 mask = static_cast< __mmask16 >((1u << n_left) - 1);
+        return _mm512_mask_loadu_ps(_mm512_set1_ps(-INFINITY), mask, x);
+    }
+
+    // lower and upper 8 values of v
+    __attribute__((target("avx512f")))
+    static __m256 low_avx512(__m512 v)
+    {
+        return _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, _mm512_castps_pd(v), 0));
+    }
+
+    __attribute__((target("avx512f")))
+    static __m256 high_avx512(__m512 v)
+    {
+        return _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, _mm512_castps_pd(v), 1));
+    }
+
+    __attribute__((target("avx512f")))
+    static __m512 exp_avx512(__m512 y)
+    {
+        __mmask16 is_small = _mm512_cmp_ps_mask(y, _mm512_set1_ps(exp_min()), _CMP_LT_OQ);
+        y = _mm512_maskz_max_ps(0xFFFF, y, _mm512_set1_ps(exp_min()));
+        __m512 fn = _mm512_maskz_roundscale_ps(0xFFFF,
+                                               _mm512_fmadd_ps(y, _mm512_set1_ps(1.44269504088896341f), _mm512_set1_ps(.5f)),
+                                               _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        __m512 r = _mm512_fnmadd_ps(fn, _mm512_set1_ps(0.693359375f), y);
+        r = _mm512_fnmadd_ps(fn, _mm512_set1_ps(-2.12194440e-4f), r);
+        __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+        p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1)));
+        __m512i bits = _mm512_maskz_slli_epi32(
+            0xFFFF, _mm512_add_epi32(_mm512_maskz_cvtps_epi32(0xFFFF, fn), _mm512_set1_epi32(127)), 23);
+        return _mm512_maskz_mul_ps(static_cast< __mmask16 >(~is_small), p, _mm512_castsi512_ps(bits));
+    }
+
+    __attribute__((target("avx512f")))
+    static float max_value_avx512(const float* x, unsigned n)
+    {
+        __m512 v = _mm512_set1_ps(-INFINITY);
+        for (unsigned k = 0; k < n; k += 16)
+        {
+            v = _mm512_maskz_max_ps(0xFFFF, v, load_avx512(x + k, n - k));
+        }
+        return reduce_max_avx2(_mm256_max_ps(low_avx512(v), high_avx512(v)));
+    }
+
+    __attribute__((target("avx512f")))
+    static double sum_exp_avx512(const float* x, unsigned n, float m)
+    {
+        __m512 vm = _mm512_set1_ps(m);
+        __m512 s = _mm512_setzero_ps();
+        for (unsigned k = 0; k < n; k += 16)
+        {
+            s = _mm512_add_ps(s, exp_avx512(_mm512_sub_ps(load_avx512(x + k, n - k), vm)));
+        }
+        return reduce_add_avx2(_mm256_add_ps(low_avx512(s), high_avx512(s)));
+    }
+#endif
+}; // struct Log_Sum
+
+#endif
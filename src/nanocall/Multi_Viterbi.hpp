@@ -0,0 +1,166 @@
+#ifndef __MULTI_VITERBI_HPP
+#define __MULTI_VITERBI_HPP
+
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "Pore_Model.hpp"
+#include "Emission_Table.hpp"
+#include "State_Transitions.hpp"
+#include "Thread_Team.hpp"
+#include "Viterbi_Kernel.hpp"
+#include "logger.hpp"
+
+/**
+ * Score-only Viterbi for several pore models sharing the same state transitions.
+ *
+ * The models advance in lockstep over the events: their alpha rows are
+ * interleaved (see Viterbi_Kernel::multi_offset()), so one pass over the
+ * transitions serves all models. path_probability(m) is identical to
+ * Viterbi::fill_score() with the m-th model.
+ */
+template < typename Float_Type, unsigned Kmer_Size = 6 >
+class Multi_Viterbi
+{
+public:
+    typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
+    typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
+    typedef Event_Sequence< Float_Type, Kmer_Size > Event_Sequence_Type;
+    typedef Viterbi_Kernel< Float_Type, Kmer_Size > Viterbi_Kernel_Type;
+    typedef Emission_Table< Float_Type, Kmer_Size > Emission_Table_Type;
+
+    static const unsigned n_states = Pore_Model_Type::n_states;
+    static const unsigned block_size = Viterbi_Kernel_Type::multi_block_size;
+
+    Multi_Viterbi() : _n_models(0) {}
+
+    unsigned n_models() const { return _n_models; }
+    Float_Type path_probability(unsigned m) const { return _path_probability_v[m]; }
+
+    // the state loop of every event is split across the threads of a team, see Thread_Team_Handle
+    static unsigned& n_threads() { static unsigned _n_threads = 1; return _n_threads; }
+    void set_thread_team(Thread_Team* team_ptr) { _team.set(team_ptr); }
+
+    // drift_v[m]: drift correction not yet applied to the events, for model m
+    void fill_score(const std::vector< const Pore_Model_Type* >& pm_ptr_v,
+                    const std::vector< Float_Type >& drift_v,
+                    const State_Transitions_Type& st,
+                    const Event_Sequence_Type& ev)
+    {
+        assert(drift_v.size() == pm_ptr_v.size());
+        _n_models = pm_ptr_v.size();
+        unsigned n_events = ev.size();
+        size_t row_size = static_cast< size_t >(n_states) * n_models();
+        _alpha[0].resize(row_size);
+        _alpha[1].resize(row_size);
+        _emission_v.resize(n_models());
+        _emission_row_v.resize(static_cast< size_t >(Emission_Table_Type::block_rows()) * n_models());
+        //
+        // i == 0
+        //
+        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+        for (unsigned m = 0; m < n_models(); ++m)
+        {
+            _emission_v[m].fill(*pm_ptr_v[m], ev, 0, 1, drift_v[m]);
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                _alpha[0][offset(j, m)] = _emission_v[m].at(0, j) - log_n_states;
+            }
+        }
+        //
+        // i > 0, one block of emissions at a time
+        //
+        for (unsigned i_block = 1; i_block < n_events; i_block += Emission_Table_Type::block_rows())
+        {
+            unsigned i_block_end = std::min(n_events, i_block + Emission_Table_Type::block_rows());
+            for (unsigned m = 0; m < n_models(); ++m)
+            {
+                _emission_v[m].reset(*pm_ptr_v[m], ev, i_block, i_block_end, drift_v[m]);
+                for (unsigned i = i_block; i < i_block_end; ++i)
+                {
+                    _emission_row_v[(i - i_block) * n_models() + m] = _emission_v[m].row(i);
+                }
+            }
+            team().run([&] (unsigned tid) {
+                    auto r = team().range(tid, n_states, block_size);
+                    for (auto& emission : _emission_v)
+                    {
+                        emission.fill_states(r.first, r.second);
+                    }
+                });
+            team().for_each_row(
+                i_block_end - i_block, n_states, block_size,
+                [&] (unsigned r, unsigned j_begin, unsigned j_end) {
+                    unsigned i = i_block + r;
+                    fill_row(st, i, _emission_row_v.data() + static_cast< size_t >(r) * n_models(),
+                             _alpha[(i - 1) % 2].data(), _alpha[i % 2].data(), j_begin, j_end);
+                },
+                [] (unsigned) {});
+        }
+        //
+        // path probabilities
+        //
+        const auto& alpha_last = _alpha[(n_events - 1) % 2];
+        _path_probability_v.assign(n_models(), -INFINITY);
+        for (unsigned m = 0; m < n_models(); ++m)
+        {
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                if (alpha_last[offset(j, m)] > _path_probability_v[m])
+                {
+                    _path_probability_v[m] = alpha_last[offset(j, m)];
+                }
+            }
+        }
+    }
+
+private:
+    std::array< std::vector< Float_Type >, 2 > _alpha;
+    std::vector< Emission_Table_Type > _emission_v;
+    // emission rows of the current block, for event i_block + r and model m at r * n_models() + m
+    std::vector< const Float_Type* > _emission_row_v;
+    std::vector< Float_Type > _path_probability_v;
+    unsigned _n_models;
+    Thread_Team_Handle _team;
+
+    size_t offset(unsigned j, unsigned m) const { return Viterbi_Kernel_Type::multi_offset(n_models(), j, m); }
+
+    Thread_Team& team() { return _team.get(n_threads()); }
+
+    void fill_row(const State_Transitions_Type& st,
+                  unsigned i,
+                  const Float_Type* const* emission_rows,
+                  const Float_Type* alpha_prev, Float_Type* alpha_crt,
+                  unsigned j_begin, unsigned j_end)
+    {
+        LOG("Viterbi", debug1) << "forward: i=" << i << " j=[" << j_begin << "," << j_end << ")"
+                               << " models=" << n_models() << std::endl;
+        if (st.has_pattern()
+            and Viterbi_Kernel_Type::max_row_multi(st, n_models(), alpha_prev, alpha_crt, emission_rows,
+                                                   j_begin, j_end))
+        {
+            return;
+        }
+        for (unsigned j = j_begin; j < j_end; ++j)
+        {
+            const auto& from_v = st.neighbours(j).from_v;
+            for (unsigned m = 0; m < n_models(); ++m)
+            {
+                Float_Type v_max = -INFINITY;
+                for (const auto& p : from_v)
+                {
+                    Float_Type v = p.second + alpha_prev[offset(p.first, m)];
+                    if (v > v_max)
+                    {
+                        v_max = v;
+                    }
+                }
+                alpha_crt[offset(j, m)] = v_max + emission_rows[m][j];
+            }
+        }
+    }
+}; // class Multi_Viterbi
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef __PARAMETER_POOL_HPP
+#define __PARAMETER_POOL_HPP
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <string>
+#include <tuple>
+
+#include "Pore_Model.hpp"
+#include "State_Transitions.hpp"
+
+/**
+ * Trained parameters of the last read of every run and channel, per model, used to start
+ * the training of later reads from the same run or channel.
+ *
+ * All keys are added by add_key() before the pool is shared. After that, get() and put()
+ * can be called from any thread, and neither takes a lock: every slot is a sequence lock
+ * over atomic values. A put() that finds its slot being written by another thread is
+ * dropped, and a get() that overlaps a put() reads the slot again.
+ */
+template < typename Float_Type >
+class Parameter_Pool
+{
+public:
+    typedef Pore_Model_Parameters< Float_Type > Pore_Model_Parameters_Type;
+    typedef State_Transition_Parameters< Float_Type > State_Transition_Parameters_Type;
+    typedef std::array< State_Transition_Parameters_Type, 2 > State_Transition_Parameters_Pair;
+    typedef std::array< std::string, 2 > Model_Key;
+
+    void add_key(const std::string& run_id, const std::string& channel_id, const Model_Key& m_name)
+    {
+        _slot_m[std::make_tuple(run_id, std::string(), m_name)];
+        _slot_m[std::make_tuple(run_id, channel_id, m_name)];
+    }
+
+    // parameters of the channel, or else of the run; false if neither was trained yet
+    bool get(const std::string& run_id, const std::string& channel_id, const Model_Key& m_name,
+             Pore_Model_Parameters_Type& pm_params, State_Transition_Parameters_Pair& st_params) const
+    {
+        return get_slot(run_id, channel_id, m_name, pm_params, st_params)
+            or get_slot(run_id, std::string(), m_name, pm_params, st_params);
+    }
+
+    void put(const std::string& run_id, const std::string& channel_id, const Model_Key& m_name,
+             const Pore_Model_Parameters_Type& pm_params, const State_Transition_Parameters_Pair& st_params)
+    {
+        put_slot(run_id, channel_id, m_name, pm_params, st_params);
+        put_slot(run_id, std::string(), m_name, pm_params, st_params);
+    }
+
+private:
+    static const unsigned n_values = 10;
+
+    struct Slot
+    {
+        // even: stable; odd: being written; 0: never written
+        std::atomic< unsigned > version;
+        std::array< std::atomic< Float_Type >, n_values > value_v;
+
+        Slot() : version(0)
+        {
+            for (auto& v : value_v)
+            {
+                v.store(0, std::memory_order_relaxed);
+            }
+        }
+    }; // struct Slot
+
+    typedef std::tuple< std::string, std::string, Model_Key > Slot_Key;
+
+    bool get_slot(const std::string& run_id, const std::string& channel_id, const Model_Key& m_name,
+                  Pore_Model_Parameters_Type& pm_params, State_Transition_Parameters_Pair& st_params) const
+    {
+        auto it = _slot_m.find(std::make_tuple(run_id, channel_id, m_name));
+        if (it == _slot_m.end()) return false;
+        const Slot& slot = it->second;
+        std::array< Float_Type, n_values > val;
+        while (true)
+        {
+            unsigned v = slot.version.load(std::memory_order_acquire);
+            if (v == 0) return false;
+            if (v % 2 == 1) continue;
+            for (unsigned k = 0; k < n_values; ++k)
+            {
+                val[k] = slot.value_v[k].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.version.load(std::memory_order_relaxed) == v) break;
+        }
+        pm_params.scale = val[0];
+        pm_params.shift = val[1];
+        pm_params.drift = val[2];
+        pm_params.var = val[3];
+        pm_params.scale_sd = val[4];
+        pm_params.var_sd = val[5];
+        for (unsigned st = 0; st < 2; ++st)
+        {
+            st_params[st].p_stay = val[6 + 2 * st];
+            st_params[st].p_skip = val[7 + 2 * st];
+        }
+        return true;
+    }
+
+    void put_slot(const std::string& run_id, const std::string& channel_id, const Model_Key& m_name,
+                  const Pore_Model_Parameters_Type& pm_params, const State_Transition_Parameters_Pair& st_params)
+    {
+        auto it = _slot_m.find(std::make_tuple(run_id, channel_id, m_name));
+        if (it == _slot_m.end()) return;
+        Slot& slot = it->second;
+        unsigned v = slot.version.load(std::memory_order_relaxed);
+        if (v % 2 == 1 or not slot.version.compare_exchange_strong(v, v + 1, std::memory_order_acquire))
+        {
+            // another thread is writing this slot; its parameters are as recent as ours
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        std::array< Float_Type, n_values > val = {{
+                pm_params.scale, pm_params.shift, pm_params.drift, pm_params.var, pm_params.scale_sd, pm_params.var_sd,
+                st_params[0].p_stay, st_params[0].p_skip, st_params[1].p_stay, st_params[1].p_skip }};
+        for (unsigned k = 0; k < n_values; ++k)
+        {
+            slot.value_v[k].store(val[k], std::memory_order_relaxed);
+        }
+        slot.version.store(v + 2, std::memory_order_release);
+    }
+
+    std::map< Slot_Key, Slot > _slot_m;
+}; // class Parameter_Pool
+
+#endif
@@ -1,7 +1,9 @@
 #ifndef __PARAMETER_TRAINER
 #define __PARAMETER_TRAINER
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <vector>
 #include <map>
 
@@ -9,7 +11,9 @@
 #include "Pore_Model.hpp"
 #include "State_Transitions.hpp"
 #include "Forward_Backward.hpp"
-#include "logsumset.hpp"
+#include "Viterbi.hpp"
+#include "Thread_Team.hpp"
+#include "Log_Sum.hpp"
 #include "logger.hpp"
 
 template < typename Float_Type, unsigned Kmer_Size = 6 >
@@ -23,7 +27,8 @@ struct Parameter_Trainer
     typedef Event< Float_Type, Kmer_Size > Event_Type;
     typedef Event_Sequence< Float_Type, Kmer_Size > Event_Sequence_Type;
     typedef Forward_Backward< Float_Type, Kmer_Size > Forward_Backward_Type;
-    typedef logsum::logsumset< Float_Type > LogSumSet_Type;
+    typedef Viterbi< Float_Type, Kmer_Size > Viterbi_Type;
+    typedef typename Log_Sum< Float_Type >::Set LogSumSet_Type;
 
     static const unsigned n_states = Pore_Model_Type::n_states;
 
@@ -62,6 +67,72 @@ struct Parameter_Trainer
         return _st_train_kmers;
     }
 
+    // accumulate the training statistics of each read during its backward pass,
+    // instead of keeping its forward-backward table for the whole round
+    static bool& fused() { static bool _fused = false; return _fused; }
+
+    // hard EM: train on the Viterbi path of each read instead of the forward-backward posteriors;
+    // the fit of a round is then the log probability of the path, not of the data
+    static bool& viterbi_training() { static bool _viterbi_training = false; return _viterbi_training; }
+
+    /**
+     * Statistics for pm_params training, summed over events.
+     * Against unscaled pm & uncorrected events; see train_pm_params.
+     */
+    struct Pm_Stats
+    {
+        std::array< std::array< double, 3 >, 3 > A;
+        std::array< double, 3 > B;
+        double D;       // = \sum_i x^2_i s_{i,0} (used for var)
+        double V_numer; // = \sum_i y_i \sum_j p_{i,j} \lambda_j / \eta^2_j (for scale_sd)
+        double V_denom; // = \sum_i \sum_j p_{i,j} \lambda_j / \eta_j (for scale_sd)
+        double U_pos;   // = \sum_i (1/y_i) \sum_j p_{i,j} \lambda_j (for var_sd)
+        unsigned n_events;
+
+        Pm_Stats() : D(0.0), V_numer(0.0), V_denom(0.0), U_pos(0.0), n_events(0)
+        {
+            for (auto& a : A)
+            {
+                a.fill(0.0);
+            }
+            B.fill(0.0);
+        }
+
+        void add(const Pm_Stats& other)
+        {
+            for (unsigned i = 0; i < 3; ++i)
+            {
+                for (unsigned j = 0; j < 3; ++j)
+                {
+                    A[i][j] += other.A[i][j];
+                }
+                B[i] += other.B[i];
+            }
+            D += other.D;
+            V_numer += other.V_numer;
+            V_denom += other.V_denom;
+            U_pos += other.U_pos;
+            n_events += other.n_events;
+        }
+    }; // struct Pm_Stats
+
+    /**
+     * Statistics for st_params training, summed over events and st_train_kmers().
+     */
+    struct St_Stats
+    {
+        LogSumSet_Type p_stay_num;
+        LogSumSet_Type p_skip_num;
+        LogSumSet_Type denom;
+
+        void add(const St_Stats& other)
+        {
+            p_stay_num.add(other.p_stay_num.val());
+            p_skip_num.add(other.p_skip_num.val());
+            denom.add(other.denom.val());
+        }
+    }; // struct St_Stats
+
     /**
      * Struct used for training rounds.
      * @event_seq_ptr_v Vector of pairs, first: an event sequence, second: strand from which it comes
@@ -69,6 +140,8 @@ struct Parameter_Trainer
      * @default_transitions_ptr Default state transitions
      * @pm_params_ptr Pore model scaling parameters (common to both strands)
      * @st_params_ptr_v State transition parameters (per strand)
+     * @train_scaling, @train_transitions Statistics to accumulate in fused mode
+     * @team_ptr Thread team used by the forward-backward passes, or null
      */
     struct Train_Data
     {
@@ -78,19 +151,78 @@ struct Parameter_Trainer
         const State_Transitions_Type* default_transitions_ptr;
         const Pore_Model_Parameters_Type* pm_params_ptr;
         std::array< const State_Transition_Parameters_Type*, 2 > st_params_ptr_v;
+        bool train_scaling;
+        bool train_transitions;
+        Thread_Team* team_ptr;
         // output
         std::array< Pore_Model_Type, 2 > scaled_model_v;
         std::array< State_Transitions_Type, 2 > custom_transitions_v;
         std::array< const State_Transitions_Type*, 2 > transitions_ptr_v;
         std::vector< Event_Sequence_Type > corrected_event_seq_v;
+        // one per event sequence; empty in fused mode
         std::vector< Forward_Backward_Type > fwbw_v;
+        // filled only in fused mode
+        Pm_Stats pm_stats;
+        std::array< St_Stats, 2 > st_stats;
         Float_Type fit;
     };
 
     /**
-     * Fill training data for one training round.
+     * Streaming fill of one event sequence in fused mode: add_stats(i) adds the statistics
+     * of event i, starting over at the last event, as the backward pass does.
      */
-    static void fill_train_data(Train_Data& data)
+    struct Fused_Job
+    {
+        const Train_Data* data_ptr;
+        unsigned st;
+        Forward_Backward_Type* fwbw_ptr;
+        Pm_Stats* pm_stats_ptr;
+        St_Stats* st_stats_ptr;
+        const Event_Sequence_Type* events_ptr;
+
+        void add_stats(unsigned i) const
+        {
+            unsigned n_events = events_ptr->size();
+            if (i == n_events - 1)
+            {
+                *pm_stats_ptr = Pm_Stats();
+                *st_stats_ptr = St_Stats();
+            }
+            if (data_ptr->train_scaling)
+            {
+                add_pm_stats(*pm_stats_ptr, *fwbw_ptr, *data_ptr->model_ptr_v[st], *events_ptr, i);
+            }
+            if (data_ptr->train_transitions and i < n_events - 1)
+            {
+                add_st_stats(*st_stats_ptr, *fwbw_ptr, *data_ptr->st_params_ptr_v[st], i);
+            }
+        }
+    }; // struct Fused_Job
+
+    /**
+     * Training buffers of one thread, kept across rounds and reads: scaled models, transitions,
+     * corrected events and forward-backward tables are recomputed in place, and memory is only
+     * allocated when a round needs more than all the previous rounds of the thread.
+     */
+    struct Workspace
+    {
+        std::vector< Train_Data > data_v;
+        std::vector< Train_Data* > data_ptr_v;
+        std::vector< typename Forward_Backward_Type::Batch_Job > job_v;
+        std::vector< Forward_Backward_Type > fused_fwbw_v;
+        std::vector< Fused_Job > fused_job_v;
+        std::vector< Pm_Stats > fused_pm_stats_v;
+        std::vector< St_Stats > fused_st_stats_v;
+        Viterbi_Type vit;
+    }; // struct Workspace
+
+    static Workspace& workspace() { static thread_local Workspace _workspace; return _workspace; }
+
+    /**
+     * Prepare training data for one training round: scaled pore models, transitions, and
+     * drift-corrected event sequences; reset the outputs of the forward-backward passes.
+     */
+    static void prepare_train_data(Train_Data& data)
     {
         // compute scaled pore models
         data.scaled_model_v[0].clear();
@@ -106,9 +238,7 @@ struct Parameter_Trainer
             data.scaled_model_v[p.second].scale(*data.pm_params_ptr);
             init_scaled_models[p.second] = true;
         }
-        // compute custom state transitions
-        data.custom_transitions_v[0].clear();
-        data.custom_transitions_v[1].clear();
+        // compute custom state transitions, in place
         std::array< bool, 2 > init_transitions = {{ false, false }};
         for (const auto& p : data.event_seq_ptr_v)
         {
@@ -126,93 +256,319 @@ struct Parameter_Trainer
             init_transitions[p.second] = true;
         }
         // compute drift-corrected event sequences
+        // (copies reuse the buffers of the previous round in this workspace)
         unsigned n_event_seqs = data.event_seq_ptr_v.size();
-        data.corrected_event_seq_v.clear();
-        data.corrected_event_seq_v.reserve(n_event_seqs);
-        data.fwbw_v.clear();
-        data.fwbw_v.reserve(n_event_seqs);
-        data.fit = 0.0;
+        data.corrected_event_seq_v.resize(n_event_seqs);
         for (unsigned k = 0; k < n_event_seqs; ++k)
         {
-            unsigned st = data.event_seq_ptr_v[k].second;
-            ASSERT(init_scaled_models[st]);
-            ASSERT(init_transitions[st]);
+            ASSERT(init_scaled_models[data.event_seq_ptr_v[k].second]);
+            ASSERT(init_transitions[data.event_seq_ptr_v[k].second]);
             // first, copy events
-            data.corrected_event_seq_v.emplace_back(*data.event_seq_ptr_v[k].first);
+            data.corrected_event_seq_v[k] = *data.event_seq_ptr_v[k].first;
             // then, apply drift correction
-            data.corrected_event_seq_v.back().apply_drift_correction(data.pm_params_ptr->drift);
-            // finally, run fwbw
-            data.fwbw_v.emplace_back();
-            data.fwbw_v.back().fill(
-                data.scaled_model_v[st], *data.transitions_ptr_v[st], data.corrected_event_seq_v.back());
-            data.fit += data.fwbw_v.back().log_pr_data();
+            data.corrected_event_seq_v[k].apply_drift_correction(data.pm_params_ptr->drift);
         }
-#ifdef DUMP_TRAINING_DATA
-        for (unsigned k = 0; k < n_event_seqs; ++k)
+        // one table per event sequence, filled by fill_train_data; none in fused mode
+        data.fwbw_v.resize(fused() or viterbi_training()? 0 : n_event_seqs);
+        data.pm_stats = Pm_Stats();
+        data.st_stats = std::array< St_Stats, 2 >();
+        data.fit = 0.0;
+    }
+
+    /**
+     * Fill training data for one training round.
+     */
+    static void fill_train_data(Train_Data& data)
+    {
+        std::vector< Train_Data* > data_ptr_v(1, &data);
+        fill_train_data(data_ptr_v);
+    }
+
+    /**
+     * Fill training data for several training rounds, such as those of the candidate models of a read.
+     * The forward-backward passes of all event sequences of all rounds run as one batch,
+     * see Forward_Backward::fill_batch(). Unless fused(), the tables of all rounds are kept at once;
+     * train_rounds() then fills one round at a time.
+     */
+    static void fill_train_data(const std::vector< Train_Data* >& data_ptr_v)
+    {
+        unsigned n_jobs = 0;
+        for (auto data_ptr : data_ptr_v)
         {
-            unsigned st = data.event_seq_ptr_v[k].second;
-            unsigned n_events = data.event_seq_ptr_v[k].first->size();
-            std::ostringstream k_sstr;
-            k_sstr << k;
-            std::ofstream ofs;
-            ofs.open(std::string("emissions.") + k_sstr.str() + ".tab");
-            for (unsigned i = 0; i < n_events; ++i)
-            {
-                for (unsigned j = 0; j < n_states; ++j)
+            prepare_train_data(*data_ptr);
+            n_jobs += data_ptr->event_seq_ptr_v.size();
+        }
+        if (viterbi_training())
+        {
+            for (auto data_ptr : data_ptr_v)
+            {
+                fill_train_data_viterbi(*data_ptr);
+            }
+            return;
+        }
+        Workspace& ws = workspace();
+        auto& job_v = ws.job_v;
+        job_v.resize(n_jobs);
+        // fused: one streaming table per event sequence; the statistics of the first event sequence
+        // of each round go straight to the round, those of the others are added when the batch is done
+        if (fused())
+        {
+            // only grow the buffers, to keep the tables of the largest batch so far
+            ws.fused_fwbw_v.resize(std::max< size_t >(ws.fused_fwbw_v.size(), n_jobs));
+            ws.fused_job_v.resize(n_jobs);
+            ws.fused_pm_stats_v.resize(n_jobs);
+            ws.fused_st_stats_v.resize(n_jobs);
+        }
+        unsigned idx = 0;
+        for (auto data_ptr : data_ptr_v)
+        {
+            Train_Data& data = *data_ptr;
+            for (unsigned k = 0; k < data.event_seq_ptr_v.size(); ++k, ++idx)
+            {
+                unsigned st = data.event_seq_ptr_v[k].second;
+                auto& job = job_v[idx];
+                job.pm_ptr = &data.scaled_model_v[st];
+                job.st_ptr = data.transitions_ptr_v[st];
+                job.ev_ptr = &data.corrected_event_seq_v[k];
+                if (not fused())
+                {
+                    job.fwbw_ptr = &data.fwbw_v[k];
+                    job.fwbw_ptr->set_thread_team(data.team_ptr);
+                    job.row_fn = nullptr;
+                    continue;
+                }
+                // fused: accumulate the statistics as the posteriors become available;
+                // if fwbw restarts the backward pass, so do the statistics of this read
+                Fused_Job& fused_job = ws.fused_job_v[idx];
+                fused_job.data_ptr = data_ptr;
+                fused_job.st = st;
+                fused_job.fwbw_ptr = &ws.fused_fwbw_v[idx];
+                fused_job.pm_stats_ptr = k == 0? &data.pm_stats : &ws.fused_pm_stats_v[idx];
+                fused_job.st_stats_ptr = k == 0? &data.st_stats[st] : &ws.fused_st_stats_v[idx];
+                fused_job.events_ptr = data.event_seq_ptr_v[k].first;
+                *fused_job.pm_stats_ptr = Pm_Stats();
+                *fused_job.st_stats_ptr = St_Stats();
+                fused_job.fwbw_ptr->set_thread_team(data.team_ptr);
+                job.fwbw_ptr = fused_job.fwbw_ptr;
+                // capture a single pointer, which std::function stores without allocating
+                const Fused_Job* fused_job_ptr = &fused_job;
+                job.row_fn = [fused_job_ptr] (unsigned i) { fused_job_ptr->add_stats(i); };
+            }
+        }
+        Forward_Backward_Type::fill_batch(job_v);
+        idx = 0;
+        for (auto data_ptr : data_ptr_v)
+        {
+            Train_Data& data = *data_ptr;
+            unsigned n_event_seqs = data.event_seq_ptr_v.size();
+            for (unsigned k = 0; k < n_event_seqs; ++k, ++idx)
+            {
+                data.fit += job_v[idx].fwbw_ptr->log_pr_data();
+                if (fused() and k > 0)
                 {
-                    if (j > 0) ofs << '\t';
-                    ofs << data.scaled_model_v[st].log_pr_corrected_emission(j, data.corrected_event_seq_v[k][i]);
+                    data.pm_stats.add(ws.fused_pm_stats_v[idx]);
+                    data.st_stats[data.event_seq_ptr_v[k].second].add(ws.fused_st_stats_v[idx]);
                 }
-                ofs << std::endl;
             }
-            ofs.close();
-            ofs.open(std::string("transitions.") + k_sstr.str() + ".tab");
-            for (unsigned j1 = 0; j1 < n_states; ++j1)
+#ifdef DUMP_TRAINING_DATA
+            ASSERT(not fused());
+            for (unsigned k = 0; k < n_event_seqs; ++k)
             {
-                std::map< unsigned, Float_Type > neighbour_m;
-                for (const auto& p : data.transitions_ptr_v[st]->neighbours(j1).to_v)
+                unsigned st = data.event_seq_ptr_v[k].second;
+                unsigned n_events = data.event_seq_ptr_v[k].first->size();
+                std::ostringstream k_sstr;
+                k_sstr << k;
+                std::ofstream ofs;
+                ofs.open(std::string("emissions.") + k_sstr.str() + ".tab");
+                for (unsigned i = 0; i < n_events; ++i)
                 {
-                    neighbour_m[p.first] = p.second;
+                    for (unsigned j = 0; j < n_states; ++j)
+                    {
+                        if (j > 0) ofs << '\t';
+                        ofs << data.fwbw_v[k].emission().at(i, j);
+                    }
+                    ofs << std::endl;
+                }
+                ofs.close();
+                ofs.open(std::string("transitions.") + k_sstr.str() + ".tab");
+                for (unsigned j1 = 0; j1 < n_states; ++j1)
+                {
+                    std::map< unsigned, Float_Type > neighbour_m;
+                    for (const auto& p : data.transitions_ptr_v[st]->neighbours(j1).to_v)
+                    {
+                        neighbour_m[p.first] = p.second;
+                    }
+                    for (unsigned j2 = 0; j2 < n_states; ++j2)
+                    {
+                        if (j2 > 0) ofs << '\t';
+                        if (neighbour_m.count(j2))
+                        {
+                            ofs << neighbour_m.at(j2);
+                        }
+                        else
+                        {
+                            ofs << -1000.0;
+                        }
+                    }
+                    ofs << std::endl;
                 }
-                for (unsigned j2 = 0; j2 < n_states; ++j2)
+                ofs.close();
+                ofs.open(std::string("fw.") + k_sstr.str() + ".tab");
+                for (unsigned i = 0; i < n_events; ++i)
                 {
-                    if (j2 > 0) ofs << '\t';
-                    if (neighbour_m.count(j2))
+                    for (unsigned j = 0; j < n_states; ++j)
                     {
-                        ofs << neighbour_m.at(j2);
+                        if (j > 0) ofs << '\t';
+                        ofs << data.fwbw_v[k].log_alpha(i, j);
                     }
-                    else
+                    ofs << std::endl;
+                }
+                ofs.close();
+                ofs.open(std::string("bw.") + k_sstr.str() + ".tab");
+                for (unsigned i = 0; i < n_events; ++i)
+                {
+                    for (unsigned j = 0; j < n_states; ++j)
                     {
-                        ofs << -1000.0;
+                        if (j > 0) ofs << '\t';
+                        ofs << data.fwbw_v[k].log_beta(i, j);
                     }
+                    ofs << std::endl;
+                }
+            }
+            abort();
+#endif
+        } // for data_ptr
+    }
+
+    /**
+     * Fill training data for one round of Viterbi training: the statistics are accumulated
+     * over the Viterbi path of each event sequence, and no forward-backward table is kept.
+     */
+    static void fill_train_data_viterbi(Train_Data& data)
+    {
+        Viterbi_Type& vit = workspace().vit;
+        vit.set_thread_team(data.team_ptr);
+        for (unsigned k = 0; k < data.event_seq_ptr_v.size(); ++k)
+        {
+            unsigned st = data.event_seq_ptr_v[k].second;
+            const Event_Sequence_Type& events = *data.event_seq_ptr_v[k].first;
+            // the path is stored in the corrected events
+            Event_Sequence_Type& path = data.corrected_event_seq_v[k];
+            vit.fill(data.scaled_model_v[st], *data.transitions_ptr_v[st], path);
+            data.fit += vit.path_probability();
+            for (unsigned i = 0; i < path.size(); ++i)
+            {
+                if (data.train_scaling)
+                {
+                    add_pm_stats(data.pm_stats, *data.model_ptr_v[st], events, i, path[i].model_state_idx);
+                }
+                if (data.train_transitions and i + 1 < path.size())
+                {
+                    add_st_stats(data.st_stats[st], path, i);
+                }
+            }
+        }
+    }
+
+    /**
+     * Add the contribution of event i to the pm_params statistics.
+     * @fwbw Forward-backward table of the event sequence, or one streaming at event i.
+     * @pm Unscaled pore model.
+     * @events Uncorrected events.
+     */
+    static void add_pm_stats(Pm_Stats& stats, const Forward_Backward_Type& fwbw,
+                             const Pore_Model_Type& pm, const Event_Sequence_Type& events, unsigned i)
+    {
+        LOG(debug1)
+            << "outter_loop i=" << i
+            << " x_i=" << events[i].mean
+            << " t_i=" << events[i].start << std::endl;
+        // t[k] := \sum_j p_{i,j} pm.training_terms(k)[j]
+        std::array< double, Pore_Model_Type::n_training_terms > t;
+        t.fill(0.0);
+        if (fwbw.is_sparse())
+        {
+            // the states kept at event i
+            fwbw.for_each_posterior(i, [&] (unsigned j, Float_Type p_ij) {
+                for (unsigned k = 0; k < Pore_Model_Type::n_training_terms; ++k)
+                {
+                    t[k] += (double)p_ij * pm.training_terms(k)[j];
                 }
-                ofs << std::endl;
+            });
+        }
+        else
+        {
+            // posterior row times the terms of the model, one block of states at a time,
+            // with a separate accumulator per lane so that the inner loop vectorizes
+            static const unsigned block_size = 64;
+            static const unsigned n_lanes = 8;
+            static_assert(n_states % block_size == 0, "blocks must not straddle the row");
+            std::array< Float_Type, block_size > p;
+            std::array< std::array< double, n_lanes >, Pore_Model_Type::n_training_terms > acc;
+            for (auto& a : acc)
+            {
+                a.fill(0.0);
             }
-            ofs.close();
-            ofs.open(std::string("fw.") + k_sstr.str() + ".tab");
-            for (unsigned i = 0; i < n_events; ++i)
+            for (unsigned j_begin = 0; j_begin < n_states; j_begin += block_size)
             {
-                for (unsigned j = 0; j < n_states; ++j)
+                fwbw.posterior_block(i, j_begin, j_begin + block_size, p.data());
+                for (unsigned k = 0; k < Pore_Model_Type::n_training_terms; ++k)
                 {
-                    if (j > 0) ofs << '\t';
-                    ofs << data.fwbw_v[k].cell(i, j).alpha;
+                    const Float_Type* term = pm.training_terms(k) + j_begin;
+                    for (unsigned j = 0; j < block_size; j += n_lanes)
+                    {
+                        for (unsigned r = 0; r < n_lanes; ++r)
+                        {
+                            acc[k][r] += (double)p[j + r] * term[j + r];
+                        }
+                    }
                 }
-                ofs << std::endl;
             }
-            ofs.close();
-            ofs.open(std::string("bw.") + k_sstr.str() + ".tab");
-            for (unsigned i = 0; i < n_events; ++i)
+            for (unsigned k = 0; k < Pore_Model_Type::n_training_terms; ++k)
             {
-                for (unsigned j = 0; j < n_states; ++j)
+                for (unsigned r = 0; r < n_lanes; ++r)
                 {
-                    if (j > 0) ofs << '\t';
-                    ofs << data.fwbw_v[k].cell(i, j).beta;
+                    t[k] += acc[k][r];
                 }
-                ofs << std::endl;
             }
         }
-        abort();
-#endif
+        add_pm_stats(stats, events, i, {{ t[0], t[1], t[2] }}, {{ t[3], t[4], t[5] }});
+    }
+
+    /**
+     * Add the contribution of event i to the pm_params statistics, when event i is in state j.
+     * @pm Unscaled pore model.
+     * @events Uncorrected events.
+     */
+    static void add_pm_stats(Pm_Stats& stats, const Pore_Model_Type& pm, const Event_Sequence_Type& events,
+                             unsigned i, unsigned j)
+    {
+        add_pm_stats(stats, events, i,
+                     {{ pm.training_terms(0)[j], pm.training_terms(1)[j], pm.training_terms(2)[j] }},
+                     {{ pm.training_terms(3)[j], pm.training_terms(4)[j], pm.training_terms(5)[j] }});
+    }
+
+    // s and l: the sums over states of train_pm_params, at event i
+    static void add_pm_stats(Pm_Stats& stats, const Event_Sequence_Type& events, unsigned i,
+                             const std::array< double, 3 >& s, const std::array< double, 3 >& l)
+    {
+        Float_Type x_i = events[i].mean;
+        Float_Type y_i = events[i].stdv;
+        Float_Type t_i = events[i].start;
+        stats.A[0][0] += s[0];
+        stats.A[0][1] += s[1];
+        stats.A[0][2] += s[0] * t_i;
+        stats.A[1][1] += s[2];
+        stats.A[1][2] += s[1] * t_i;
+        stats.A[2][2] += s[0] * t_i * t_i;
+        stats.B[0]    += s[0] * x_i;
+        stats.B[1]    += s[1] * x_i;
+        stats.B[2]    += s[0] * x_i * t_i;
+        stats.D       += s[0] * x_i * x_i;
+        stats.V_numer += l[2] * y_i;
+        stats.V_denom += l[1];
+        stats.U_pos   += l[0] / y_i;
+        ++stats.n_events;
     }
 
     /**
@@ -224,8 +580,6 @@ struct Parameter_Trainer
     static void train_pm_params(const Train_Data& data, Pore_Model_Parameters_Type& new_pm_params, bool& done)
     {
         done = false;
-        unsigned n_event_seqs = data.event_seq_ptr_v.size();
-        unsigned total_n_events = 0;
         ASSERT(data.pm_params_ptr);
         //
         // compute the scaling matrices in normal space (not logspace!)
@@ -237,72 +591,25 @@ struct Parameter_Trainer
         auto& d_hat = new_pm_params.var;
         auto& v_hat = new_pm_params.scale_sd;
         auto& u_hat = new_pm_params.var_sd;
-        std::array< std::array< double, 3 >, 3 > A = {{ {{ 0.0, 0.0, 0.0 }},
-                                                        {{ 0.0, 0.0, 0.0 }},
-                                                        {{ 0.0, 0.0, 0.0 }} }};
-        std::array< double, 3 > B = {{ 0.0, 0.0, 0.0 }};
-        double D       = 0.0; // = \sum_i x^2_i s_{i,0} (used for var)
-        double V_numer = 0.0; // = \sum_i y_i \sum_j p_{i,j} \lambda_j / \eta^2_j (for scale_sd)
-        double V_denom = 0.0; // = \sum_i \sum_j p_{i,j} \lambda_j / \eta_j (for scale_sd)
-        double U_pos   = 0.0; // = \sum_i (1/y_i) \sum_j p_{i,j} \lambda_j (for var_sd)
-        for (unsigned k = 0; k < n_event_seqs; ++k)
+        // in fused mode, the statistics were accumulated by fill_train_data, and fwbw_v is empty
+        Pm_Stats stats = data.pm_stats;
+        for (unsigned k = 0; k < data.fwbw_v.size(); ++k)
         {
             unsigned st = data.event_seq_ptr_v.at(k).second;
             ASSERT(st < 2);
             const Event_Sequence_Type& events = *data.event_seq_ptr_v[k].first;
-            unsigned n_events = events.size();
-            total_n_events += n_events;
-            const Pore_Model_Type& pm = *data.model_ptr_v[st];
-            const Forward_Backward_Type& fwbw = data.fwbw_v.at(k);
-            for (unsigned i = 0; i < n_events; ++i)
-            {
-                Float_Type x_i = events[i].mean;
-                Float_Type y_i = events[i].stdv;
-                Float_Type t_i = events[i].start;
-                LOG(debug1)
-                    << "outter_loop k=" << k << " i=" << i
-                    << " x_i=" << x_i
-                    << " t_i=" << t_i << std::endl;
-                // \sum_j p_{i,j} \mu^*_j / \simga^2_j
-                std::array< float, 3 > s = {{ 0.0, 0.0, 0.0 }};
-                // \sum_j p_{i,j} \lambda_j / \eta^*_j
-                std::array< float, 3 > l = {{ 0.0, 0.0, 0.0 }};
-                for (unsigned j = 0; j < Pore_Model_Type::n_states; ++j)
-                {
-                    Float_Type p_ij = std::exp(fwbw.log_posterior(i, j));
-                    Float_Type term_s0 = p_ij / (pm.state(j).level_stdv * pm.state(j).level_stdv);
-                    Float_Type term_s1 = term_s0 * pm.state(j).level_mean;
-                    Float_Type term_s2 = term_s1 * pm.state(j).level_mean;
-                    Float_Type term_l0 = p_ij * pm.state(j).sd_lambda;
-                    Float_Type term_l1 = term_l0 / pm.state(j).sd_mean;
-                    Float_Type term_l2 = term_l1 / pm.state(j).sd_mean;
-                    LOG(debug2)
-                        << "inner_loop k=" << k << " i=" << i << " j=" << j << " p_ij=" << p_ij
-                        << " term_s0=" << term_s0 << " term_s1=" << term_s1 << " term_s2=" << term_s2
-                        << " term_l0=" << term_l0 << " term_l1=" << term_l1 << " term_l2=" << term_l2
-                        << std::endl;
-                    s[0] += term_s0;
-                    s[1] += term_s1;
-                    s[2] += term_s2;
-                    l[0] += term_l0;
-                    l[1] += term_l1;
-                    l[2] += term_l2;
-                } // for j
-                A[0][0] += s[0];
-                A[0][1] += s[1];
-                A[0][2] += s[0] * t_i;
-                A[1][1] += s[2];
-                A[1][2] += s[1] * t_i;
-                A[2][2] += s[0] * t_i * t_i;
-                B[0]    += s[0] * x_i;
-                B[1]    += s[1] * x_i;
-                B[2]    += s[0] * x_i * t_i;
-                D       += s[0] * x_i * x_i;
-                V_numer += l[2] * y_i;
-                V_denom += l[1];
-                U_pos   += l[0] / y_i;
-            } // for i
-        } // for k
+            for (unsigned i = 0; i < events.size(); ++i)
+            {
+                add_pm_stats(stats, data.fwbw_v[k], *data.model_ptr_v[st], events, i);
+            }
+        }
+        auto& A = stats.A;
+        auto& B = stats.B;
+        const double& D = stats.D;
+        const double& V_numer = stats.V_numer;
+        const double& V_denom = stats.V_denom;
+        const double& U_pos = stats.U_pos;
+        unsigned total_n_events = stats.n_events;
         A[1][0] = A[0][1];
         A[2][0] = A[0][2];
         A[2][1] = A[1][2];
@@ -413,6 +720,110 @@ struct Parameter_Trainer
         u_hat = (double)total_n_events / (U_pos - V_denom / v_hat);
     }
 
+    /**
+     * Add the contribution of events i and i+1 to the st_params statistics of their strand.
+     * @fwbw Forward-backward table of the event sequence, or one streaming at event i.
+     * @st_params Transition parameters used by fwbw.
+     */
+    static void add_st_stats(St_Stats& stats, const Forward_Backward_Type& fwbw,
+                             const State_Transition_Parameters_Type& st_params, unsigned i)
+    {
+        Float_Type log_p_stay = std::log(st_params.p_stay);
+        Float_Type log_p_step_4 = std::log(1.0 - st_params.p_stay - st_params.p_skip) - std::log(4.0);
+        //
+        // P[S_i = j1, S_{i+1} = j2]
+        //
+        auto log_joint_prob = [&] (unsigned j1, unsigned j2, Float_Type log_p_trans) {
+            Float_Type p = fwbw.log_joint_posterior(i, j1, j2, log_p_trans);
+            LOG(debug2) << "step_prob i=" << i
+                        << " j1=" << Kmer_Type::to_string(j1)
+                        << " j2=" << Kmer_Type::to_string(j2)
+                        << " log_p_trans=" << log_p_trans
+                        << " res=" << p << std::endl;
+            return p;
+        };
+
+        auto add_j1 = [&] (unsigned j1) {
+            // Pr[ S_i = j1 ]
+            Float_Type log_p_j1 = fwbw.log_posterior(i, j1);
+            stats.denom.add(log_p_j1);
+            // Pr[ S_i = j1, S_{i+1} = j1 ]
+            Float_Type log_p_j1_j1 = log_joint_prob(j1, j1, log_p_stay);
+            if (log_p_j1_j1 > log_p_j1)
+            {
+                if (log_p_j1_j1 > log_p_j1 + std::max(std::abs(log_p_j1), 1.0f) * 1.0e-3)
+                {
+                    LOG(warning) << "numerical error log_p_j1 [" << log_p_j1
+                                 << "] log_p_j1_j1 [" << log_p_j1_j1 << "]" << std::endl;
+                }
+                log_p_j1_j1 = log_p_j1;
+            }
+            stats.p_stay_num.add(log_p_j1_j1);
+            // Pr[ S_i = j1, dist(j1,S_{i+1}) > 1 ]
+            Float_Type log_p_j1_d01;
+            {
+                LogSumSet_Type s2;
+                s2.add(log_p_j1_j1);
+                for (auto j2 : Kmer_Type::neighbour_list(j1, 1))
+                {
+                    // transition prob j1 to j2 is (p_step / 4)
+                    s2.add(log_joint_prob(j1, j2, log_p_step_4));
+                }
+                log_p_j1_d01 = s2.val();
+            }
+            if (log_p_j1_d01 > log_p_j1)
+            {
+                if (log_p_j1_d01 > log_p_j1 + std::max(std::abs(log_p_j1), 1.0f) * 1.0e-3)
+                {
+                    LOG(warning) << "numerical error log_p_j1 [" << log_p_j1
+                                 << "] log_p_j1_d01 [" << log_p_j1_d01 << "]" << std::endl;
+                }
+                log_p_j1_d01 = log_p_j1;
+            }
+            Float_Type p_j1_d2 = std::exp(log_p_j1) - std::exp(log_p_j1_d01);
+            stats.p_skip_num.add(std::log(p_j1_d2));
+        };
+        if (fwbw.is_sparse())
+        {
+            // the other states have posterior 0
+            fwbw.for_each_posterior(i, [&] (unsigned j1, Float_Type) {
+                    if (std::binary_search(st_train_kmers().begin(), st_train_kmers().end(), j1))
+                    {
+                        add_j1(j1);
+                    }
+                });
+        }
+        else
+        {
+            for (auto j1 : st_train_kmers())
+            {
+                add_j1(j1);
+            }
+        }
+    }
+
+    /**
+     * Add the transition from event i to event i+1 of a Viterbi path to the st_params statistics,
+     * if the state at event i is one of st_train_kmers().
+     */
+    static void add_st_stats(St_Stats& stats, const Event_Sequence_Type& path, unsigned i)
+    {
+        if (not std::binary_search(st_train_kmers().begin(), st_train_kmers().end(), path[i].model_state_idx))
+        {
+            return;
+        }
+        // count 1 in log space
+        stats.denom.add(0.0);
+        if (path[i + 1].move == 0)
+        {
+            stats.p_stay_num.add(0.0);
+        }
+        else if (path[i + 1].move > 1)
+        {
+            stats.p_skip_num.add(0.0);
+        }
+    }
+
     /**
      * Train st_params on training data.
      * @data Training data, as filled by fill_train_data.
@@ -421,87 +832,22 @@ struct Parameter_Trainer
     static void train_st_params(const Train_Data& data,
                                 std::array< State_Transition_Parameters_Type, 2 >& new_st_params)
     {
-        unsigned n_event_seqs = data.event_seq_ptr_v.size();
         for (unsigned st = 0; st < 2; ++st)
         {
             ASSERT(data.st_params_ptr_v[st]);
-            LogSumSet_Type s_p_stay_num(false);
-            LogSumSet_Type s_p_skip_num(false);
-            LogSumSet_Type s_denom(false);
-            Float_Type log_p_stay = std::log(data.st_params_ptr_v[st]->p_stay);
-            Float_Type log_p_step_4 = std::log(1.0 - data.st_params_ptr_v[st]->p_stay - data.st_params_ptr_v[st]->p_skip) - std::log(4.0);
-            for (unsigned k = 0; k < n_event_seqs; ++k)
+            // in fused mode, the statistics were accumulated by fill_train_data, and fwbw_v is empty
+            St_Stats stats = data.st_stats[st];
+            for (unsigned k = 0; k < data.fwbw_v.size(); ++k)
             {
                 if (data.event_seq_ptr_v[k].second != st) continue;
-                const Pore_Model_Type& scaled_pm = data.scaled_model_v[st];
-                const Event_Sequence_Type& corrected_events = data.corrected_event_seq_v.at(k);
-                unsigned n_events = corrected_events.size();
-                const Forward_Backward_Type& fwbw = data.fwbw_v.at(k);
-                //
-                // P[S_i = j1, S_{i+1} = j2]
-                //
-                auto log_joint_prob = [&] (unsigned i, unsigned j1, unsigned j2, Float_Type log_p_trans) {
-                    Float_Type p = fwbw.cell(i, j1).alpha
-                        + log_p_trans
-                        + scaled_pm.log_pr_corrected_emission(j2, corrected_events[i + 1])
-                        + fwbw.cell(i + 1, j2).beta
-                        - fwbw.log_pr_data();
-                    LOG(debug2) << "step_prob k=" << k
-                                << " i=" << i
-                                << " j1=" << Kmer_Type::to_string(j1)
-                                << " j2=" << Kmer_Type::to_string(j2)
-                                << " log_p_trans=" << log_p_trans
-                                << " res=" << p << std::endl;
-                    return p;
-                };
-
-                for (unsigned i = 0; i < n_events - 1; ++i)
+                const Forward_Backward_Type& fwbw = data.fwbw_v[k];
+                for (unsigned i = 0; i + 1 < fwbw.n_events(); ++i)
                 {
-                    for (auto j1 : st_train_kmers())
-                    {
-                        // Pr[ S_i = j1 ]
-                        Float_Type log_p_j1 = fwbw.log_posterior(i, j1);
-                        s_denom.add(log_p_j1);
-                        // Pr[ S_i = j1, S_{i+1} = j1 ]
-                        Float_Type log_p_j1_j1 = log_joint_prob(i, j1, j1, log_p_stay);
-                        if (log_p_j1_j1 > log_p_j1)
-                        {
-                            if (log_p_j1_j1 > log_p_j1 + std::max(std::abs(log_p_j1), 1.0f) * 1.0e-3)
-                            {
-                                LOG(warning) << "numerical error log_p_j1 [" << log_p_j1
-                                             << "] log_p_j1_j1 [" << log_p_j1_j1 << "]" << std::endl;
-                            }
-                            log_p_j1_j1 = log_p_j1;
-                        }
-                        s_p_stay_num.add(log_p_j1_j1);
-                        // Pr[ S_i = j1, dist(j1,S_{i+1}) > 1 ]
-                        Float_Type log_p_j1_d01;
-                        {
-                            LogSumSet_Type s2(false);
-                            s2.add(log_p_j1_j1);
-                            for (auto j2 : Kmer_Type::neighbour_list(j1, 1))
-                            {
-                                // transition prob j1 to j2 is (p_step / 4)
-                                s2.add(log_joint_prob(i, j1, j2, log_p_step_4));
-                            }
-                            log_p_j1_d01 = s2.val();
-                        }
-                        if (log_p_j1_d01 > log_p_j1)
-                        {
-                            if (log_p_j1_d01 > log_p_j1 + std::max(std::abs(log_p_j1), 1.0f) * 1.0e-3)
-                            {
-                                LOG(warning) << "numerical error log_p_j1 [" << log_p_j1
-                                             << "] log_p_j1_d01 [" << log_p_j1_d01 << "]" << std::endl;
-                            }
-                            log_p_j1_d01 = log_p_j1;
-                        }
-                        Float_Type p_j1_d2 = std::exp(log_p_j1) - std::exp(log_p_j1_d01);
-                        s_p_skip_num.add(std::log(p_j1_d2));
-                    } // for j1
-                } // for i
-            } // for k
-            new_st_params[st].p_stay = std::exp(s_p_stay_num.val() - s_denom.val());
-            new_st_params[st].p_skip = std::exp(s_p_skip_num.val() - s_denom.val());
+                    add_st_stats(stats, fwbw, *data.st_params_ptr_v[st], i);
+                }
+            }
+            new_st_params[st].p_stay = std::exp(stats.p_stay_num.val() - stats.denom.val());
+            new_st_params[st].p_skip = std::exp(stats.p_skip_num.val() - stats.denom.val());
             if (new_st_params[st].p_stay < .05 or new_st_params[st].p_stay > .4
                 or new_st_params[st].p_skip < .05 or new_st_params[st].p_skip > .4)
             {
@@ -518,12 +864,129 @@ struct Parameter_Trainer
         } // for st
     } // train_st_params()
 
+    /**
+     * Training round of one model, as performed by train_rounds.
+     * @model_ptrs Unscaled pore models (per strand)
+     * @crt_pm_params_ptr, @crt_st_params_ptr Current parameters
+     * @new_pm_params Destination for trained pm params (common to both strands)
+     * @new_st_params Destination for trained st params (per strand)
+     * @fit Destination for pr_data using crt params
+     * @done Set to true if no more training rounds can be performed due to singularity.
+     */
+    struct Round
+    {
+        const std::vector< std::pair< const Event_Sequence_Type*, unsigned > >* event_seq_ptrs_ptr;
+        std::array< const Pore_Model_Type*, 2 > model_ptrs;
+        const Pore_Model_Parameters_Type* crt_pm_params_ptr;
+        const std::array< State_Transition_Parameters_Type, 2 >* crt_st_params_ptr;
+        Pore_Model_Parameters_Type new_pm_params;
+        std::array< State_Transition_Parameters_Type, 2 > new_st_params;
+        Float_Type fit;
+        bool done;
+    };
+
+    /**
+     * Perform one training round for each of several models, each on its own event sequences,
+     * with a single batch of forward-backward passes. Without fused() or viterbi_training(),
+     * the tables of a round are kept until its parameters are trained, so to bound memory,
+     * the rounds are instead performed one at a time, each with a batch of its own event sequences.
+     * @team_ptr Thread team used by the forward-backward passes, or null; with
+     * Forward_Backward::task_parallel(), it also computes the new parameters of batched rounds
+     * in parallel, one round per thread at a time
+     */
+    static void train_rounds(
+        const State_Transitions_Type& default_transitions,
+        std::vector< Round >& round_v,
+        bool train_scaling,
+        bool train_transitions,
+        Thread_Team* team_ptr = nullptr)
+    {
+        // initialize training data, in the buffers of this thread
+        Workspace& ws = workspace();
+        auto& data_v = ws.data_v;
+        auto& data_ptr_v = ws.data_ptr_v;
+        auto init_data = [&] (Train_Data& data, const Round& round) {
+            data.event_seq_ptr_v = *round.event_seq_ptrs_ptr;
+            data.model_ptr_v = round.model_ptrs;
+            data.default_transitions_ptr = &default_transitions;
+            data.pm_params_ptr = round.crt_pm_params_ptr;
+            data.st_params_ptr_v = {{ &(*round.crt_st_params_ptr)[0], &(*round.crt_st_params_ptr)[1] }};
+            data.train_scaling = train_scaling;
+            data.train_transitions = train_transitions;
+            data.team_ptr = team_ptr;
+        };
+        auto train_round = [&] (const Train_Data& data, Round& round) {
+            round.fit = data.fit;
+            round.done = false;
+            if (train_scaling)
+            {
+                // train pm params
+                train_pm_params(data, round.new_pm_params, round.done);
+                if (round.done)
+                {
+                    round.new_st_params = *round.crt_st_params_ptr;
+                    return;
+                }
+            }
+            if (train_transitions)
+            {
+                // train st params
+                train_st_params(data, round.new_st_params);
+            }
+        };
+        if (not fused() and not viterbi_training())
+        {
+            // one round at a time, in the buffers of the first training data
+            if (data_v.empty())
+            {
+                data_v.resize(1);
+            }
+            for (auto& round : round_v)
+            {
+                init_data(data_v[0], round);
+                fill_train_data(data_v[0]);
+                train_round(data_v[0], round);
+            }
+            return;
+        }
+        if (data_v.size() < round_v.size())
+        {
+            data_v.resize(round_v.size());
+        }
+        data_ptr_v.clear();
+        for (unsigned r = 0; r < round_v.size(); ++r)
+        {
+            init_data(data_v[r], round_v[r]);
+            data_ptr_v.push_back(&data_v[r]);
+        }
+        // fill the training data
+        fill_train_data(data_ptr_v);
+        if (Forward_Backward_Type::task_parallel() and team_ptr and team_ptr->size() > 1 and round_v.size() > 1)
+        {
+            std::atomic< unsigned > next_round(0);
+            team_ptr->run([&] (unsigned) {
+                    for (unsigned r = next_round++; r < round_v.size(); r = next_round++)
+                    {
+                        train_round(data_v[r], round_v[r]);
+                    }
+                });
+        }
+        else
+        {
+            for (unsigned r = 0; r < round_v.size(); ++r)
+            {
+                train_round(data_v[r], round_v[r]);
+            }
+        }
+    } // train_rounds
+
     /**
      * Perform one training round.
      * @new_pm_params Destination for trained pm params (common to both strands)
      * @new_st_params Destination for trained st params (per strand)
      * @fit Destination for pr_data using crt params
      * @done Bool; set to true if no more training rounds can be performed due to singularity.
+     * @team_ptr Thread team used by the forward-backward passes, or null
      */
     static void train_one_round(
         const std::vector< std::pair< const Event_Sequence_Type*, unsigned > >& event_seq_ptrs,
@@ -536,33 +999,21 @@ struct Parameter_Trainer
         Float_Type& fit,
         bool& done,
         bool train_scaling,
-        bool train_transitions)
+        bool train_transitions,
+        Thread_Team* team_ptr = nullptr)
     {
-        // initialize training data
-        Train_Data data;
-        data.event_seq_ptr_v = event_seq_ptrs;
-        data.model_ptr_v = model_ptrs;
-        data.default_transitions_ptr = &default_transitions;
-        data.pm_params_ptr = &crt_pm_params;
-        data.st_params_ptr_v = {{ &crt_st_params[0], &crt_st_params[1] }};
-        // fill the training data
-        fill_train_data(data);
-        fit = data.fit;
-        if (train_scaling)
-        {
-            // train pm params
-            train_pm_params(data, new_pm_params, done);
-            if (done)
-            {
-                new_st_params = crt_st_params;
-                return;
-            }
-        }
-        if (train_transitions)
-        {
-            // train st params
-            train_st_params(data, new_st_params);
-        }
+        std::vector< Round > round_v(1);
+        round_v[0].event_seq_ptrs_ptr = &event_seq_ptrs;
+        round_v[0].model_ptrs = model_ptrs;
+        round_v[0].crt_pm_params_ptr = &crt_pm_params;
+        round_v[0].crt_st_params_ptr = &crt_st_params;
+        round_v[0].new_pm_params = new_pm_params;
+        round_v[0].new_st_params = new_st_params;
+        train_rounds(default_transitions, round_v, train_scaling, train_transitions, team_ptr);
+        new_pm_params = round_v[0].new_pm_params;
+        new_st_params = round_v[0].new_st_params;
+        fit = round_v[0].fit;
+        done = round_v[0].done;
     } // train_one_round
 
 }; // class Parameter_Trainer
@@ -15,6 +15,7 @@
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "Kmer.hpp"
 #include "Event.hpp"
@@ -69,6 +70,11 @@ struct Pore_Model_Parameters
            << " var=" << p.var << " scale_sd=" << p.scale_sd << " var_sd=" << p.var_sd << "]";
         return os;
     }
+    friend bool operator == (const Pore_Model_Parameters& lhs, const Pore_Model_Parameters& rhs)
+    {
+        return (lhs.scale == rhs.scale and lhs.shift == rhs.shift and lhs.drift == rhs.drift
+                and lhs.var == rhs.var and lhs.scale_sd == rhs.scale_sd and lhs.var_sd == rhs.var_sd);
+    }
     void write_tsv(std::ostream& os) const
     {
         os << std::fixed << std::setprecision(5)
@@ -174,7 +180,7 @@ public:
     typedef Pore_Model_Parameters< Float_Type > Pore_Model_Parameters_Type;
     static const unsigned n_states = 1u << (2 * Kmer_Size);
 
-    Pore_Model() : _strand(2) {}
+    Pore_Model() : _emission_center(0), _strand(2) {}
     void clear() { _state.clear(); }
 
     const Pore_Model_State_Type& state(unsigned i) const { return _state.at(i); }
@@ -182,6 +188,20 @@ public:
 
     const std::vector< Pore_Model_State_Type >& get_state_vector() const { return _state; }
 
+    // The log emission probability of a state is linear in the emission features of an event:
+    //   log_pr_corrected_emission(j, e) == sum_f emission_coefficients(f)[j] * e.get_emission_features(emission_center())[f]
+    // The coefficients are stored feature-major (one array of n_states per feature), and in double
+    // precision because the terms cancel out. They are updated whenever the model is loaded or scaled.
+    static const unsigned n_emission_features = Event_Type::n_emission_features;
+    double emission_center() const { return _emission_center; }
+    const double* emission_coefficients(unsigned f) const { return &_emission_coefficients[f * n_states]; }
+
+    // Per-state terms of the scaling statistics of Parameter_Trainer, one array of n_states per term:
+    //   1/sigma^2, mu/sigma^2, mu^2/sigma^2, lambda, lambda/eta, lambda/eta^2
+    // (level mean mu, level stdv sigma, sd mean eta, sd lambda). Updated along with the emission coefficients.
+    static const unsigned n_training_terms = 6;
+    const Float_Type* training_terms(unsigned t) const { return &_training_terms[t * n_states]; }
+
     const unsigned& strand() const { return _strand; }
     unsigned& strand() { return _strand; }
     Float_Type mean() const { return _mean; }
@@ -300,6 +320,9 @@ public:
 
 private:
     std::vector< Pore_Model_State_Type > _state;
+    std::vector< double > _emission_coefficients;
+    std::vector< Float_Type > _training_terms;
+    double _emission_center;
     Float_Type _mean;
     Float_Type _stdv;
     unsigned _strand;
@@ -310,6 +333,50 @@ private:
         std::tie(_mean, _stdv) = alg::mean_stdv_of< Float_Type >(
             _state,
             [] (const Pore_Model_State_Type& s) { return s.level_mean; });
+        update_emission_coefficients();
+        update_training_terms();
+    }
+
+    void update_training_terms()
+    {
+        _training_terms.resize(n_training_terms * n_states);
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            const Pore_Model_State_Type& s = state(j);
+            double inv_var = 1.0 / (static_cast< double >(s.level_stdv) * s.level_stdv);
+            double lambda = s.sd_lambda;
+            _training_terms[0 * n_states + j] = inv_var;
+            _training_terms[1 * n_states + j] = inv_var * s.level_mean;
+            _training_terms[2 * n_states + j] = inv_var * s.level_mean * s.level_mean;
+            _training_terms[3 * n_states + j] = lambda;
+            _training_terms[4 * n_states + j] = lambda / s.sd_mean;
+            _training_terms[5 * n_states + j] = lambda / s.sd_mean / s.sd_mean;
+        }
+    }
+
+    void update_emission_coefficients()
+    {
+        static const double log_2pi = std::log(2.0 * M_PI);
+        // center the level means to limit cancellation
+        _emission_center = _mean;
+        _emission_coefficients.resize(n_emission_features * n_states);
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            const Pore_Model_State_Type& s = state(j);
+            // gaussian level term
+            double inv_var = 1.0 / (static_cast< double >(s.level_stdv) * s.level_stdv);
+            double m = s.level_mean - _emission_center;
+            // inverse gaussian stdv term
+            double mu = s.sd_mean;
+            double lambda = s.sd_lambda;
+            _emission_coefficients[0 * n_states + j] = -.5 * inv_var;
+            _emission_coefficients[1 * n_states + j] = m * inv_var;
+            _emission_coefficients[2 * n_states + j] = (- s.log_level_stdv - .5 * log_2pi - .5 * m * m * inv_var
+                                                        + .5 * (s.log_sd_lambda - log_2pi) + lambda / mu);
+            _emission_coefficients[3 * n_states + j] = -.5 * lambda / (mu * mu);
+            _emission_coefficients[4 * n_states + j] = -.5 * lambda;
+            _emission_coefficients[5 * n_states + j] = -1.5;
+        }
     }
 }; // class Pore_Model
 
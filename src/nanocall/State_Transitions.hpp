@@ -1,14 +1,18 @@
 #ifndef __STATE_TRANSITIONS_BASE_HPP
 #define __STATE_TRANSITIONS_BASE_HPP
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <vector>
 #include <map>
+#include <set>
 
 #include "Kmer.hpp"
-#include "logsumset.hpp"
+#include "Log_Sum.hpp"
 #include "logger.hpp"
 
 template < typename Float_Type >
@@ -42,6 +46,10 @@ struct State_Transition_Parameters
            << " p_skip=" << stp.p_skip << "]";
         return os;
     }
+    friend bool operator == (const State_Transition_Parameters& lhs, const State_Transition_Parameters& rhs)
+    {
+        return lhs.p_stay == rhs.p_stay and lhs.p_skip == rhs.p_skip;
+    }
     void write_tsv(std::ostream& os) const
     {
         os << std::fixed << std::setprecision(5)
@@ -68,13 +76,39 @@ public:
     typedef State_Neighbours< Float_Type > State_Neighbours_Type;
     typedef State_Transition_Parameters< Float_Type > State_Transition_Parameters_Type;
     static const unsigned n_states = 1u << (2 * Kmer_Size);
+    // de Bruijn predecessor pattern: slot 0 is the state itself (stay),
+    // slots 1..4 shift in one base, slots 5..20 shift in two bases
+    static const unsigned n_pattern_slots = 21;
+
+    // de Bruijn groups: the step predecessors of j are the 4 states ending in Kmer::prefix(j, k-1),
+    // the skip predecessors the 16 states ending in Kmer::prefix(j, k-2); member b of a group is the
+    // predecessor in pattern slot 1 + b, resp. 5 + b
+    static const unsigned n_step_groups = n_states / 4;
+    static const unsigned n_skip_groups = n_states / 16;
 
-    State_Transitions() = default;
-    void clear() { _neighbours.clear(); }
+    State_Transitions() : _has_pattern(false), _has_groups(false) {}
+    void clear() { _neighbours.clear(); _has_pattern = false; _has_groups = false; }
 
     const State_Neighbours_Type& neighbours(unsigned i) const { return _neighbours.at(i); }
     State_Neighbours_Type& neighbours(unsigned i) { return _neighbours.at(i); }
 
+    // predecessor of state j in the given pattern slot
+    static unsigned pattern_pred(unsigned j, unsigned slot)
+    {
+        return (slot == 0
+                ? j
+                : slot < 5
+                ? ((slot - 1) << (2 * (Kmer_Size - 1))) | (j >> 2)
+                : ((slot - 5) << (2 * (Kmer_Size - 2))) | (j >> 4));
+    }
+    // true iff every predecessor in every from_v fits in the pattern
+    bool has_pattern() const { return _has_pattern; }
+    // pattern, structure-of-arrays layout, one array of n_states per slot:
+    // log transition probability from pattern_pred(j, slot) to j, or -INFINITY if absent
+    const Float_Type* pattern_weights(unsigned slot) const { return &_pattern_weights[slot * n_states]; }
+    // index in from_v of j of pattern_pred(j, slot), or 0xFF if absent
+    const uint8_t* pattern_from_idx(unsigned slot) const { return &_pattern_from_idx[slot * n_states]; }
+
     // update fields from_v, p_rest_from, p_rest_to based on to_v
     void update_fields()
     {
@@ -84,7 +118,7 @@ public:
         }
         for (unsigned i = 0; i < n_states; ++i)
         {
-            logsum::logsumset< Float_Type > s(false);
+            typename Log_Sum< Float_Type >::Set s;
             for (const auto& p : neighbours(i).to_v)
             {
                 neighbours(p.first).from_v.push_back(std::make_pair(i, p.second));
@@ -94,13 +128,115 @@ public:
         }
         for (unsigned i = 0; i < n_states; ++i)
         {
-            logsum::logsumset< Float_Type > s(false);
+            typename Log_Sum< Float_Type >::Set s;
             for (const auto& p : neighbours(i).from_v)
             {
                 s.add(p.second);
             }
             neighbours(i).p_rest_from = std::log(1 - std::exp(s.val()));
         }
+        update_pattern();
+    }
+
+    static unsigned step_group(unsigned j) { return j >> 2; }
+    static unsigned skip_group(unsigned j) { return j >> 4; }
+    static unsigned step_group_member(unsigned g, unsigned b) { return (b << (2 * (Kmer_Size - 1))) | g; }
+    static unsigned skip_group_member(unsigned g, unsigned b) { return (b << (2 * (Kmer_Size - 2))) | g; }
+    // group and member of state i as a step (skip) predecessor
+    static unsigned step_pred_group(unsigned i) { return i & (n_step_groups - 1); }
+    static unsigned step_pred_member(unsigned i) { return i >> (2 * (Kmer_Size - 1)); }
+    static unsigned skip_pred_group(unsigned i) { return i & (n_skip_groups - 1); }
+    static unsigned skip_pred_member(unsigned i) { return i >> (2 * (Kmer_Size - 2)); }
+    // true iff has_pattern(); the group layout is then available
+    bool has_groups() const { return _has_groups; }
+    // log transition probability from member b of the group to every state in the group
+    // that takes it as a predecessor (see from_grouped())
+    const Float_Type* step_group_weights(unsigned g) const { return &_step_group_weights[4 * g]; }
+    const Float_Type* skip_group_weights(unsigned g) const { return &_skip_group_weights[16 * g]; }
+    // true iff the transitions into j from its step and skip predecessors all have the group weights,
+    // so that \sum_k Pr[ k -> j ] x_k can be computed from the group sums and the stay transition
+    bool from_grouped(unsigned j) const { return _from_grouped[j]; }
+    // true iff the transitions from j to the states that take it as a step or skip predecessor all
+    // have the group weights of j
+    bool to_grouped(unsigned j) const { return _to_grouped[j]; }
+
+    // recompute the pattern layout from from_v
+    void update_pattern()
+    {
+        _pattern_weights.assign(n_pattern_slots * n_states, -INFINITY);
+        _pattern_from_idx.assign(n_pattern_slots * n_states, 0xFF);
+        _has_pattern = Kmer_Size >= 2;
+        for (unsigned j = 0; _has_pattern and j < n_states; ++j)
+        {
+            const auto& from_v = neighbours(j).from_v;
+            _has_pattern = from_v.size() < 0xFF;
+            for (unsigned k = 0; _has_pattern and k < from_v.size(); ++k)
+            {
+                unsigned j_prev = from_v[k].first;
+                unsigned slot;
+                if (j_prev == j)
+                {
+                    slot = 0;
+                }
+                else if (Kmer_Type::suffix(j_prev, Kmer_Size - 1) == Kmer_Type::prefix(j, Kmer_Size - 1))
+                {
+                    slot = 1 + Kmer_Type::prefix(j_prev, 1);
+                }
+                else if (Kmer_Type::suffix(j_prev, Kmer_Size - 2) == Kmer_Type::prefix(j, Kmer_Size - 2))
+                {
+                    slot = 5 + Kmer_Type::prefix(j_prev, 2);
+                }
+                else
+                {
+                    _has_pattern = false;
+                    break;
+                }
+                assert(pattern_pred(j, slot) == j_prev);
+                _has_pattern = _pattern_from_idx[slot * n_states + j] == 0xFF;
+                _pattern_weights[slot * n_states + j] = from_v[k].second;
+                _pattern_from_idx[slot * n_states + j] = k;
+            }
+        }
+        LOG(debug1) << "has_pattern=" << _has_pattern << std::endl;
+        update_groups();
+    }
+
+    // recompute the group layout from the pattern: the weight of every group member is the one
+    // it has into the first state of the group that has it in its pattern; states that take a
+    // member with a different weight, or not at all, are not grouped
+    void update_groups()
+    {
+        _has_groups = _has_pattern;
+        _step_group_weights.assign(4 * n_step_groups, -INFINITY);
+        _skip_group_weights.assign(16 * n_skip_groups, -INFINITY);
+        _from_grouped.assign(n_states, _has_groups);
+        _to_grouped.assign(n_states, _has_groups);
+        if (not _has_groups) return;
+        for (unsigned slot = 1; slot < n_pattern_slots; ++slot)
+        {
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                Float_Type& w = group_weight(slot, j);
+                if (w == -INFINITY)
+                {
+                    w = pattern_weights(slot)[j];
+                }
+            }
+        }
+        unsigned n_from_grouped = n_states;
+        for (unsigned slot = 1; slot < n_pattern_slots; ++slot)
+        {
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                if (pattern_weights(slot)[j] != group_weight(slot, j))
+                {
+                    n_from_grouped -= _from_grouped[j];
+                    _from_grouped[j] = false;
+                    _to_grouped[pattern_pred(j, slot)] = false;
+                }
+            }
+        }
+        LOG(debug1) << "from_grouped=" << n_from_grouped << "/" << n_states << std::endl;
     }
 
     // drop transitions with low probability
@@ -187,11 +323,11 @@ public:
             Float_Type val;
         }; // struct Default_Float
 
-        _neighbours.clear();
-        _neighbours.reserve(n_states);
+        // recompute in place, reusing the vectors of a previous computation
+        _neighbours.resize(n_states);
         for (unsigned i = 0; i < n_states; ++i)
         {
-            _neighbours.emplace_back();
+            neighbours(i).to_v.clear();
             Float_Type p_skip = p_skip_default;
             if (p_skip_map.count(i))
             {
@@ -205,15 +341,20 @@ public:
                         << " p_skip=" << p_skip
                         << " p_step=" << p_step
                         << " p_skip_1=" << p_skip_1 << std::endl;
-            std::set< unsigned > to_s{i};
+            // i and its neighbours at distance 1 and 2, sorted, without duplicates
+            std::array< unsigned, 21 > to_a;
             const auto& nl1 = Kmer_Type::neighbour_list(i, 1);
-            to_s.insert(nl1.begin(), nl1.end());
             const auto& nl2 = Kmer_Type::neighbour_list(i, 2);
-            to_s.insert(nl2.begin(), nl2.end());
-            for (const auto& j : to_s)
+            assert(nl1.size() == 4 and nl2.size() == 16);
+            to_a[0] = i;
+            std::copy(nl1.begin(), nl1.end(), to_a.begin() + 1);
+            std::copy(nl2.begin(), nl2.end(), to_a.begin() + 5);
+            std::sort(to_a.begin(), to_a.end());
+            auto to_end = std::unique(to_a.begin(), to_a.end());
+            for (auto it = to_a.begin(); it != to_end; ++it)
             {
-                Float_Type p = get_trans_prob(i, j, p_stay, p_step, p_skip_1);
-                neighbours(i).to_v.push_back(std::make_pair(j, std::log(p)));
+                Float_Type p = get_trans_prob(i, *it, p_stay, p_step, p_skip_1);
+                neighbours(i).to_v.push_back(std::make_pair(*it, std::log(p)));
             }
         }
         update_fields();
@@ -253,6 +394,21 @@ public:
 
 private:
     std::vector< State_Neighbours_Type > _neighbours;
+    std::vector< Float_Type > _pattern_weights;
+    std::vector< uint8_t > _pattern_from_idx;
+    std::vector< Float_Type > _step_group_weights;
+    std::vector< Float_Type > _skip_group_weights;
+    std::vector< bool > _from_grouped;
+    std::vector< bool > _to_grouped;
+    bool _has_pattern;
+    bool _has_groups;
+
+    Float_Type& group_weight(unsigned slot, unsigned j)
+    {
+        return (slot < 5
+                ? _step_group_weights[4 * step_group(j) + slot - 1]
+                : _skip_group_weights[16 * skip_group(j) + slot - 5]);
+    }
 }; // class State_Transitions
 
 #endif
@@ -0,0 +1,294 @@
+#ifndef __THREAD_TEAM_HPP
+#define __THREAD_TEAM_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * A persistent team of threads used to split the state loop of a single
+ * dynamic programming row.
+ *
+ * run(fn) calls fn(tid) for tid in [0, size()), with tid 0 on the calling
+ * thread, and returns when all calls have returned. Within fn, barrier()
+ * synchronizes all team members, e.g., once per row.
+ *
+ * Teams can grow between calls to run() by claiming threads from a global pool
+ * of spare threads: a thread that runs out of work can add itself to the pool
+ * with add_spare_threads(1), and a team returns the threads it claimed when it
+ * is destroyed.
+ *
+ * run_split(fn_a, fn_b) runs two independent jobs at once, each on half of the team.
+ */
+class Thread_Team
+{
+public:
+    explicit Thread_Team(unsigned max_size = 1)
+        : _max_size(std::max(max_size, 1u)),
+          _n_claimed(0),
+          _fn_ptr(nullptr),
+          _generation(0),
+          _n_running(0),
+          _quit(false),
+          _barrier_count(0),
+          _barrier_generation(0)
+    {
+        for (unsigned h = 0; h < 2; ++h)
+        {
+            _half_barrier_count[h] = 0;
+            _half_barrier_generation[h] = 0;
+        }
+    }
+    Thread_Team(const Thread_Team&) = delete;
+    Thread_Team& operator = (const Thread_Team&) = delete;
+    ~Thread_Team()
+    {
+        {
+            std::lock_guard< std::mutex > lock(_mutex);
+            _quit = true;
+        }
+        _start_cv.notify_all();
+        for (auto& t : _workers)
+        {
+            t.join();
+        }
+        add_spare_threads(_n_claimed);
+    }
+
+    unsigned size() const { return _workers.size() + 1; }
+    unsigned max_size() const { return _max_size; }
+
+    // start workers until the team has n_threads members; not to be called from within run()
+    void resize(unsigned n_threads)
+    {
+        n_threads = std::min(n_threads, _max_size);
+        while (size() < n_threads)
+        {
+            unsigned tid = size();
+            _workers.emplace_back(&Thread_Team::worker, this, tid, _generation);
+        }
+    }
+
+    // claim spare threads from the global pool, up to max_size(); not to be called from within run()
+    void grow()
+    {
+        if (size() >= _max_size) return;
+        int n_wanted = _max_size - size();
+        int n_spare = spare_threads().load();
+        int n_claim;
+        do
+        {
+            n_claim = std::min(n_spare, n_wanted);
+            if (n_claim <= 0) return;
+        }
+        while (not spare_threads().compare_exchange_weak(n_spare, n_spare - n_claim));
+        _n_claimed += n_claim;
+        resize(size() + n_claim);
+    }
+
+    static std::atomic< int >& spare_threads() { static std::atomic< int > _spare_threads(0); return _spare_threads; }
+    static void add_spare_threads(int n) { spare_threads() += n; }
+
+    void run(const std::function< void(unsigned) >& fn)
+    {
+        if (_workers.empty())
+        {
+            fn(0);
+            return;
+        }
+        {
+            std::lock_guard< std::mutex > lock(_mutex);
+            _fn_ptr = &fn;
+            _n_running = _workers.size();
+            ++_generation;
+        }
+        _start_cv.notify_all();
+        fn(0);
+        std::unique_lock< std::mutex > lock(_mutex);
+        _done_cv.wait(lock, [&] () { return _n_running == 0; });
+        _fn_ptr = nullptr;
+    }
+
+    // to be called by every team member from within run()
+    void barrier()
+    {
+        if (_workers.empty()) return;
+        spin_barrier(_barrier_count, _barrier_generation, size());
+    }
+
+    // call fn_a(tid, n, half_barrier) on members [0, n) with n = (size() + 1) / 2, and at the same time,
+    // fn_b(tid, n, half_barrier) on the other members; tid is relative to the half, and half_barrier()
+    // synchronizes the members of the half; needs size() >= 2
+    typedef std::function< void(unsigned, unsigned, const std::function< void() >&) > Split_Fn;
+    void run_split(const Split_Fn& fn_a, const Split_Fn& fn_b)
+    {
+        unsigned n_a = (size() + 1) / 2;
+        std::array< unsigned, 2 > n = {{ n_a, size() - n_a }};
+        std::array< std::function< void() >, 2 > half_barrier;
+        for (unsigned h = 0; h < 2; ++h)
+        {
+            half_barrier[h] = [this, h, &n] () {
+                spin_barrier(_half_barrier_count[h], _half_barrier_generation[h], n[h]);
+            };
+        }
+        run([&] (unsigned tid) {
+                if (tid < n_a)
+                {
+                    fn_a(tid, n[0], half_barrier[0]);
+                }
+                else
+                {
+                    fn_b(tid - n_a, n[1], half_barrier[1]);
+                }
+            });
+    }
+
+    // for r in [0, n_rows):
+    //   every member calls row_fn(r, col_begin, col_end) on its part of [0, n_cols);
+    //   once row r is complete, member 0 calls row_done_fn(r) while the others start row r + 1
+    // the team grows between blocks of rows_per_run() rows
+    template < typename Row_Fn, typename Row_Done_Fn >
+    void for_each_row(unsigned n_rows, unsigned n_cols, unsigned align,
+                      Row_Fn&& row_fn, Row_Done_Fn&& row_done_fn)
+    {
+        for (unsigned r_begin = 0; r_begin < n_rows; r_begin += rows_per_run())
+        {
+            unsigned r_end = std::min(n_rows, r_begin + rows_per_run());
+            grow();
+            if (_workers.empty())
+            {
+                for (unsigned r = r_begin; r < r_end; ++r)
+                {
+                    row_fn(r, 0u, n_cols);
+                    row_done_fn(r);
+                }
+                continue;
+            }
+            run([&] (unsigned tid) {
+                    auto cols = range(tid, n_cols, align);
+                    for (unsigned r = r_begin; r < r_end; ++r)
+                    {
+                        row_fn(r, cols.first, cols.second);
+                        barrier();
+                        if (tid == 0) row_done_fn(r);
+                    }
+                });
+        }
+    }
+
+    static unsigned& rows_per_run() { static unsigned _rows_per_run = 64; return _rows_per_run; }
+
+    // range of [0, n) assigned to member tid, with boundaries at multiples of align
+    std::pair< unsigned, unsigned > range(unsigned tid, unsigned n, unsigned align = 1) const
+    {
+        return range(tid, size(), n, align);
+    }
+    // same, for member tid of a group of n_members
+    static std::pair< unsigned, unsigned > range(unsigned tid, unsigned n_members, unsigned n, unsigned align)
+    {
+        unsigned n_blocks = (n + align - 1) / align;
+        unsigned blocks_per_member = (n_blocks + n_members - 1) / n_members;
+        unsigned begin = std::min(n, tid * blocks_per_member * align);
+        unsigned end = std::min(n, begin + blocks_per_member * align);
+        return std::make_pair(begin, end);
+    }
+
+private:
+    // wait until n threads called this with the same counters
+    static void spin_barrier(std::atomic< unsigned >& count, std::atomic< unsigned >& generation, unsigned n)
+    {
+        if (n <= 1) return;
+        unsigned crt_generation = generation.load(std::memory_order_acquire);
+        if (count.fetch_add(1, std::memory_order_acq_rel) + 1 == n)
+        {
+            count.store(0, std::memory_order_relaxed);
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        else
+        {
+            // rows are short: spin for a while before yielding
+            for (unsigned n_spins = 0; generation.load(std::memory_order_acquire) == crt_generation; ++n_spins)
+            {
+                if (n_spins >= 1000) std::this_thread::yield();
+            }
+        }
+    }
+
+    void worker(unsigned tid, unsigned generation)
+    {
+        while (true)
+        {
+            const std::function< void(unsigned) >* fn_ptr;
+            {
+                std::unique_lock< std::mutex > lock(_mutex);
+                _start_cv.wait(lock, [&] () { return _quit or _generation != generation; });
+                if (_quit) return;
+                generation = _generation;
+                fn_ptr = _fn_ptr;
+            }
+            (*fn_ptr)(tid);
+            std::lock_guard< std::mutex > lock(_mutex);
+            if (--_n_running == 0)
+            {
+                _done_cv.notify_one();
+            }
+        }
+    }
+
+    std::vector< std::thread > _workers;
+    unsigned _max_size;
+    int _n_claimed;
+    std::mutex _mutex;
+    std::condition_variable _start_cv;
+    std::condition_variable _done_cv;
+    const std::function< void(unsigned) >* _fn_ptr;
+    unsigned _generation;
+    unsigned _n_running;
+    bool _quit;
+    std::atomic< unsigned > _barrier_count;
+    std::atomic< unsigned > _barrier_generation;
+    std::array< std::atomic< unsigned >, 2 > _half_barrier_count;
+    std::array< std::atomic< unsigned >, 2 > _half_barrier_generation;
+}; // class Thread_Team
+
+/**
+ * The thread team of an engine: the one given with set(), if any, otherwise a team of the
+ * engine's own, created on first use with n_threads members, and again whenever n_threads changes.
+ * Copies share the own team.
+ */
+class Thread_Team_Handle
+{
+public:
+    Thread_Team_Handle() : _team_ptr(nullptr) {}
+
+    void set(Thread_Team* team_ptr) { _team_ptr = team_ptr; }
+    // the team given with set(), or null
+    Thread_Team* given() const { return _team_ptr; }
+
+    Thread_Team& get(unsigned n_threads)
+    {
+        if (_team_ptr)
+        {
+            return *_team_ptr;
+        }
+        if (not _own_team or _own_team->max_size() != n_threads)
+        {
+            _own_team = std::make_shared< Thread_Team >(n_threads);
+            _own_team->resize(n_threads);
+        }
+        return *_own_team;
+    }
+
+private:
+    Thread_Team* _team_ptr;
+    std::shared_ptr< Thread_Team > _own_team;
+}; // class Thread_Team_Handle
+
+#endif
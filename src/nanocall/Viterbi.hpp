@@ -1,13 +1,23 @@
 #ifndef __VITERBI_HPP
 #define __VITERBI_HPP
 
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <map>
+#include <tuple>
+#include <utility>
 #include <vector>
 #include <set>
 
 #include "Pore_Model.hpp"
+#include "Emission_Table.hpp"
 #include "State_Transitions.hpp"
+#include "Thread_Team.hpp"
+#include "Viterbi_Kernel.hpp"
 #include "logsumset.hpp"
 #include "logger.hpp"
 #include "fast5.hpp"
@@ -22,123 +32,939 @@ public:
     typedef Event< Float_Type, Kmer_Size > Event_Type;
     typedef Event_Sequence< Float_Type, Kmer_Size > Event_Sequence_Type;
     typedef logsum::logsumset< Float_Type > LogSumSet_Type;
+    typedef Viterbi_Kernel< Float_Type, Kmer_Size > Viterbi_Kernel_Type;
+    typedef Emission_Table< Float_Type, Kmer_Size > Emission_Table_Type;
 
-    struct Matrix_Entry
+    struct Beam_Entry
     {
-        Float_Type alpha; // := Pr[ MLSS producing e_1 ... e_i, with S_i == j ]
-        unsigned beta;    // := previous state in the MLSS
-    }; // struct Matrix_Entry
+        unsigned state;   // := state/kmer index
+        unsigned prev;    // := index of the previous entry in the MLSS
+        Float_Type alpha; // := Pr[ MLSS producing e_1 ... e_i, with S_i == state ]
+    }; // struct Beam_Entry
 
     static const unsigned n_states = Pore_Model_Type::n_states;
+    // back-pointers are stored as indexes in from_v, this one means "none"
+    static const unsigned no_beta = 0xFF;
 
     unsigned n_events() const { return _n_events; }
     Float_Type path_probability() const { return _path_probability; }
 
     // i: event index
     // j: state/kmer index
-    const Matrix_Entry& cell(unsigned i, unsigned j) const { return _m[i * n_states + j]; }
-    Matrix_Entry& cell(unsigned i, unsigned j) { return _m[i * n_states + j]; }
+    // beta := index in st.neighbours(j).from_v of the previous state in the MLSS
+    unsigned beta(unsigned i, unsigned j) const { return _beta[static_cast< size_t >(i) * n_states + j]; }
+    // alpha := Pr[ MLSS producing e_1 ... e_{n-1}, with S_{n-1} == j ]
+    Float_Type last_alpha(unsigned j) const { return _alpha[(n_events() - 1) % 2][j]; }
 
+    // beam search: number of states kept per event (0: keep all)
+    static unsigned& beam_width() { static unsigned _beam_width = 0; return _beam_width; }
+    // beam search: drop states with log score below the event maximum by more than this
+    static Float_Type& beam_margin() { static Float_Type _beam_margin = INFINITY; return _beam_margin; }
+    static bool use_beam() { return beam_width() > 0 or beam_margin() < INFINITY; }
+
+    // beam search: entries kept for event i
+    unsigned beam_size(unsigned i) const { return _beam_row_start[i + 1] - _beam_row_start[i]; }
+    const Beam_Entry& beam_entry(unsigned i, unsigned k) const { return _beam[_beam_row_start[i] + k]; }
+
+    // checkpointing: keep alpha rows only every ~sqrt(n) events, and recompute
+    // back-pointers one segment at a time during traceback
+    static bool& checkpointing() { static bool _checkpointing = false; return _checkpointing; }
+
+    // quantized: int16 scores in units of 1 / quantization_scale() nats (see fill_quantized())
+    static bool& quantized() { static bool _quantized = false; return _quantized; }
+    static Float_Type& quantization_scale() { static Float_Type _quantization_scale = 256; return _quantization_scale; }
+
+    // windows: reads longer than 2 * window_size() events are decoded in windows of ~window_size()
+    // events, extended by window_overlap() events on each side, on separate threads (0: off)
+    static unsigned& window_size() { static unsigned _window_size = 0; return _window_size; }
+    static unsigned& window_overlap() { static unsigned _window_overlap = 256; return _window_overlap; }
+    static bool use_windows(unsigned n_events) { return window_size() > 0 and n_events > 2 * window_size(); }
+
+    // use the reference scan of from_v lists instead of the pattern kernel, or of the de Bruijn
+    // groups of the transitions where there is no kernel
+    static bool& scalar_kernel() { static bool _scalar_kernel = false; return _scalar_kernel; }
+
+    // the state loop of every event is split across the threads of a team, see Thread_Team_Handle
     static unsigned& n_threads() { static unsigned _n_threads = 1; return _n_threads; }
+    void set_thread_team(Thread_Team* team_ptr) { _team.set(team_ptr); }
 
     void fill(const Pore_Model_Type& pm,
               const State_Transitions_Type& st,
               Event_Sequence_Type& ev)
+    {
+        if (use_beam())
+        {
+            fill_beam(pm, st, ev);
+        }
+        else if (use_windows(ev.size()))
+        {
+            fill_windowed(pm, st, ev);
+        }
+        else
+        {
+            fill_exhaustive(pm, st, ev);
+        }
+    }
+
+    // exhaustive search over all states, as selected by quantized() and checkpointing()
+    void fill_exhaustive(const Pore_Model_Type& pm,
+                         const State_Transitions_Type& st,
+                         Event_Sequence_Type& ev)
+    {
+        if (quantized())
+        {
+            fill_quantized(pm, st, ev);
+        }
+        else if (checkpointing())
+        {
+            fill_checkpointed(pm, st, ev);
+        }
+        else
+        {
+            fill_full(pm, st, ev);
+        }
+    }
+
+    // Score only: compute path_probability() with two alpha rows, leaving the events untouched.
+    // The drift correction is applied on the fly, so the events need not be copied.
+    // Beam search and checkpointing settings are ignored.
+    void fill_score(const Pore_Model_Type& pm,
+                    const State_Transitions_Type& st,
+                    const Event_Sequence_Type& ev,
+                    Float_Type drift = 0)
     {
         _n_events = ev.size();
-        _m.clear();
-        _m.resize(n_states * n_events());
-        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+        _beam.clear();
+        _beam_row_start.clear();
+        _checkpoint_v.clear();
+        check_transitions(st);
+        _alpha[0].resize(n_states);
+        _alpha[1].resize(n_states);
+        // back-pointers of the current row are computed but not kept
+        _beta.clear();
+        _beta.resize(n_states);
+        fill_first_row(pm, ev, drift, _alpha[0].data(), _beta.data());
+        fill_rows(pm, st, ev, drift, 1, n_events(),
+                  [&] (unsigned) { return _beta.data(); },
+                  [] (unsigned) {});
+        find_last_state();
+        _beta.clear();
+    }
+
+    void fill_full(const Pore_Model_Type& pm,
+                   const State_Transitions_Type& st,
+                   Event_Sequence_Type& ev)
+    {
+        _n_events = ev.size();
+        _beam.clear();
+        _beam_row_start.clear();
+        check_transitions(st);
+        // only the previous alpha row is needed by the recursion
+        _alpha[0].resize(n_states);
+        _alpha[1].resize(n_states);
+        _checkpoint_v.clear();
+        _beta.clear();
+        _beta.resize(static_cast< size_t >(n_states) * n_events());
         //
         // alpha, beta; i == 0
         //
+        fill_first_row(pm, ev, 0, _alpha[0].data(), _beta.data());
+        //
+        // alpha, beta; i > 0
+        //
+        fill_rows(pm, st, ev, 0, 1, n_events(),
+                  [&] (unsigned i) { return &_beta[static_cast< size_t >(i) * n_states]; },
+                  [] (unsigned) {});
+        fill_state_seq(st, ev, find_last_state());
+        fill_move_seq(ev);
+    }
+
+    // Quantized: scores are int16, in units of 1 / quantization_scale() nats, with saturating
+    // arithmetic. Every row is shifted by the maximum of the previous row, and emissions by the
+    // maximum of their row, so scores stay in [-32768, 0]; states further than
+    // 32768 / quantization_scale() nats below the best one are clamped. The SIMD kernels process
+    // twice as many states per instruction as with float scores. Rounding can change the choice
+    // between paths with nearly equal scores, and path_probability() is approximate.
+    void fill_quantized(const Pore_Model_Type& pm,
+                        const State_Transitions_Type& st,
+                        Event_Sequence_Type& ev)
+    {
+        _n_events = ev.size();
+        _beam.clear();
+        _beam_row_start.clear();
+        _checkpoint_v.clear();
+        check_transitions(st);
+        quantize_transitions(st);
+        _alpha_q[0].resize(n_states);
+        _alpha_q[1].resize(n_states);
+        _beta.clear();
+        _beta.resize(static_cast< size_t >(n_states) * n_events());
+        // constant removed from the scores, in nats
+        _score_offset = -std::log(static_cast< double >(n_states));
+        //
+        // i == 0
+        //
+        fill_emission_q(pm, ev, 0, 1);
+        std::copy_n(_emission_q.begin(), n_states, _alpha_q[0].begin());
+        std::fill_n(_beta.begin(), n_states, no_beta);
+        _score_offset += max_q(_alpha_q[0].data()) / quantization_scale();
+        //
+        // i > 0
+        //
+        for (unsigned i_block = 1; i_block < n_events(); i_block += Emission_Table_Type::block_rows())
         {
-            LOG("Viterbi", debug1) << "forward: i=0" << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
+            unsigned i_block_end = std::min(n_events(), i_block + Emission_Table_Type::block_rows());
+            fill_emission_q(pm, ev, i_block, i_block_end);
+            team().for_each_row(
+                i_block_end - i_block, n_states, 32,
+                [&] (unsigned r, unsigned j_begin, unsigned j_end) {
+                    unsigned i = i_block + r;
+                    fill_row_q(st, &_emission_q[static_cast< size_t >(r) * n_states], i,
+                               _alpha_q[(i - 1) % 2].data(), _alpha_q[i % 2].data(),
+                               &_beta[static_cast< size_t >(i) * n_states],
+                               j_begin, j_end);
+                },
+                [&] (unsigned r) {
+                    unsigned i = i_block + r;
+                    _score_offset += max_q(_alpha_q[i % 2].data()) / quantization_scale();
+                });
+        }
+        //
+        // most likely last state; its score is the last row maximum, included in the offset
+        //
+        const auto& alpha_last = _alpha_q[(n_events() - 1) % 2];
+        unsigned max_j = std::max_element(alpha_last.begin(), alpha_last.end()) - alpha_last.begin();
+        _path_probability = _score_offset;
+        fill_state_seq(st, ev, max_j);
+        fill_move_seq(ev);
+    }
+
+    // Checkpointing: the forward pass keeps only the alpha rows at multiples of
+    // ~sqrt(n), then the traceback recomputes each segment from its checkpoint,
+    // last segment first. The recomputation repeats the same arithmetic, so the
+    // state sequence is identical to that of fill_full().
+    void fill_checkpointed(const Pore_Model_Type& pm,
+                           const State_Transitions_Type& st,
+                           Event_Sequence_Type& ev)
+    {
+        _n_events = ev.size();
+        _beam.clear();
+        _beam_row_start.clear();
+        check_transitions(st);
+        _alpha[0].resize(n_states);
+        _alpha[1].resize(n_states);
+        unsigned interval = std::max(1u, static_cast< unsigned >(std::ceil(std::sqrt(n_events()))));
+        unsigned n_checkpoints = (n_events() + interval - 1) / interval;
+        _checkpoint_v.clear();
+        _checkpoint_v.resize(static_cast< size_t >(n_states) * n_checkpoints);
+        // back-pointers of one segment
+        _beta.clear();
+        _beta.resize(static_cast< size_t >(n_states) * (interval + 1));
+        //
+        // forward pass, saving checkpoints
+        //
+        fill_first_row(pm, ev, 0, _alpha[0].data(), _beta.data());
+        std::copy(_alpha[0].begin(), _alpha[0].end(), _checkpoint_v.begin());
+        fill_rows(pm, st, ev, 0, 1, n_events(),
+                  [&] (unsigned) { return _beta.data(); },
+                  [&] (unsigned i) {
+                      if (i % interval == 0)
+                      {
+                          std::copy(_alpha[i % 2].begin(), _alpha[i % 2].end(),
+                                    _checkpoint_v.begin() + static_cast< size_t >(n_states) * (i / interval));
+                      }
+                  });
+        unsigned max_j = find_last_state();
+        //
+        // traceback, recomputing the back-pointers of rows (c * interval, (c + 1) * interval]
+        //
+        for (unsigned c = n_checkpoints; c > 0; --c)
+        {
+            unsigned seg_start = (c - 1) * interval;
+            unsigned seg_end = std::min(c * interval, n_events() - 1);
+            if (seg_end <= seg_start) continue;
+            LOG("Viterbi", debug1)
+                << "traceback: segment [" << seg_start << "," << seg_end << "]" << std::endl;
+            std::copy_n(_checkpoint_v.begin() + static_cast< size_t >(n_states) * (c - 1),
+                        n_states, _alpha[seg_start % 2].begin());
+            fill_rows(pm, st, ev, 0, seg_start + 1, seg_end + 1,
+                      [&] (unsigned i) { return &_beta[static_cast< size_t >(i - seg_start) * n_states]; },
+                      [] (unsigned) {});
+            for (unsigned i = seg_end; i > seg_start; --i)
             {
-                // alpha
-                cell(0, j).alpha = pm.log_pr_corrected_emission(j, ev[0]) - log_n_states;
-                // beta
-                cell(0, j).beta = n_states;
-                LOG("Viterbi", debug2)
-                    << "i=0 j=" << Kmer_Type::to_string(j)
-                    << " alpha=" << cell(0, j).alpha
-                    << " beta=" << cell(0, j).beta << std::endl;
+                set_state(ev[i], max_j);
+                max_j = st.neighbours(max_j).from_v[_beta[static_cast< size_t >(i - seg_start) * n_states + max_j]].first;
             }
         }
+        set_state(ev[0], max_j);
+        fill_move_seq(ev);
+    }
+
+    // Windows: the events are split at window boundaries, and every window is decoded
+    // independently, extended past its boundaries by an overlap; the windows are spread over the
+    // threads of the team. At every boundary, the paths of the two windows are stitched at the
+    // event closest to the boundary, within the overlap, where they are in the same state. If
+    // there is no such event, the overlap of that boundary is doubled and the two windows are
+    // decoded again; once the overlap reaches a neighbouring boundary, the two windows are merged.
+    // path_probability() is the log probability of the stitched path.
+    void fill_windowed(const Pore_Model_Type& pm,
+                       const State_Transitions_Type& st,
+                       Event_Sequence_Type& ev)
+    {
+        _n_events = ev.size();
+        _beam.clear();
+        _beam_row_start.clear();
+        _checkpoint_v.clear();
+        _beta.clear();
+        check_transitions(st);
+        unsigned n_windows = std::max(1u, n_events() / window_size());
+        // every window has at least window_size() events, so the initial overlaps stay within them
+        unsigned overlap = std::max(1u, std::min(window_overlap(), window_size() / 2));
+        // boundary k separates windows k - 1 and k
+        std::vector< unsigned > bound_v;
+        std::vector< unsigned > overlap_v;
+        for (unsigned k = 0; k <= n_windows; ++k)
+        {
+            bound_v.push_back(static_cast< size_t >(n_events()) * k / n_windows);
+            overlap_v.push_back(0 < k and k < n_windows? overlap : 0);
+        }
+        // decoded state sequences, by event range
+        std::map< std::pair< unsigned, unsigned >, std::vector< unsigned > > path_m;
+        auto window_range = [&] (unsigned k) {
+            return std::make_pair(bound_v[k] - overlap_v[k], bound_v[k + 1] + overlap_v[k + 1]);
+        };
+        std::vector< unsigned > stitch_v;
+        while (true)
+        {
+            std::vector< std::pair< unsigned, unsigned > > todo;
+            for (unsigned k = 0; k + 1 < bound_v.size(); ++k)
+            {
+                auto r = window_range(k);
+                if (not path_m.count(r))
+                {
+                    todo.push_back(r);
+                    path_m[r];
+                }
+            }
+            decode_windows(pm, st, ev, todo, path_m);
+            // stitch points, in increasing order
+            stitch_v.assign(1, 0);
+            std::vector< unsigned > failed_v;
+            for (unsigned k = 1; k + 1 < bound_v.size(); ++k)
+            {
+                const auto& path_left = path_m.at(window_range(k - 1));
+                const auto& path_right = path_m.at(window_range(k));
+                unsigned left_begin = window_range(k - 1).first;
+                unsigned right_begin = window_range(k).first;
+                unsigned stitch = n_events();
+                for (unsigned d = 0; d < overlap_v[k] and stitch == n_events(); ++d)
+                {
+                    for (unsigned i : { bound_v[k] + d, bound_v[k] - 1 - d })
+                    {
+                        if (i >= std::max(bound_v[k] - overlap_v[k], stitch_v.back())
+                            and i < bound_v[k] + overlap_v[k]
+                            and path_left[i - left_begin] == path_right[i - right_begin])
+                        {
+                            stitch = i;
+                            break;
+                        }
+                    }
+                }
+                if (stitch < n_events())
+                {
+                    stitch_v.push_back(stitch);
+                }
+                else
+                {
+                    failed_v.push_back(k);
+                }
+            }
+            if (failed_v.empty()) break;
+            // widen the overlap of boundaries without a stitch point, or remove them
+            for (auto it = failed_v.rbegin(); it != failed_v.rend(); ++it)
+            {
+                unsigned k = *it;
+                overlap_v[k] *= 2;
+                LOG("Viterbi", debug)
+                    << "windows: no stitch point at boundary [" << bound_v[k]
+                    << "], overlap [" << overlap_v[k] << "]" << std::endl;
+                if (overlap_v[k] >= bound_v[k] - bound_v[k - 1] or overlap_v[k] >= bound_v[k + 1] - bound_v[k])
+                {
+                    bound_v.erase(bound_v.begin() + k);
+                    overlap_v.erase(overlap_v.begin() + k);
+                }
+            }
+        }
+        stitch_v.push_back(n_events());
         //
-        // alpha, beta; i > 0
+        // stitched path
+        //
+        std::vector< unsigned > state_v(n_events());
+        for (unsigned k = 0; k + 1 < bound_v.size(); ++k)
+        {
+            const auto& path = path_m.at(window_range(k));
+            unsigned begin = window_range(k).first;
+            for (unsigned i = stitch_v[k]; i < stitch_v[k + 1]; ++i)
+            {
+                state_v[i] = path[i - begin];
+            }
+        }
+        _path_probability = -std::log(static_cast< Float_Type >(n_states));
+        for (unsigned i = 0; i < n_events(); ++i)
+        {
+            set_state(ev[i], state_v[i]);
+            _path_probability += pm.log_pr_corrected_emission(state_v[i], ev[i]);
+            if (i > 0)
+            {
+                for (const auto& p : st.neighbours(state_v[i]).from_v)
+                {
+                    if (p.first == state_v[i - 1])
+                    {
+                        _path_probability += p.second;
+                        break;
+                    }
+                }
+            }
+        }
+        fill_move_seq(ev);
+    }
+
+    // Beam search: for every event, keep only the top scoring states,
+    // and expand only their successors.
+    void fill_beam(const Pore_Model_Type& pm,
+                   const State_Transitions_Type& st,
+                   Event_Sequence_Type& ev)
+    {
+        _n_events = ev.size();
+        _beta.clear();
+        _checkpoint_v.clear();
+        _beam.clear();
+        _beam_row_start.clear();
+        _beam_row_start.reserve(n_events() + 1);
+        if (beam_width() > 0)
+        {
+            _beam.reserve(n_states + static_cast< size_t >(n_events()) * beam_width());
+        }
+        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+        // dense scratch row, reset after every event
+        std::vector< Beam_Entry > row(n_states, Beam_Entry{ n_states, 0, -INFINITY });
+        std::vector< unsigned > touched;
+        touched.reserve(n_states);
+        //
+        // i == 0
+        //
+        _beam_row_start.push_back(0);
+        LOG("Viterbi", debug1) << "beam: i=0" << std::endl;
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            _beam.push_back(Beam_Entry{ j, 0, pm.log_pr_corrected_emission(j, ev[0]) - log_n_states });
+        }
+        prune_beam_row();
+        //
+        // i > 0
         //
         for (unsigned i = 1; i < n_events(); ++i)
         {
-            LOG("Viterbi", debug1) << "forward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j) // TODO: parallelize
+            LOG("Viterbi", debug1) << "beam: i=" << i << std::endl;
+            unsigned prev_start = _beam_row_start[i - 1];
+            unsigned prev_end = _beam.size();
+            for (unsigned k = prev_start; k < prev_end; ++k)
             {
-                cell(i, j).alpha = -INFINITY;
-                cell(i, j).beta = n_states;
-                for (const auto& p : st.neighbours(j).from_v)
+                const unsigned j_prev = _beam[k].state;
+                for (const auto& p : st.neighbours(j_prev).to_v)
                 {
-                    const unsigned& j_prev = p.first;
+                    const unsigned& j = p.first;
                     const Float_Type& log_pr_transition = p.second;
-                    Float_Type v = log_pr_transition + cell(i - 1, j_prev).alpha;
-                    if (v > cell(i, j).alpha)
+                    Float_Type v = log_pr_transition + _beam[k].alpha;
+                    if (row[j].state == n_states)
                     {
-                        cell(i, j).alpha = v;
-                        cell(i, j).beta = j_prev;
+                        touched.push_back(j);
+                        row[j].state = j;
+                    }
+                    // on ties, prefer the smaller previous state, as the exhaustive fill does
+                    if (v > row[j].alpha
+                        or (v == row[j].alpha and j_prev < _beam[row[j].prev].state))
+                    {
+                        row[j].alpha = v;
+                        row[j].prev = k;
                     }
                 }
-                cell(i, j).alpha += pm.log_pr_corrected_emission(j, ev[i]);
-                LOG("Viterbi", debug2)
-                    << "i=" << i << " j=" << Kmer_Type::to_string(j)
-                    << " alpha=" << cell(i, j).alpha
-                    << " beta=" << cell(i, j).beta << std::endl;
             }
+            _beam_row_start.push_back(_beam.size());
+            for (auto j : touched)
+            {
+                row[j].alpha += pm.log_pr_corrected_emission(j, ev[i]);
+                _beam.push_back(row[j]);
+                row[j] = Beam_Entry{ n_states, 0, -INFINITY };
+            }
+            touched.clear();
+            prune_beam_row();
+            LOG("Viterbi", debug2)
+                << "i=" << i << " beam_size=" << beam_size(i) << std::endl;
         }
-        fill_state_seq(ev);
+        _beam_row_start.push_back(_beam.size());
+        fill_state_seq_beam(ev);
         fill_move_seq(ev);
     }
 
     friend std::ostream& operator << (std::ostream& os, const Viterbi& vit)
     {
+        if (not vit._beam.empty())
+        {
+            for (unsigned i = 0; i < vit.n_events(); ++i)
+            {
+                for (unsigned k = 0; k < vit.beam_size(i); ++k)
+                {
+                    const auto& e = vit.beam_entry(i, k);
+                    os << i << '\t' << e.state << '\t'
+                       << e.alpha << '\t'
+                       << (i > 0? vit._beam[e.prev].state : vit.n_states) << std::endl;
+                }
+            }
+            return os;
+        }
+        if (not vit._checkpoint_v.empty()
+            or vit._beta.size() != static_cast< size_t >(vit.n_states) * vit.n_events())
+        {
+            // back-pointers were not kept
+            return os;
+        }
         for (unsigned i = 0; i < vit.n_events(); ++i)
         {
             for (unsigned j = 0; j < vit.n_states; ++j)
             {
                 os << i << '\t' << j << '\t'
-                   << vit.cell(i, j).alpha << '\t'
-                   << vit.cell(i, j).beta << std::endl;
+                   << vit.beta(i, j) << std::endl;
             }
         }
         return os;
     }
 
 private:
-    std::vector< Matrix_Entry > _m;
+    std::array< std::vector< Float_Type >, 2 > _alpha;
+    std::vector< uint8_t > _beta;
+    std::vector< Float_Type > _checkpoint_v;
+    std::vector< Beam_Entry > _beam;
+    std::vector< unsigned > _beam_row_start;
     Float_Type _path_probability;
     unsigned _n_events;
+    Thread_Team_Handle _team;
+    Emission_Table_Type _emission;
+    std::array< std::vector< int16_t >, 2 > _alpha_q;
+    std::vector< int16_t > _emission_q;
+    std::vector< Float_Type > _emission_max_v;
+    std::vector< int16_t > _pattern_weights_q;
+    std::vector< int16_t > _from_weights_q;
+    std::vector< unsigned > _from_start_q;
+    double _score_offset;
 
-    void fill_state_seq(Event_Sequence_Type& ev)
+    // decode the given event ranges independently, spread over the team
+    void decode_windows(const Pore_Model_Type& pm,
+                        const State_Transitions_Type& st,
+                        const Event_Sequence_Type& ev,
+                        const std::vector< std::pair< unsigned, unsigned > >& range_v,
+                        std::map< std::pair< unsigned, unsigned >, std::vector< unsigned > >& path_m)
+    {
+        team().grow();
+        team().run([&] (unsigned tid) {
+                Thread_Team solo_team;
+                for (unsigned w = tid; w < range_v.size(); w += team().size())
+                {
+                    const auto& r = range_v[w];
+                    LOG("Viterbi", debug) << "windows: decoding [" << r.first << "," << r.second << ")" << std::endl;
+                    Event_Sequence_Type window_ev(ev.begin() + r.first, ev.begin() + r.second);
+                    Viterbi vit;
+                    vit.set_thread_team(&solo_team);
+                    vit.fill_exhaustive(pm, st, window_ev);
+                    // entries exist already: the map is not modified concurrently
+                    auto& path = path_m.at(r);
+                    path.resize(window_ev.size());
+                    for (unsigned i = 0; i < window_ev.size(); ++i)
+                    {
+                        path[i] = window_ev[i].model_state_idx;
+                    }
+                }
+            });
+    }
+
+    // keep the top scoring entries of the last beam row
+    void prune_beam_row()
+    {
+        auto row_begin = _beam.begin() + _beam_row_start.back();
+        auto row_end = _beam.end();
+        auto cmp = [] (const Beam_Entry& lhs, const Beam_Entry& rhs) { return lhs.alpha > rhs.alpha; };
+        if (beam_width() > 0 and static_cast< unsigned >(row_end - row_begin) > beam_width())
+        {
+            std::nth_element(row_begin, row_begin + (beam_width() - 1), row_end, cmp);
+            row_end = row_begin + beam_width();
+        }
+        if (beam_margin() < INFINITY)
+        {
+            Float_Type max_v = -INFINITY;
+            for (auto it = row_begin; it != row_end; ++it)
+            {
+                max_v = std::max(max_v, it->alpha);
+            }
+            row_end = std::partition(
+                row_begin, row_end,
+                [&] (const Beam_Entry& e) { return e.alpha >= max_v - beam_margin(); });
+        }
+        _beam.erase(row_end, _beam.end());
+    }
+
+    // back-pointers must fit in one byte
+    static void check_transitions(const State_Transitions_Type& st)
+    {
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            if (st.neighbours(j).from_v.size() >= no_beta)
+            {
+                LOG(error)
+                    << "state [" << Kmer_Type::to_string(j) << "] has too many predecessors ["
+                    << st.neighbours(j).from_v.size() << "]; maximum is ["
+                    << no_beta - 1 << "]" << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    void fill_first_row(const Pore_Model_Type& pm,
+                        const Event_Sequence_Type& ev,
+                        Float_Type drift,
+                        Float_Type* alpha_crt, uint8_t* beta_crt)
+    {
+        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+        LOG("Viterbi", debug1) << "forward: i=0" << std::endl;
+        _emission.fill(pm, ev, 0, 1, drift);
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            alpha_crt[j] = _emission.at(0, j) - log_n_states;
+            beta_crt[j] = no_beta;
+            LOG("Viterbi", debug2)
+                << "i=0 j=" << Kmer_Type::to_string(j)
+                << " alpha=" << alpha_crt[j] << std::endl;
+        }
+    }
+
+    Thread_Team& team() { return _team.get(n_threads()); }
+
+    // fill rows [i_begin, i_end), using the alpha rows i % 2;
+    // drift: drift correction not yet applied to the events
+    // beta_row_fn(i): back-pointer row of event i
+    // row_done_fn(i): called once row i is complete
+    template < typename Beta_Row_Fn, typename Row_Done_Fn >
+    void fill_rows(const Pore_Model_Type& pm,
+                   const State_Transitions_Type& st,
+                   const Event_Sequence_Type& ev,
+                   Float_Type drift,
+                   unsigned i_begin, unsigned i_end,
+                   Beta_Row_Fn&& beta_row_fn, Row_Done_Fn&& row_done_fn)
+    {
+        // emissions are computed one block of events at a time
+        for (unsigned i_block = i_begin; i_block < i_end; i_block += Emission_Table_Type::block_rows())
+        {
+            unsigned i_block_end = std::min(i_end, i_block + Emission_Table_Type::block_rows());
+            _emission.reset(pm, ev, i_block, i_block_end, drift);
+            // kernel blocks must not be split
+            team().run([&] (unsigned tid) {
+                    auto r = team().range(tid, n_states, 16);
+                    _emission.fill_states(r.first, r.second);
+                });
+            team().for_each_row(
+                i_block_end - i_block, n_states, 16,
+                [&] (unsigned r, unsigned j_begin, unsigned j_end) {
+                    unsigned i = i_block + r;
+                    fill_row(st, _emission.row(i), i,
+                             _alpha[(i - 1) % 2].data(), _alpha[i % 2].data(), beta_row_fn(i),
+                             j_begin, j_end);
+                },
+                [&] (unsigned r) { row_done_fn(i_block + r); });
+        }
+    }
+
+    // emission_row: log emission probabilities of event i
+    void fill_row(const State_Transitions_Type& st,
+                  const Float_Type* emission_row,
+                  unsigned i,
+                  const Float_Type* alpha_prev, Float_Type* alpha_crt, uint8_t* beta_crt,
+                  unsigned j_begin, unsigned j_end) const
+    {
+        LOG("Viterbi", debug1) << "forward: i=" << i << " j=[" << j_begin << "," << j_end << ")" << std::endl;
+        if (st.has_pattern() and not scalar_kernel()
+            and Viterbi_Kernel_Type::max_row(st, alpha_prev, alpha_crt, beta_crt, j_begin, j_end))
+        {
+            for (unsigned j = j_begin; j < j_end; ++j)
+            {
+                alpha_crt[j] += emission_row[j];
+            }
+            return;
+        }
+        bool grouped = st.has_groups() and not scalar_kernel();
+        // without a kernel: the best step and skip predecessors are found once per de Bruijn group;
+        // from_v is sorted by predecessor, so ties go to the smaller predecessor, as in the scan
+        assert(j_begin % 16 == 0 and j_end % 16 == 0);
+        std::array< Float_Type, State_Transitions_Type::n_step_groups > step_max;
+        std::array< uint8_t, State_Transitions_Type::n_step_groups > step_arg;
+        std::array< Float_Type, State_Transitions_Type::n_skip_groups > skip_max;
+        std::array< uint8_t, State_Transitions_Type::n_skip_groups > skip_arg;
+        for (unsigned g = j_begin / 4; grouped and g < j_end / 4; ++g)
+        {
+            step_max[g] = -INFINITY;
+            step_arg[g] = 0;
+            for (unsigned b = 0; b < 4; ++b)
+            {
+                Float_Type v = st.step_group_weights(g)[b] + alpha_prev[State_Transitions_Type::step_group_member(g, b)];
+                if (v > step_max[g])
+                {
+                    step_max[g] = v;
+                    step_arg[g] = b;
+                }
+            }
+        }
+        for (unsigned g = j_begin / 16; grouped and g < j_end / 16; ++g)
+        {
+            skip_max[g] = -INFINITY;
+            skip_arg[g] = 0;
+            for (unsigned b = 0; b < 16; ++b)
+            {
+                Float_Type v = st.skip_group_weights(g)[b] + alpha_prev[State_Transitions_Type::skip_group_member(g, b)];
+                if (v > skip_max[g])
+                {
+                    skip_max[g] = v;
+                    skip_arg[g] = b;
+                }
+            }
+        }
+        for (unsigned j = j_begin; j < j_end; ++j)
+        {
+            if (grouped and st.from_grouped(j))
+            {
+                unsigned g = State_Transitions_Type::step_group(j);
+                unsigned g2 = State_Transitions_Type::skip_group(j);
+                // candidates: (score, predecessor, pattern slot)
+                std::array< std::tuple< Float_Type, unsigned, unsigned >, 3 > cand = {{
+                        std::make_tuple(st.pattern_weights(0)[j] + alpha_prev[j], j, 0u),
+                        std::make_tuple(step_max[g], State_Transitions_Type::step_group_member(g, step_arg[g]),
+                                        1u + step_arg[g]),
+                        std::make_tuple(skip_max[g2], State_Transitions_Type::skip_group_member(g2, skip_arg[g2]),
+                                        5u + skip_arg[g2]) }};
+                Float_Type v_max = -INFINITY;
+                unsigned j_max = 0;
+                unsigned k_max = no_beta;
+                for (const auto& c : cand)
+                {
+                    if (std::get< 0 >(c) > v_max
+                        or (std::get< 0 >(c) == v_max and k_max != no_beta and std::get< 1 >(c) < j_max))
+                    {
+                        v_max = std::get< 0 >(c);
+                        j_max = std::get< 1 >(c);
+                        k_max = st.pattern_from_idx(std::get< 2 >(c))[j];
+                    }
+                }
+                alpha_crt[j] = v_max + emission_row[j];
+                beta_crt[j] = k_max;
+                continue;
+            }
+            const auto& from_v = st.neighbours(j).from_v;
+            Float_Type v_max = -INFINITY;
+            unsigned k_max = no_beta;
+            for (unsigned k = 0; k < from_v.size(); ++k)
+            {
+                const unsigned& j_prev = from_v[k].first;
+                const Float_Type& log_pr_transition = from_v[k].second;
+                Float_Type v = log_pr_transition + alpha_prev[j_prev];
+                if (v > v_max)
+                {
+                    v_max = v;
+                    k_max = k;
+                }
+            }
+            alpha_crt[j] = v_max + emission_row[j];
+            beta_crt[j] = k_max;
+            LOG("Viterbi", debug2)
+                << "i=" << i << " j=" << Kmer_Type::to_string(j)
+                << " alpha=" << alpha_crt[j]
+                << " beta=" << k_max << std::endl;
+        }
+    }
+
+    // scale: quantization_scale()
+    static int16_t quantize(Float_Type x, Float_Type scale)
+    {
+        // clamp first: the conversion of out of range values is undefined;
+        // round half to even, like the SIMD conversions
+        Float_Type v = std::max< Float_Type >(INT16_MIN, std::min< Float_Type >(INT16_MAX, x * scale));
+        return static_cast< int16_t >(std::nearbyint(v));
+    }
+    static int16_t adds_q(int a, int b)
+    {
+        return std::max< int >(INT16_MIN, std::min< int >(INT16_MAX, a + b));
+    }
+    static int16_t max_q(const int16_t* row)
+    {
+        int16_t res = INT16_MIN;
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            res = std::max(res, row[j]);
+        }
+        return res;
+    }
+
+    // quantized weights of the from_v lists, concatenated, and of the pattern,
+    // with the same layout as st.pattern_weights()
+    void quantize_transitions(const State_Transitions_Type& st)
+    {
+        Float_Type scale = quantization_scale();
+        _from_weights_q.clear();
+        _from_start_q.resize(n_states + 1);
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            _from_start_q[j] = _from_weights_q.size();
+            for (const auto& p : st.neighbours(j).from_v)
+            {
+                _from_weights_q.push_back(quantize(p.second, scale));
+            }
+        }
+        _from_start_q[n_states] = _from_weights_q.size();
+        _pattern_weights_q.clear();
+        if (not st.has_pattern()) return;
+        _pattern_weights_q.resize(State_Transitions_Type::n_pattern_slots * n_states);
+        for (unsigned slot = 0; slot < State_Transitions_Type::n_pattern_slots; ++slot)
+        {
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                _pattern_weights_q[slot * n_states + j] = quantize(st.pattern_weights(slot)[j], scale);
+            }
+        }
+    }
+
+    // quantized emissions of events [i_begin, i_end), shifted by their row maximum,
+    // which is added to the score offset
+    void fill_emission_q(const Pore_Model_Type& pm, const Event_Sequence_Type& ev,
+                         unsigned i_begin, unsigned i_end)
+    {
+        unsigned n_rows = i_end - i_begin;
+        _emission.reset(pm, ev, i_begin, i_end);
+        _emission_max_v.assign(n_rows, -INFINITY);
+        _emission_q.resize(static_cast< size_t >(n_rows) * n_states);
+        team().run([&] (unsigned tid) {
+                auto r = team().range(tid, n_states, 32);
+                _emission.fill_states(r.first, r.second);
+                team().barrier();
+                Float_Type scale = quantization_scale();
+                auto rows = team().range(tid, n_rows);
+                for (unsigned k = rows.first; k < rows.second; ++k)
+                {
+                    const Float_Type* e = _emission.row(i_begin + k);
+                    int16_t* e_q = &_emission_q[static_cast< size_t >(k) * n_states];
+                    Float_Type e_max = Viterbi_Kernel_Type::quantize_row(e, n_states, scale, e_q);
+                    if (std::isnan(e_max))
+                    {
+                        e_max = *std::max_element(e, e + n_states);
+                        for (unsigned j = 0; j < n_states; ++j)
+                        {
+                            e_q[j] = quantize(e[j] - e_max, scale);
+                        }
+                    }
+                    _emission_max_v[k] = e_max;
+                }
+            });
+        for (unsigned k = 0; k < n_rows; ++k)
+        {
+            _score_offset += _emission_max_v[k];
+        }
+    }
+
+    // every team member computes the shift, i.e., the maximum of the previous row
+    void fill_row_q(const State_Transitions_Type& st,
+                    const int16_t* emission_row,
+                    unsigned i,
+                    const int16_t* alpha_prev, int16_t* alpha_crt, uint8_t* beta_crt,
+                    unsigned j_begin, unsigned j_end) const
+    {
+        LOG("Viterbi", debug1) << "forward_q: i=" << i << " j=[" << j_begin << "," << j_end << ")" << std::endl;
+        int16_t shift = max_q(alpha_prev);
+        if (st.has_pattern() and not scalar_kernel()
+            and Viterbi_Kernel_Type::max_row_q(st, _pattern_weights_q.data(), alpha_prev, shift, emission_row,
+                                               alpha_crt, beta_crt, j_begin, j_end))
+        {
+            return;
+        }
+        for (unsigned j = j_begin; j < j_end; ++j)
+        {
+            const auto& from_v = st.neighbours(j).from_v;
+            const int16_t* w_q = &_from_weights_q[_from_start_q[j]];
+            int16_t v_max = INT16_MIN;
+            unsigned k_max = no_beta;
+            for (unsigned k = 0; k < from_v.size(); ++k)
+            {
+                int16_t v = adds_q(alpha_prev[from_v[k].first], w_q[k]);
+                // clamped scores can be equal: take the first predecessor among them
+                if (v > v_max or k_max == no_beta)
+                {
+                    v_max = v;
+                    k_max = k;
+                }
+            }
+            alpha_crt[j] = adds_q(adds_q(v_max, -shift), emission_row[j]);
+            beta_crt[j] = k_max;
+        }
+    }
+
+    // find the most likely last state, and save the path probability
+    unsigned find_last_state()
     {
-        assert(Kmer_Size <= MAX_K_LEN);
         Float_Type max_v = -INFINITY;
         unsigned max_j = n_states;
         for (unsigned j = 0; j < n_states; ++j)
         {
-            if (cell(n_events() - 1, j).alpha > max_v)
+            if (last_alpha(j) > max_v)
             {
                 max_j = j;
-                max_v = cell(n_events() - 1, j).alpha;
+                max_v = last_alpha(j);
             }
         }
         _path_probability = max_v;
+        return max_j;
+    }
+
+    static void set_state(Event_Type& e, unsigned j)
+    {
+        e.model_state_idx = j;
+        e.set_model_state(Kmer_Type::to_string(j));
+    }
+
+    // max_j: last state of the MLSS
+    void fill_state_seq(const State_Transitions_Type& st, Event_Sequence_Type& ev, unsigned max_j)
+    {
+        assert(Kmer_Size <= MAX_K_LEN);
+        for (unsigned i = n_events() - 1; i > 0; --i)
+        {
+            set_state(ev[i], max_j);
+            max_j = st.neighbours(max_j).from_v[beta(i, max_j)].first;
+        }
+        set_state(ev[0], max_j);
+    }
+
+    void fill_state_seq_beam(Event_Sequence_Type& ev)
+    {
+        assert(Kmer_Size <= MAX_K_LEN);
+        unsigned last_start = _beam_row_start[n_events() - 1];
+        unsigned max_k = last_start;
+        for (unsigned k = last_start; k < _beam_row_start[n_events()]; ++k)
+        {
+            if (_beam[k].alpha > _beam[max_k].alpha)
+            {
+                max_k = k;
+            }
+        }
+        _path_probability = _beam[max_k].alpha;
         for (unsigned i = n_events() - 1; i > 0; --i)
         {
-            ev[i].model_state_idx = max_j;
-            ev[i].set_model_state(Kmer_Type::to_string(ev[i].model_state_idx));
-            max_j = cell(i, max_j).beta;
+            set_state(ev[i], _beam[max_k].state);
+            max_k = _beam[max_k].prev;
         }
-        ev[0].model_state_idx = max_j;
-        ev[0].set_model_state(Kmer_Type::to_string(ev[0].model_state_idx));
+        set_state(ev[0], _beam[max_k].state);
     }
 
     void fill_move_seq(Event_Sequence_Type& ev)
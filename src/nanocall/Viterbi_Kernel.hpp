@@ -0,0 +1,537 @@
+#ifndef __VITERBI_KERNEL_HPP
+#define __VITERBI_KERNEL_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "State_Transitions.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NANOCALL_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/**
+ * Viterbi row kernels over the de Bruijn predecessor pattern of State_Transitions.
+ *
+ * max_row() computes, for every state j in [j_begin, j_end) (multiples of 16),
+ * the same values as a scan of from_v:
+ *   v_max[j] := max_{slot} ( alpha_prev[pattern_pred(j, slot)] + pattern_weights(slot)[j] )
+ *   beta[j]  := pattern_from_idx(slot)[j] of the maximizing slot
+ * Ties are resolved in favour of the smaller from_v index, and states with no
+ * finite predecessor get 0xFF, exactly as with strict comparisons in from_v order.
+ *
+ * The predecessors of 8 (16) consecutive states come from 2 (4) consecutive
+ * previous states in each step slot, and from a single previous state in each
+ * skip slot, so the SIMD kernels need no gathers.
+ *
+ * max_row_multi() advances several models that share the transitions. Their
+ * alpha rows are interleaved in blocks of multi_block_size states (see
+ * multi_offset()), so the predecessors of a block of states are fetched for all
+ * models from neighbouring memory, and every transition weight vector is
+ * loaded once for all models. Back-pointers are not computed.
+ *
+ * max_row_q() is the int16 version of max_row(), with saturating arithmetic:
+ *   alpha_crt[j] := max_{slot} ( alpha_prev[pattern_pred(j, slot)] + weights_q[slot][j] )
+ *                   - shift + emission_row[j]
+ * where the maximum is taken in the same order as in max_row(). The kernels
+ * process 16 (32) states per instruction.
+ */
+template < typename Float_Type, unsigned Kmer_Size >
+struct Viterbi_Kernel
+{
+    typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
+    static const unsigned n_states = State_Transitions_Type::n_states;
+    static const unsigned n_pattern_slots = State_Transitions_Type::n_pattern_slots;
+
+    // interleaved alpha rows: states per block, and models per pass over the slots
+    static const unsigned multi_block_size = 16;
+    static const unsigned multi_chunk_size = 8;
+    static_assert(n_states % multi_block_size == 0, "interleaved blocks must not straddle rows");
+
+    // offset of state j of model m in an interleaved row of n_models models
+    static size_t multi_offset(unsigned n_models, unsigned j, unsigned m)
+    {
+        return (static_cast< size_t >(j / multi_block_size) * n_models + m) * multi_block_size
+            + j % multi_block_size;
+    }
+
+    // 0: none; 1: AVX2; 2: AVX-512
+    // defaults to the best level supported by the cpu; may be lowered for testing
+    static unsigned& simd_level() { static unsigned _simd_level = detect_simd_level(); return _simd_level; }
+
+    static unsigned detect_simd_level()
+    {
+#ifdef NANOCALL_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return 2;
+        if (__builtin_cpu_supports("avx2")) return 1;
+#endif
+        return 0;
+    }
+
+    // returns false if no kernel is available: the caller should then scan from_v lists;
+    // there are no kernels for types other than float
+    template < typename T >
+    static bool max_row(const State_Transitions< T, Kmer_Size >&, const T*, T*, uint8_t*, unsigned, unsigned)
+    {
+        return false;
+    }
+
+    static bool max_row(const State_Transitions< float, Kmer_Size >& st,
+                        const float* alpha_prev, float* v_max, uint8_t* beta,
+                        unsigned j_begin, unsigned j_end)
+    {
+#ifdef NANOCALL_X86_KERNELS
+        if (simd_level() >= 2)
+        {
+            max_row_avx512(st, alpha_prev, v_max, beta, j_begin, j_end);
+            return true;
+        }
+        if (simd_level() >= 1)
+        {
+            max_row_avx2(st, alpha_prev, v_max, beta, j_begin, j_end);
+            return true;
+        }
+#else
+        (void)st; (void)alpha_prev; (void)v_max; (void)beta; (void)j_begin; (void)j_end;
+#endif
+        return false;
+    }
+
+    static bool has_avx512bw()
+    {
+#ifdef NANOCALL_X86_KERNELS
+        static bool _has_avx512bw = __builtin_cpu_supports("avx512bw");
+        return _has_avx512bw;
+#else
+        return false;
+#endif
+    }
+
+    // weights_q: quantized pattern weights, with the layout of st.pattern_weights();
+    // [j_begin, j_end): multiples of 32; returns false if no kernel is available
+    static bool max_row_q(const State_Transitions_Type& st, const int16_t* weights_q,
+                          const int16_t* alpha_prev, int16_t shift, const int16_t* emission_row,
+                          int16_t* alpha_crt, uint8_t* beta,
+                          unsigned j_begin, unsigned j_end)
+    {
+#ifdef NANOCALL_X86_KERNELS
+        if (simd_level() >= 2 and has_avx512bw())
+        {
+            max_row_q_avx512(st, weights_q, alpha_prev, shift, emission_row, alpha_crt, beta, j_begin, j_end);
+            return true;
+        }
+        if (simd_level() >= 1)
+        {
+            max_row_q_avx2(st, weights_q, alpha_prev, shift, emission_row, alpha_crt, beta, j_begin, j_end);
+            return true;
+        }
+#else
+        (void)st; (void)weights_q; (void)alpha_prev; (void)shift; (void)emission_row;
+        (void)alpha_crt; (void)beta; (void)j_begin; (void)j_end;
+#endif
+        return false;
+    }
+
+    // quantized emissions: out[j] := x[j] - x_max, times scale, rounded to nearest (even) and
+    // saturated to int16, where x_max := max_j x[j]; n: multiple of 16
+    // returns x_max, or NAN if no kernel is available
+    template < typename T >
+    static T quantize_row(const T*, unsigned, T, int16_t*)
+    {
+        return NAN;
+    }
+
+    static float quantize_row(const float* x, unsigned n, float scale, int16_t* out)
+    {
+#ifdef NANOCALL_X86_KERNELS
+        if (simd_level() >= 2)
+        {
+            return quantize_row_avx512(x, n, scale, out);
+        }
+        if (simd_level() >= 1)
+        {
+            return quantize_row_avx2(x, n, scale, out);
+        }
+#else
+        (void)x; (void)n; (void)scale; (void)out;
+#endif
+        return NAN;
+    }
+
+    // interleaved rows of n_models models; for each model m and state j in [j_begin, j_end):
+    //   alpha_crt[j, m] := max_{slot} ( alpha_prev[pattern_pred(j, slot), m] + pattern_weights(slot)[j] )
+    //                      + emission_rows[m][j]
+    // returns false if no kernel is available
+    template < typename T >
+    static bool max_row_multi(const State_Transitions< T, Kmer_Size >&, unsigned, const T*, T*, const T* const*,
+                              unsigned, unsigned)
+    {
+        return false;
+    }
+
+    static bool max_row_multi(const State_Transitions< float, Kmer_Size >& st, unsigned n_models,
+                              const float* alpha_prev, float* alpha_crt, const float* const* emission_rows,
+                              unsigned j_begin, unsigned j_end)
+    {
+#ifdef NANOCALL_X86_KERNELS
+        if (simd_level() >= 2)
+        {
+            max_row_multi_avx512(st, n_models, alpha_prev, alpha_crt, emission_rows, j_begin, j_end);
+            return true;
+        }
+        if (simd_level() >= 1)
+        {
+            max_row_multi_avx2(st, n_models, alpha_prev, alpha_crt, emission_rows, j_begin, j_end);
+            return true;
+        }
+#else
+        (void)st; (void)n_models; (void)alpha_prev; (void)alpha_crt; (void)emission_rows; (void)j_begin; (void)j_end;
+#endif
+        return false;
+    }
+
+#ifdef NANOCALL_X86_KERNELS
+    __attribute__((target("avx2")))
+    static inline void update_avx2(__m256& best, __m256i& best_k, __m256 v, const uint8_t* idx)
+    {
+        const __m256 neg_inf = _mm256_set1_ps(-INFINITY);
+        __m256i k = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast< const __m128i* >(idx)));
+        __m256 gt = _mm256_cmp_ps(v, best, _CMP_GT_OQ);
+        __m256 eq = _mm256_and_ps(_mm256_cmp_ps(v, best, _CMP_EQ_OQ),
+                                  _mm256_cmp_ps(v, neg_inf, _CMP_GT_OQ));
+        __m256 lt = _mm256_castsi256_ps(_mm256_cmpgt_epi32(best_k, k));
+        __m256 take = _mm256_or_ps(gt, _mm256_and_ps(eq, lt));
+        best = _mm256_blendv_ps(best, v, take);
+        best_k = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_k), _mm256_castsi256_ps(k), take));
+    }
+
+    __attribute__((target("avx2")))
+    static void max_row_avx2(const State_Transitions< float, Kmer_Size >& st,
+                             const float* alpha_prev, float* v_max, uint8_t* beta,
+                             unsigned j_begin, unsigned j_end)
+    {
+        const __m256i step_perm = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+        for (unsigned j0 = j_begin; j0 < j_end; j0 += 8)
+        {
+            __m256 best = _mm256_set1_ps(-INFINITY);
+            __m256i best_k = _mm256_set1_epi32(0xFF);
+            update_avx2(best, best_k,
+                        _mm256_add_ps(_mm256_loadu_ps(st.pattern_weights(0) + j0), _mm256_loadu_ps(alpha_prev + j0)),
+                        st.pattern_from_idx(0) + j0);
+            for (unsigned slot = 1; slot < 5; ++slot)
+            {
+                const float* a = alpha_prev + State_Transitions_Type::pattern_pred(j0, slot);
+                __m256 a_v = _mm256_permutevar8x32_ps(
+                    _mm256_castps128_ps256(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast< const __m128i* >(a)))),
+                    step_perm);
+                update_avx2(best, best_k,
+                            _mm256_add_ps(_mm256_loadu_ps(st.pattern_weights(slot) + j0), a_v),
+                            st.pattern_from_idx(slot) + j0);
+            }
+            for (unsigned slot = 5; slot < n_pattern_slots; ++slot)
+            {
+                __m256 a_v = _mm256_broadcast_ss(alpha_prev + State_Transitions_Type::pattern_pred(j0, slot));
+                update_avx2(best, best_k,
+                            _mm256_add_ps(_mm256_loadu_ps(st.pattern_weights(slot) + j0), a_v),
+                            st.pattern_from_idx(slot) + j0);
+            }
+            _mm256_storeu_ps(v_max + j0, best);
+            __m128i k16 = _mm_packus_epi32(_mm256_castsi256_si128(best_k), _mm256_extracti128_si256(best_k, 1));
+            _mm_storel_epi64(reinterpret_cast< __m128i* >(beta + j0), _mm_packus_epi16(k16, k16));
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    static inline void update_avx512(__m512& best, __m512i& best_k, __m512 v, const uint8_t* idx)
+    {
+        const __m512 neg_inf = _mm512_set1_ps(-INFINITY);
+        __m512i k = _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm_loadu_si128(reinterpret_cast< const __m128i* >(idx)));
+        __mmask16 take = (_mm512_cmp_ps_mask(v, best, _CMP_GT_OQ)
+                          | (_mm512_cmp_ps_mask(v, best, _CMP_EQ_OQ)
+                             & _mm512_cmp_ps_mask(v, neg_inf, _CMP_GT_OQ)
+                             & _mm512_cmpgt_epi32_mask(best_k, k)));
+        best = _mm512_mask_blend_ps(take, best, v);
+        best_k = _mm512_mask_blend_epi32(take, best_k, k);
+    }
+
+    __attribute__((target("avx512f")))
+    static void max_row_avx512(const State_Transitions< float, Kmer_Size >& st,
+                               const float* alpha_prev, float* v_max, uint8_t* beta,
+                               unsigned j_begin, unsigned j_end)
+    {
+        const __m512i step_perm = _mm512_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+        for (unsigned j0 = j_begin; j0 < j_end; j0 += 16)
+        {
+            __m512 best = _mm512_set1_ps(-INFINITY);
+            __m512i best_k = _mm512_set1_epi32(0xFF);
+            update_avx512(best, best_k,
+                          _mm512_add_ps(_mm512_loadu_ps(st.pattern_weights(0) + j0), _mm512_loadu_ps(alpha_prev + j0)),
+                          st.pattern_from_idx(0) + j0);
+            for (unsigned slot = 1; slot < 5; ++slot)
+            {
+                const float* a = alpha_prev + State_Transitions_Type::pattern_pred(j0, slot);
+                __m512 a_v = _mm512_maskz_permutexvar_ps(0xFFFF, step_perm, _mm512_maskz_loadu_ps(0x000F, a));
+                update_avx512(best, best_k,
+                              _mm512_add_ps(_mm512_loadu_ps(st.pattern_weights(slot) + j0), a_v),
+                              st.pattern_from_idx(slot) + j0);
+            }
+            for (unsigned slot = 5; slot < n_pattern_slots; ++slot)
+            {
+                __m512 a_v = _mm512_set1_ps(alpha_prev[State_Transitions_Type::pattern_pred(j0, slot)]);
+                update_avx512(best, best_k,
+                              _mm512_add_ps(_mm512_loadu_ps(st.pattern_weights(slot) + j0), a_v),
+                              st.pattern_from_idx(slot) + j0);
+            }
+            _mm512_storeu_ps(v_max + j0, best);
+            _mm512_mask_cvtepi32_storeu_epi8(beta + j0, 0xFFFF, best_k);
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static float quantize_row_avx2(const float* x, unsigned n, float scale, int16_t* out)
+    {
+        __m256 x_max_v = _mm256_set1_ps(-INFINITY);
+        for (unsigned j = 0; j < n; j += 8)
+        {
+            x_max_v = _mm256_max_ps(x_max_v, _mm256_loadu_ps(x + j));
+        }
+        __m128 m = _mm_max_ps(_mm256_castps256_ps128(x_max_v), _mm256_extractf128_ps(x_max_v, 1));
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+        float x_max = _mm_cvtss_f32(m);
+        __m256 x_max_v2 = _mm256_set1_ps(x_max);
+        __m256 scale_v = _mm256_set1_ps(scale);
+        for (unsigned j = 0; j < n; j += 16)
+        {
+            __m256i lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j), x_max_v2), scale_v));
+            __m256i hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + j + 8), x_max_v2), scale_v));
+            // packs works within 128-bit lanes
+            _mm256_storeu_si256(reinterpret_cast< __m256i* >(out + j),
+                                _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8));
+        }
+        return x_max;
+    }
+
+    __attribute__((target("avx512f")))
+    static float quantize_row_avx512(const float* x, unsigned n, float scale, int16_t* out)
+    {
+        __m512 x_max_v = _mm512_set1_ps(-INFINITY);
+        for (unsigned j = 0; j < n; j += 16)
+        {
+            x_max_v = _mm512_maskz_max_ps(0xFFFF, x_max_v, _mm512_loadu_ps(x + j));
+        }
+        float lanes[16];
+        _mm512_storeu_ps(lanes, x_max_v);
+        float x_max = *std::max_element(lanes, lanes + 16);
+        __m512 x_max_v2 = _mm512_set1_ps(x_max);
+        __m512 scale_v = _mm512_set1_ps(scale);
+        for (unsigned j = 0; j < n; j += 16)
+        {
+            __m512i v = _mm512_maskz_cvtps_epi32(0xFFFF, _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(x + j), x_max_v2), scale_v));
+            _mm512_mask_cvtsepi32_storeu_epi16(out + j, 0xFFFF, v);
+        }
+        return x_max;
+    }
+
+    __attribute__((target("avx2")))
+    static inline void update_q_avx2(__m256i& best, __m256i& best_k, __m256i v, const uint8_t* idx)
+    {
+        __m256i k = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast< const __m128i* >(idx)));
+        __m256i take = _mm256_or_si256(_mm256_cmpgt_epi16(v, best),
+                                       _mm256_and_si256(_mm256_cmpeq_epi16(v, best),
+                                                        _mm256_cmpgt_epi16(best_k, k)));
+        best = _mm256_blendv_epi8(best, v, take);
+        best_k = _mm256_blendv_epi8(best_k, k, take);
+    }
+
+    __attribute__((target("avx2")))
+    static void max_row_q_avx2(const State_Transitions_Type& st, const int16_t* weights_q,
+                               const int16_t* alpha_prev, int16_t shift, const int16_t* emission_row,
+                               int16_t* alpha_crt, uint8_t* beta,
+                               unsigned j_begin, unsigned j_end)
+    {
+        // step slots: the 16 states of a block have 4 predecessors, each repeated 4 times
+        const __m256i step_shuffle = _mm256_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 2, 3, 2, 3, 2, 3, 2, 3,
+                                                      4, 5, 4, 5, 4, 5, 4, 5, 6, 7, 6, 7, 6, 7, 6, 7);
+        const __m256i shift_v = _mm256_set1_epi16(shift);
+        for (unsigned j0 = j_begin; j0 < j_end; j0 += 16)
+        {
+            __m256i best = _mm256_set1_epi16(INT16_MIN);
+            __m256i best_k = _mm256_set1_epi16(0xFF);
+            update_q_avx2(best, best_k,
+                          _mm256_adds_epi16(_mm256_loadu_si256(reinterpret_cast< const __m256i* >(alpha_prev + j0)),
+                                            _mm256_loadu_si256(reinterpret_cast< const __m256i* >(weights_q + j0))),
+                          st.pattern_from_idx(0) + j0);
+            for (unsigned slot = 1; slot < n_pattern_slots; ++slot)
+            {
+                const int16_t* a = alpha_prev + State_Transitions_Type::pattern_pred(j0, slot);
+                __m256i a_v = (slot < 5
+                               ? _mm256_shuffle_epi8(
+                                   _mm256_broadcastq_epi64(_mm_loadl_epi64(reinterpret_cast< const __m128i* >(a))),
+                                   step_shuffle)
+                               // skip slots: a single predecessor
+                               : _mm256_set1_epi16(*a));
+                const int16_t* w = weights_q + slot * n_states + j0;
+                update_q_avx2(best, best_k,
+                              _mm256_adds_epi16(a_v, _mm256_loadu_si256(reinterpret_cast< const __m256i* >(w))),
+                              st.pattern_from_idx(slot) + j0);
+            }
+            __m256i out = _mm256_adds_epi16(_mm256_subs_epi16(best, shift_v),
+                                            _mm256_loadu_si256(reinterpret_cast< const __m256i* >(emission_row + j0)));
+            _mm256_storeu_si256(reinterpret_cast< __m256i* >(alpha_crt + j0), out);
+            _mm_storeu_si128(reinterpret_cast< __m128i* >(beta + j0),
+                             _mm_packus_epi16(_mm256_castsi256_si128(best_k), _mm256_extracti128_si256(best_k, 1)));
+        }
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    static inline void update_q_avx512(__m512i& best, __m512i& best_k, __m512i v, const uint8_t* idx)
+    {
+        __m512i k = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast< const __m256i* >(idx)));
+        __mmask32 take = (_mm512_cmpgt_epi16_mask(v, best)
+                          | (_mm512_cmpeq_epi16_mask(v, best) & _mm512_cmpgt_epi16_mask(best_k, k)));
+        best = _mm512_mask_blend_epi16(take, best, v);
+        best_k = _mm512_mask_blend_epi16(take, best_k, k);
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    static void max_row_q_avx512(const State_Transitions_Type& st, const int16_t* weights_q,
+                                 const int16_t* alpha_prev, int16_t shift, const int16_t* emission_row,
+                                 int16_t* alpha_crt, uint8_t* beta,
+                                 unsigned j_begin, unsigned j_end)
+    {
+        // the 32 states of a block have 8 predecessors in each step slot, each repeated 4 times,
+        // and 2 predecessors in each skip slot, each repeated 16 times
+        static const int16_t step_idx[32] = { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                              4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7 };
+        static const int16_t skip_idx[32] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+        const __m512i step_perm = _mm512_loadu_si512(step_idx);
+        const __m512i skip_perm = _mm512_loadu_si512(skip_idx);
+        const __m512i shift_v = _mm512_set1_epi16(shift);
+        for (unsigned j0 = j_begin; j0 < j_end; j0 += 32)
+        {
+            __m512i best = _mm512_set1_epi16(INT16_MIN);
+            __m512i best_k = _mm512_set1_epi16(0xFF);
+            update_q_avx512(best, best_k,
+                            _mm512_adds_epi16(_mm512_loadu_si512(alpha_prev + j0), _mm512_loadu_si512(weights_q + j0)),
+                            st.pattern_from_idx(0) + j0);
+            for (unsigned slot = 1; slot < n_pattern_slots; ++slot)
+            {
+                const int16_t* a = alpha_prev + State_Transitions_Type::pattern_pred(j0, slot);
+                __m512i a_v = (slot < 5
+                               ? _mm512_permutexvar_epi16(step_perm, _mm512_maskz_loadu_epi16(0x000000FF, a))
+                               : _mm512_permutexvar_epi16(skip_perm, _mm512_maskz_loadu_epi16(0x00000003, a)));
+                update_q_avx512(best, best_k,
+                                _mm512_adds_epi16(a_v, _mm512_loadu_si512(weights_q + slot * n_states + j0)),
+                                st.pattern_from_idx(slot) + j0);
+            }
+            __m512i out = _mm512_adds_epi16(_mm512_subs_epi16(best, shift_v), _mm512_loadu_si512(emission_row + j0));
+            _mm512_storeu_si512(alpha_crt + j0, out);
+            _mm512_mask_cvtepi16_storeu_epi8(beta + j0, 0xFFFFFFFF, best_k);
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void max_row_multi_avx2(const State_Transitions< float, Kmer_Size >& st, unsigned n_models,
+                                   const float* alpha_prev, float* alpha_crt, const float* const* emission_rows,
+                                   unsigned j_begin, unsigned j_end)
+    {
+        const __m256i step_perm = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+        __m256 best[multi_chunk_size];
+        for (unsigned j0 = j_begin; j0 < j_end; j0 += 8)
+        {
+            for (unsigned m0 = 0; m0 < n_models; m0 += multi_chunk_size)
+            {
+                unsigned n_chunk = std::min(n_models - m0, multi_chunk_size);
+                __m256 w = _mm256_loadu_ps(st.pattern_weights(0) + j0);
+                for (unsigned m = 0; m < n_chunk; ++m)
+                {
+                    best[m] = _mm256_add_ps(w, _mm256_loadu_ps(alpha_prev + multi_offset(n_models, j0, m0 + m)));
+                }
+                for (unsigned slot = 1; slot < 5; ++slot)
+                {
+                    unsigned p = State_Transitions_Type::pattern_pred(j0, slot);
+                    w = _mm256_loadu_ps(st.pattern_weights(slot) + j0);
+                    for (unsigned m = 0; m < n_chunk; ++m)
+                    {
+                        const float* a = alpha_prev + multi_offset(n_models, p, m0 + m);
+                        __m256 a_v = _mm256_permutevar8x32_ps(
+                            _mm256_castps128_ps256(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast< const __m128i* >(a)))),
+                            step_perm);
+                        best[m] = _mm256_max_ps(best[m], _mm256_add_ps(w, a_v));
+                    }
+                }
+                for (unsigned slot = 5; slot < n_pattern_slots; ++slot)
+                {
+                    unsigned p = State_Transitions_Type::pattern_pred(j0, slot);
+                    w = _mm256_loadu_ps(st.pattern_weights(slot) + j0);
+                    for (unsigned m = 0; m < n_chunk; ++m)
+                    {
+                        __m256 a_v = _mm256_broadcast_ss(alpha_prev + multi_offset(n_models, p, m0 + m));
+                        best[m] = _mm256_max_ps(best[m], _mm256_add_ps(w, a_v));
+                    }
+                }
+                for (unsigned m = 0; m < n_chunk; ++m)
+                {
+                    _mm256_storeu_ps(alpha_crt + multi_offset(n_models, j0, m0 + m),
+                                     _mm256_add_ps(best[m], _mm256_loadu_ps(emission_rows[m0 + m] + j0)));
+                }
+            }
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    static void max_row_multi_avx512(const State_Transitions< float, Kmer_Size >& st, unsigned n_models,
+                                     const float* alpha_prev, float* alpha_crt, const float* const* emission_rows,
+                                     unsigned j_begin, unsigned j_end)
+    {
+        const __m512i step_perm = _mm512_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+        __m512 best[multi_chunk_size];
+        for (unsigned j0 = j_begin; j0 < j_end; j0 += 16)
+        {
+            for (unsigned m0 = 0; m0 < n_models; m0 += multi_chunk_size)
+            {
+                unsigned n_chunk = std::min(n_models - m0, multi_chunk_size);
+                __m512 w = _mm512_loadu_ps(st.pattern_weights(0) + j0);
+                for (unsigned m = 0; m < n_chunk; ++m)
+                {
+                    best[m] = _mm512_add_ps(w, _mm512_loadu_ps(alpha_prev + multi_offset(n_models, j0, m0 + m)));
+                }
+                for (unsigned slot = 1; slot < 5; ++slot)
+                {
+                    unsigned p = State_Transitions_Type::pattern_pred(j0, slot);
+                    w = _mm512_loadu_ps(st.pattern_weights(slot) + j0);
+                    for (unsigned m = 0; m < n_chunk; ++m)
+                    {
+                        const float* a = alpha_prev + multi_offset(n_models, p, m0 + m);
+                        __m512 a_v = _mm512_maskz_permutexvar_ps(0xFFFF, step_perm, _mm512_maskz_loadu_ps(0x000F, a));
+                        best[m] = _mm512_maskz_max_ps(0xFFFF, best[m], _mm512_add_ps(w, a_v));
+                    }
+                }
+                for (unsigned slot = 5; slot < n_pattern_slots; ++slot)
+                {
+                    unsigned p = State_Transitions_Type::pattern_pred(j0, slot);
+                    w = _mm512_loadu_ps(st.pattern_weights(slot) + j0);
+                    for (unsigned m = 0; m < n_chunk; ++m)
+                    {
+                        __m512 a_v = _mm512_set1_ps(alpha_prev[multi_offset(n_models, p, m0 + m)]);
+                        best[m] = _mm512_maskz_max_ps(0xFFFF, best[m], _mm512_add_ps(w, a_v));
+                    }
+                }
+                for (unsigned m = 0; m < n_chunk; ++m)
+                {
+                    _mm512_storeu_ps(alpha_crt + multi_offset(n_models, j0, m0 + m),
+                                     _mm512_add_ps(best[m], _mm512_loadu_ps(emission_rows[m0 + m] + j0)));
+                }
+            }
+        }
+    }
+#endif
+}; // struct Viterbi_Kernel
+
+#endif
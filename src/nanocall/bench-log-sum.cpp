@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <tclap/CmdLine.h>
+
+#include "Log_Sum.hpp"
+#include "logsumset.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+#ifndef FLOAT_TYPE
+#define FLOAT_TYPE float
+#endif
+typedef Log_Sum< FLOAT_TYPE > Log_Sum_Type;
+
+namespace opts
+{
+    using namespace TCLAP;
+    string description =
+        "Time Log_Sum against logsum::logsumset on random sets of log probabilities, and report the error of each";
+    CmdLine cmd_parser(description);
+    MultiArg< string > log_level("d", "log-level", "Log level.", false, "string", cmd_parser);
+    MultiArg< unsigned > set_size("", "set-size", "Number of values per set (default: 21 and 4096).", false, "int", cmd_parser);
+    ValueArg< unsigned > n_values("", "values", "Total number of values per run.", false, 1u << 22, "int", cmd_parser);
+    ValueArg< float > spread("", "spread", "Values are drawn uniformly from [-spread, 0].", false, 30, "float", cmd_parser);
+    ValueArg< unsigned > simd_level("", "simd-level", "Maximum SIMD level (0: none, 1: AVX2, 2: AVX-512).", false, 2, "int", cmd_parser);
+    ValueArg< unsigned > seed("", "seed", "Random seed.", false, 42, "int", cmd_parser);
+} // namespace opts
+
+struct Result
+{
+    double ns_per_set;
+    double max_abs_err;
+};
+
+// time fn(set) over all sets, and compare the results to the long double reference
+template < typename Fn >
+Result run(const vector< vector< FLOAT_TYPE > >& sets, const vector< long double >& ref_v, Fn&& fn)
+{
+    Result res;
+    res.max_abs_err = 0;
+    vector< FLOAT_TYPE > val_v(sets.size());
+    auto start = chrono::steady_clock::now();
+    for (unsigned k = 0; k < sets.size(); ++k)
+    {
+        val_v[k] = fn(sets[k]);
+    }
+    auto end = chrono::steady_clock::now();
+    res.ns_per_set = chrono::duration< double, nano >(end - start).count() / sets.size();
+    for (unsigned k = 0; k < sets.size(); ++k)
+    {
+        res.max_abs_err = max(res.max_abs_err, static_cast< double >(fabsl(val_v[k] - ref_v[k])));
+    }
+    return res;
+}
+
+void real_main()
+{
+    Log_Sum_Type::simd_level() = min(Log_Sum_Type::simd_level(), opts::simd_level.get());
+    vector< unsigned > set_size_v = opts::set_size.get();
+    if (set_size_v.empty())
+    {
+        set_size_v = { 21, 4096 };
+    }
+    mt19937 rg(opts::seed);
+    uniform_real_distribution< FLOAT_TYPE > dist(-opts::spread, 0);
+    cout << "set_size\tmethod\tns_per_set\tspeedup\tmax_abs_err" << endl;
+    for (unsigned set_size : set_size_v)
+    {
+        vector< vector< FLOAT_TYPE > > sets(max(opts::n_values.get() / max(set_size, 1u), 1u));
+        vector< long double > ref_v(sets.size());
+        for (unsigned k = 0; k < sets.size(); ++k)
+        {
+            sets[k].resize(set_size);
+            long double s = 0;
+            for (auto& x : sets[k])
+            {
+                x = dist(rg);
+                s += expl(x);
+            }
+            ref_v[k] = logl(s);
+        }
+        Result res_logsumset = run(sets, ref_v, [] (const vector< FLOAT_TYPE >& x) {
+                logsum::logsumset< FLOAT_TYPE > s(false);
+                for (auto v : x) s.add(v);
+                return s.val();
+            });
+        auto print = [&] (const string& method, const Result& res) {
+            cout << set_size << '\t' << method << '\t' << fixed << setprecision(1) << res.ns_per_set << '\t'
+                 << setprecision(2) << res_logsumset.ns_per_set / res.ns_per_set << '\t'
+                 << scientific << setprecision(2) << res.max_abs_err << endl;
+            cout.unsetf(ios_base::floatfield);
+        };
+        print("logsumset", res_logsumset);
+        for (bool fast : { false, true })
+        {
+            Log_Sum_Type::fast() = fast;
+            print(fast? "log_sum_fast" : "log_sum", run(sets, ref_v, [] (const vector< FLOAT_TYPE >& x) {
+                        return Log_Sum_Type::log_sum(x.data(), x.size());
+                    }));
+            print(fast? "set_fast" : "set", run(sets, ref_v, [] (const vector< FLOAT_TYPE >& x) {
+                        Log_Sum_Type::Set s;
+                        for (auto v : x) s.add(v);
+                        return s.val();
+                    }));
+        }
+        Log_Sum_Type::fast() = false;
+    }
+    LOG(info) << "simd_level [" << Log_Sum_Type::simd_level() << "]" << endl;
+}
+
+int main(int argc, char * argv[])
+{
+    opts::cmd_parser.parse(argc, argv);
+    logger::Logger::set_levels_from_options(opts::log_level);
+    real_main();
+}
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <tclap/CmdLine.h>
+
+#include "Pore_Model.hpp"
+#include "State_Transitions.hpp"
+#include "Event.hpp"
+#include "Viterbi.hpp"
+#include "logger.hpp"
+#include "zstr.hpp"
+
+using namespace std;
+
+#ifndef FLOAT_TYPE
+#define FLOAT_TYPE float
+#endif
+#ifndef KMER_SIZE
+#define KMER_SIZE 6
+#endif
+typedef State_Transitions< FLOAT_TYPE, KMER_SIZE > State_Transitions_Type;
+typedef Pore_Model< FLOAT_TYPE, KMER_SIZE > Pore_Model_Type;
+typedef Event< FLOAT_TYPE, KMER_SIZE > Event_Type;
+typedef Event_Sequence< FLOAT_TYPE, KMER_SIZE > Event_Sequence_Type;
+typedef Viterbi< FLOAT_TYPE, KMER_SIZE > Viterbi_Type;
+
+namespace opts
+{
+    using namespace TCLAP;
+    string description =
+        "Compare approximate Viterbi modes against exhaustive float Viterbi on a corpus of event files";
+    CmdLine cmd_parser(description);
+    MultiArg< string > log_level("d", "log-level", "Log level.", false, "string", cmd_parser);
+    ValueArg< string > pm_file_name("p", "pore-model", "Scaled pore model file name.", true, "", "file", cmd_parser);
+    ValueArg< string > st_file_name("s", "state-transitions", "State transitions file name.", true, "", "file", cmd_parser);
+    SwitchArg quantized("", "quantized", "Use int16 scores.", cmd_parser);
+    ValueArg< float > quantization_scale("", "quantization-scale", "Quantized score units per nat.", false, 256, "float", cmd_parser);
+    ValueArg< unsigned > beam_width("", "beam", "Beam width (0: exhaustive).", false, 0, "int", cmd_parser);
+    ValueArg< float > beam_margin("", "beam-margin", "Beam log score margin.", false, INFINITY, "float", cmd_parser);
+    ValueArg< unsigned > window_size("", "window", "Decode reads longer than twice this many events in overlapping windows (0: off).", false, 0, "int", cmd_parser);
+    ValueArg< unsigned > window_overlap("", "window-overlap", "Initial window overlap.", false, 256, "int", cmd_parser);
+    ValueArg< unsigned > num_threads("t", "threads", "Number of threads used within the read.", false, 1, "int", cmd_parser);
+    UnlabeledMultiArg< string > ev_file_names("events", "Events file names.", true, "file", cmd_parser);
+} // namespace opts
+
+// 1 - (edit distance) / (length of the longer sequence)
+double seq_identity(const string& s1, const string& s2)
+{
+    if (s1.empty() and s2.empty()) return 1.0;
+    vector< unsigned > prev(s2.size() + 1);
+    vector< unsigned > crt(s2.size() + 1);
+    for (unsigned j = 0; j <= s2.size(); ++j)
+    {
+        prev[j] = j;
+    }
+    for (unsigned i = 1; i <= s1.size(); ++i)
+    {
+        crt[0] = i;
+        for (unsigned j = 1; j <= s2.size(); ++j)
+        {
+            crt[j] = min(min(prev[j], crt[j - 1]) + 1, prev[j - 1] + (s1[i - 1] != s2[j - 1]));
+        }
+        swap(prev, crt);
+    }
+    return 1.0 - static_cast< double >(prev[s2.size()]) / max(s1.size(), s2.size());
+}
+
+void real_main()
+{
+    Pore_Model_Type pm;
+    State_Transitions_Type st;
+    zstr::ifstream(opts::pm_file_name) >> pm;
+    zstr::ifstream(opts::st_file_name) >> st;
+    Viterbi_Type::n_threads() = std::max(opts::num_threads.get(), 1u);
+    Viterbi_Type::quantization_scale() = opts::quantization_scale;
+    Viterbi_Type::window_overlap() = opts::window_overlap;
+
+    unsigned n_files = 0;
+    unsigned n_identical = 0;
+    size_t n_events_total = 0;
+    size_t n_states_agree_total = 0;
+    double identity_sum = 0;
+    double identity_min = 1.0;
+    cout << "file\tevents\tstates_agree\tbase_seq_identical\tbase_seq_identity\tlog_path_prob\tfull_log_path_prob" << endl;
+    for (const auto& ev_file_name : opts::ev_file_names.get())
+    {
+        Event_Sequence_Type ev;
+        {
+            zstr::ifstream ifs(ev_file_name);
+            Event_Type e;
+            while (ifs >> e)
+            {
+                ev.push_back(e);
+            }
+        }
+        if (ev.empty()) continue;
+        Event_Sequence_Type ev_full(ev);
+        // reference
+        Viterbi_Type::quantized() = false;
+        Viterbi_Type::window_size() = 0;
+        Viterbi_Type::beam_width() = 0;
+        Viterbi_Type::beam_margin() = INFINITY;
+        Viterbi_Type vit_full;
+        vit_full.fill(pm, st, ev_full);
+        // tested mode
+        Viterbi_Type::quantized() = opts::quantized;
+        Viterbi_Type::window_size() = opts::window_size;
+        Viterbi_Type::beam_width() = opts::beam_width;
+        Viterbi_Type::beam_margin() = opts::beam_margin;
+        Viterbi_Type vit;
+        vit.fill(pm, st, ev);
+
+        unsigned n_agree = 0;
+        for (unsigned i = 0; i < ev.size(); ++i)
+        {
+            n_agree += (ev[i].model_state_idx == ev_full[i].model_state_idx);
+        }
+        string base_seq = ev.get_base_seq();
+        string base_seq_full = ev_full.get_base_seq();
+        double identity = seq_identity(base_seq, base_seq_full);
+        bool identical = base_seq == base_seq_full;
+        cout << ev_file_name << '\t' << ev.size() << '\t' << n_agree << '\t'
+             << identical << '\t' << fixed << setprecision(6) << identity << '\t'
+             << setprecision(3) << vit.path_probability() << '\t' << vit_full.path_probability() << endl;
+        cout.unsetf(ios_base::floatfield);
+        ++n_files;
+        n_identical += identical;
+        n_events_total += ev.size();
+        n_states_agree_total += n_agree;
+        identity_sum += identity;
+        identity_min = min(identity_min, identity);
+    }
+    LOG(info)
+        << "summary files [" << n_files
+        << "] base_seq_identical [" << n_identical
+        << "] mean_base_seq_identity [" << (n_files > 0? identity_sum / n_files : 1.0)
+        << "] min_base_seq_identity [" << identity_min
+        << "] state_agreement_rate [" << (n_events_total > 0? (double)n_states_agree_total / n_events_total : 1.0)
+        << "]" << endl;
+}
+
+int main(int argc, char * argv[])
+{
+    opts::cmd_parser.parse(argc, argv);
+    logger::Logger::set_levels_from_options(opts::log_level);
+    real_main();
+}
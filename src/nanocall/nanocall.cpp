@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <deque>
 #include <iostream>
+#include <set>
 #include <string>
+#include <thread>
 #include <tclap/CmdLine.h>
 
 #include <ctime>
@@ -12,9 +15,13 @@
 #include "State_Transitions.hpp"
 #include "Event.hpp"
 #include "Fast5_Summary.hpp"
+#include "Thread_Team.hpp"
 #include "Viterbi.hpp"
+#include "Multi_Viterbi.hpp"
 #include "Forward_Backward.hpp"
+#include "Log_Sum.hpp"
 #include "Parameter_Trainer.hpp"
+#include "Parameter_Pool.hpp"
 #include "logger.hpp"
 #include "alg.hpp"
 #include "zstr.hpp"
@@ -45,7 +52,11 @@ typedef Event< FLOAT_TYPE, KMER_SIZE > Event_Type;
 typedef Event_Sequence< FLOAT_TYPE, KMER_SIZE > Event_Sequence_Type;
 typedef Fast5_Summary< FLOAT_TYPE, KMER_SIZE > Fast5_Summary_Type;
 typedef Parameter_Trainer< FLOAT_TYPE, KMER_SIZE > Parameter_Trainer_Type;
+typedef Parameter_Pool< FLOAT_TYPE > Parameter_Pool_Type;
+typedef Forward_Backward< FLOAT_TYPE, KMER_SIZE > Forward_Backward_Type;
+typedef Log_Sum< FLOAT_TYPE > Log_Sum_Type;
 typedef Viterbi< FLOAT_TYPE, KMER_SIZE > Viterbi_Type;
+typedef Multi_Viterbi< FLOAT_TYPE, KMER_SIZE > Multi_Viterbi_Type;
 
 namespace opts
 {
@@ -61,9 +72,18 @@ namespace opts
     ValueArg< unsigned > min_ed_events("", "min-ed-events", "Minimum EventDetection events.", false, 10, "int", cmd_parser);
     ValueArg< unsigned > fasta_line_width("", "fasta-line-width", "Maximum fasta line width.", false, 80, "int", cmd_parser);
     //
+    ValueArg< unsigned > viterbi_beam("", "viterbi-beam", "Number of states kept per event during basecalling. (default: 0=all)", false, 0, "int", cmd_parser);
+    SwitchArg viterbi_checkpoint("", "viterbi-checkpoint", "During basecalling, keep Viterbi rows only at sqrt(n) checkpoints and recompute them during traceback; use with large --max-ed-events.", cmd_parser);
+    SwitchArg viterbi_quantized("", "viterbi-quantized", "During basecalling, decode with int16 Viterbi scores; faster, but paths of nearly equal probability may be resolved differently.", cmd_parser);
+    ValueArg< unsigned > viterbi_window("", "viterbi-window", "During basecalling, split strands longer than twice this many events into overlapping windows decoded by separate threads. (default: 0=off)", false, 0, "int", cmd_parser);
+    ValueArg< unsigned > viterbi_window_overlap("", "viterbi-window-overlap", "Initial overlap of Viterbi windows, in events; doubled where the paths of neighbouring windows do not agree.", false, 256, "int", cmd_parser);
+    ValueArg< float > viterbi_beam_margin("", "viterbi-beam-margin", "During basecalling, drop states with log score below the event maximum by more than this.", false, INFINITY, "float", cmd_parser);
+    //
     ValueArg< float > scaling_select_threshold("", "scaling-select-threshold", "Select best model per strand during scaling if log score better by threshold.", false, 20.0, "float", cmd_parser);
+    ValueArg< float > scaling_race_margin("", "scaling-race-margin", "After every scaling round, stop training the models whose fit trails the best one by more than this (inf: off).", false, INFINITY, "float", cmd_parser);
     ValueArg< float > scaling_min_progress("", "scaling-min-progress", "Minimum scaling fit progress.", false, 1.0, "float", cmd_parser);
     ValueArg< unsigned > scaling_max_rounds("", "scaling-max-rounds", "Maximum scaling rounds.", false, 10, "int", cmd_parser);
+    SwitchArg scaling_warm_start("", "scaling-warm-start", "Start training a read from the parameters last trained on the same channel, or else the same run (as given by ONT file names), instead of moment matching.", cmd_parser);
     ValueArg< unsigned > scaling_num_events("", "scaling-num-events", "Number of events used for model scaling.", false, 200, "int", cmd_parser);
     //
     SwitchArg single_strand_scaling("", "single-strand-scaling", "Train scaling parameters per strand.", cmd_parser);
@@ -73,6 +93,15 @@ namespace opts
     SwitchArg only_train("", "only-train", "Stop after training.", cmd_parser);
     SwitchArg train("", "train", "Enable training. (default)", cmd_parser);
     SwitchArg no_train("", "no-train", "Disable all training.", cmd_parser);
+    ValueArg< string > scaling_method("", "scaling-method", "Training method: forward-backward posteriors, or the Viterbi path of each read (faster, less accurate).", false, "fwbw", "fwbw|viterbi", cmd_parser);
+    SwitchArg scaled_fwbw("", "scaled-fwbw", "During training, run forward-backward in probability space with per-event scaling instead of log space.", cmd_parser);
+    SwitchArg fused_training("", "fused-training", "During training, accumulate statistics in the backward pass instead of keeping full forward-backward tables.", cmd_parser);
+    ValueArg< float > prune_margin("", "prune-margin", "During training, drop states whose forward probability is this log margin below the best state of the event (inf: off).", false, INFINITY, "float", cmd_parser);
+    SwitchArg concurrent_fwbw("", "concurrent-fwbw", "During training, run the forward and backward passes at the same time once a read has 2 or more threads (log space, without --fused-training).", cmd_parser);
+    SwitchArg task_parallel_training("", "task-parallel-training", "During training, give each thread of a read whole forward-backward passes of its models and strands, instead of a share of every pass.", cmd_parser);
+    SwitchArg factorized_fwbw("", "factorized-fwbw", "During training, sum over the de Bruijn groups of predecessors once per group in forward-backward.", cmd_parser);
+    SwitchArg checkpoint_fwbw("", "checkpoint-fwbw", "With --fused-training, keep forward-backward rows for ~sqrt(n) events at a time, recomputing them in the backward pass.", cmd_parser);
+    SwitchArg fast_log_sum("", "fast-log-sum", "During training, use polynomial approximations of exp and log in log-space sums.", cmd_parser);
     //
     ValueArg< float > pr_skip("", "pr-skip", "Transition probability of skipping at least 1 state.", false, .3, "float", cmd_parser);
     ValueArg< float > pr_stay("", "pr-stay", "Transition probability of staying in the same state.", false, .1, "float", cmd_parser);
@@ -265,19 +294,215 @@ void init_reads(const Pore_Model_Dict_Type& models,
     }
 } // init_reads
 
+// a model, or pair of models when scaling strands together, to train on a read
+// on strand st (2: both strands together)
+struct Train_Candidate
+{
+    unsigned st;
+    const vector< pair< const Event_Sequence_Type*, unsigned > >* event_seq_ptrs_ptr;
+    string m_name;
+    array< string, 2 > m_key;
+    array< const Pore_Model_Type*, 2 > model_ptrs;
+    Pore_Model_Parameters_Type* pm_params_ptr;
+    array< State_Transition_Parameters_Type, 2 >* st_params_ptr;
+    FLOAT_TYPE* fit_ptr;
+};
+
+// train the candidate models of a read, of one or both strands;
+// each round of the models still in training is a single batch of forward-backward passes;
+// with a pool, start from the parameters in the pool, and add the trained ones to it
+void train_candidates(const Fast5_Summary_Type& read_summary,
+                      const State_Transitions_Type& default_transitions,
+                      vector< Train_Candidate >& cand_v, unsigned max_rounds, Thread_Team& team,
+                      Parameter_Pool_Type* pool_ptr)
+{
+    auto st_params_str = [] (unsigned st, const array< State_Transition_Parameters_Type, 2 >& st_params) {
+        ostringstream oss;
+        if (st == 2)
+        {
+            oss << st_params[0] << "," << st_params[1];
+        }
+        else
+        {
+            oss << st_params[st];
+        }
+        return oss.str();
+    };
+    vector< unsigned > round_v(cand_v.size(), 0);
+    vector< unsigned > active_v;
+    for (unsigned c = 0; c < cand_v.size(); ++c)
+    {
+        *cand_v[c].fit_ptr = -INFINITY;
+        active_v.push_back(c);
+        if (pool_ptr and pool_ptr->get(read_summary.run_id, read_summary.channel_id, cand_v[c].m_key,
+                                       *cand_v[c].pm_params_ptr, *cand_v[c].st_params_ptr))
+        {
+            LOG(debug)
+                << "warm_start read [" << read_summary.read_id
+                << "] strand [" << cand_v[c].st
+                << "] model [" << cand_v[c].m_name
+                << "] pm_params [" << *cand_v[c].pm_params_ptr
+                << "] st_params [" << st_params_str(cand_v[c].st, *cand_v[c].st_params_ptr) << "]" << endl;
+        }
+    }
+    while (not active_v.empty())
+    {
+        vector< Parameter_Trainer_Type::Round > train_round_v(active_v.size());
+        for (unsigned k = 0; k < active_v.size(); ++k)
+        {
+            const auto& cand = cand_v[active_v[k]];
+            auto& train_round = train_round_v[k];
+            train_round.event_seq_ptrs_ptr = cand.event_seq_ptrs_ptr;
+            train_round.model_ptrs = cand.model_ptrs;
+            train_round.crt_pm_params_ptr = cand.pm_params_ptr;
+            train_round.crt_st_params_ptr = cand.st_params_ptr;
+            train_round.new_pm_params = *cand.pm_params_ptr;
+            train_round.new_st_params = *cand.st_params_ptr;
+        }
+        Parameter_Trainer_Type::train_rounds(
+            default_transitions, train_round_v,
+            not opts::no_train_scaling, not opts::no_train_transitions, &team);
+        vector< unsigned > next_active_v;
+        for (unsigned k = 0; k < active_v.size(); ++k)
+        {
+            unsigned c = active_v[k];
+            unsigned st = cand_v[c].st;
+            const auto& m_name = cand_v[c].m_name;
+            auto& crt_pm_params = *cand_v[c].pm_params_ptr;
+            auto& crt_st_params = *cand_v[c].st_params_ptr;
+            auto& crt_fit = *cand_v[c].fit_ptr;
+            auto& round = round_v[c];
+            Pore_Model_Parameters_Type old_pm_params(crt_pm_params);
+            array< State_Transition_Parameters_Type, 2 > old_st_params(crt_st_params);
+            auto old_fit = crt_fit;
+            crt_pm_params = train_round_v[k].new_pm_params;
+            crt_st_params = train_round_v[k].new_st_params;
+            crt_fit = train_round_v[k].fit;
+
+            LOG(debug)
+                << "scaling_round read [" << read_summary.read_id
+                << "] strand [" << st
+                << "] model [" << m_name
+                << "] old_pm_params [" << old_pm_params
+                << "] old_st_params [" << st_params_str(st, old_st_params)
+                << "] old_fit [" << old_fit
+                << "] crt_pm_params [" << crt_pm_params
+                << "] crt_st_params [" << st_params_str(st, crt_st_params)
+                << "] crt_fit [" << crt_fit
+                << "] round [" << round << "]" << endl;
+
+            if (train_round_v[k].done)
+            {
+                // singularity detected; stop
+                continue;
+            }
+
+            if (crt_fit < old_fit)
+            {
+                LOG(info) << "scaling_regression read [" << read_summary.read_id
+                          << "] strand [" << st
+                          << "] model [" << m_name
+                          << "] old_pm_params [" << old_pm_params
+                          << "] old_st_params [" << st_params_str(st, old_st_params)
+                          << "] old_fit [" << old_fit
+                          << "] crt_pm_params [" << crt_pm_params
+                          << "] crt_st_params [" << st_params_str(st, crt_st_params)
+                          << "] crt_fit [" << crt_fit
+                          << "] round [" << round << "]" << endl;
+                crt_pm_params = old_pm_params;
+                crt_st_params = old_st_params;
+                crt_fit = old_fit;
+                continue;
+            }
+
+            ++round;
+            // stop condition
+            if (round >= max_rounds
+                or (round > 1 and crt_fit < old_fit + opts::scaling_min_progress))
+            {
+                continue;
+            }
+            next_active_v.push_back(c);
+        } // for k
+        // racing: stop training the candidates that trail the best one of their strand by more than the margin
+        if (opts::scaling_race_margin.get() < INFINITY)
+        {
+            array< FLOAT_TYPE, 3 > best_fit = {{ -INFINITY, -INFINITY, -INFINITY }};
+            for (const auto& cand : cand_v)
+            {
+                best_fit[cand.st] = max(best_fit[cand.st], *cand.fit_ptr);
+            }
+            auto it = remove_if(next_active_v.begin(), next_active_v.end(), [&] (unsigned c) {
+                    unsigned st = cand_v[c].st;
+                    if (*cand_v[c].fit_ptr + opts::scaling_race_margin.get() >= best_fit[st]) return false;
+                    LOG(info)
+                        << "scaling_dropped read [" << read_summary.read_id
+                        << "] strand [" << st
+                        << "] model [" << cand_v[c].m_name
+                        << "] fit [" << *cand_v[c].fit_ptr
+                        << "] best_fit [" << best_fit[st]
+                        << "] round [" << round_v[c] << "]" << endl;
+                    return true;
+                });
+            next_active_v.erase(it, next_active_v.end());
+        }
+        active_v = move(next_active_v);
+    } // while active_v
+    for (unsigned c = 0; c < cand_v.size(); ++c)
+    {
+        LOG(info)
+            << "scaling_result read [" << read_summary.read_id
+            << "] strand [" << cand_v[c].st
+            << "] model [" << cand_v[c].m_name
+            << "] pm_params [" << *cand_v[c].pm_params_ptr
+            << "] st_params [" << st_params_str(cand_v[c].st, *cand_v[c].st_params_ptr)
+            << "] fit [" << *cand_v[c].fit_ptr
+            << "] rounds [" << round_v[c] << "]" << endl;
+        if (pool_ptr)
+        {
+            pool_ptr->put(read_summary.run_id, read_summary.channel_id, cand_v[c].m_key,
+                          *cand_v[c].pm_params_ptr, *cand_v[c].st_params_ptr);
+        }
+    }
+} // train_candidates
+
 void train_reads(const Pore_Model_Dict_Type& models,
                  const State_Transitions_Type& default_transitions,
                  deque< Fast5_Summary_Type >& reads)
 {
     auto time_start_ms = get_cpu_time_ms();
     Parameter_Trainer_Type::init();
+    // warm start: the pool has slots for the models of every read from a known run and channel
+    Parameter_Pool_Type pool;
+    Parameter_Pool_Type* pool_ptr = opts::scaling_warm_start? &pool : nullptr;
+    if (pool_ptr)
+    {
+        for (const auto& read_summary : reads)
+        {
+            if (read_summary.run_id.empty()) continue;
+            for (const auto& p : read_summary.pm_params_m)
+            {
+                pool.add_key(read_summary.run_id, read_summary.channel_id, p.first);
+            }
+        }
+    }
     unsigned crt_idx = 0;
+    // once the queue is empty, threads without work lend themselves to the teams of reads in progress
+    set< std::thread::id > idle_thread_ids;
+    Thread_Team::spare_threads() = 0;
     pfor::pfor< unsigned >(
         opts::num_threads,
         opts::chunk_size,
         // get_item
         [&] (unsigned& i) {
-            if (crt_idx >= reads.size()) return false;
+            if (crt_idx >= reads.size())
+            {
+                if (idle_thread_ids.insert(std::this_thread::get_id()).second)
+                {
+                    Thread_Team::add_spare_threads(1);
+                }
+                return false;
+            }
             i = crt_idx++;
             return true;
         },
@@ -285,6 +510,8 @@ void train_reads(const Pore_Model_Dict_Type& models,
         [&] (unsigned& i) {
             Fast5_Summary_Type& read_summary = reads[i];
             if (read_summary.num_ed_events == 0) return;
+            // starts with this thread only, grows as spare threads become available
+            Thread_Team team(opts::num_threads);
             global_assert::global_msg() = read_summary.read_id;
             read_summary.load_events();
             //
@@ -346,87 +573,24 @@ void train_reads(const Pore_Model_Dict_Type& models,
                 // track model fit
                 // key = pore model name; value = fit
                 map< array< string, 2 >, FLOAT_TYPE > model_fit;
+                vector< Train_Candidate > cand_v;
                 for (const auto& m_name_0 : model_list[0])
                 {
                     for (const auto& m_name_1 : model_list[1])
                     {
                         array< string, 2 > m_name_key = {{ m_name_0, m_name_1 }};
-                        string m_name = m_name_0 + "+" + m_name_1;
-                        unsigned round = 0;
-                        auto& crt_pm_params = read_summary.pm_params_m.at(m_name_key);
-                        auto& crt_st_params = read_summary.st_params_m.at(m_name_key);
-                        auto& crt_fit = model_fit[m_name_key];
-                        crt_fit = -INFINITY;
-                        while (true)
-                        {
-                            Pore_Model_Parameters_Type old_pm_params(crt_pm_params);
-                            std::array< State_Transition_Parameters_Type, 2 > old_st_params(crt_st_params);
-                            auto old_fit = crt_fit;
-                            bool done;
-
-                            Parameter_Trainer_Type::train_one_round(
-                                train_event_seq_ptrs,
-                                {{ &models.at(m_name_0), &models.at(m_name_1) }},
-                                default_transitions,
-                                old_pm_params, old_st_params,
-                                crt_pm_params, crt_st_params, crt_fit, done,
-                                not opts::no_train_scaling, not opts::no_train_transitions);
-
-                            LOG(debug)
-                                << "scaling_round read [" << read_summary.read_id
-                                << "] strand [" << 2
-                                << "] model [" << m_name
-                                << "] old_pm_params [" << old_pm_params
-                                << "] old_st_params [" << old_st_params[0] << "," << old_st_params[1]
-                                << "] old_fit [" << old_fit
-                                << "] crt_pm_params [" << crt_pm_params
-                                << "] crt_st_params [" << crt_st_params[0] << "," << crt_st_params[1]
-                                << "] crt_fit [" << crt_fit
-                                << "] round [" << round << "]" << endl;
-
-                            if (done)
-                            {
-                                // singularity detected; stop
-                                break;
-                            }
-
-                            if (crt_fit < old_fit)
-                            {
-                                LOG(info) << "scaling_regression read [" << read_summary.read_id
-                                          << "] strand [" << 2
-                                          << "] model [" << m_name
-                                          << "] old_params [" << old_pm_params
-                                          << "] old_st_params [" << old_st_params[0] << "," << old_st_params[1]
-                                          << "] old_fit [" << old_fit
-                                          << "] crt_pm_params [" << crt_pm_params
-                                          << "] crt_st_params [" << crt_st_params[0] << "," << crt_st_params[1]
-                                          << "] crt_fit [" << crt_fit
-                                          << "] round [" << round << "]" << endl;
-                                crt_pm_params = old_pm_params;
-                                crt_st_params = old_st_params;
-                                crt_fit = old_fit;
-                                break;
-                            }
-
-                            ++round;
-                            // stop condition
-                            if (round >= 2u * opts::scaling_max_rounds
-                                or (round > 1 and crt_fit < old_fit + opts::scaling_min_progress))
-                            {
-                                break;
-                            }
-
-                        }; // while true
-                        LOG(info)
-                            << "scaling_result read [" << read_summary.read_id
-                            << "] strand [" << 2
-                            << "] model [" << m_name
-                            << "] pm_params [" << crt_pm_params
-                            << "] st_params [" << crt_st_params[0] << "," << crt_st_params[1]
-                            << "] fit [" << crt_fit
-                            << "] rounds [" << round << "]" << endl;
-                    } // for m_name[1]
-                } // for m_name[0]
+                        cand_v.emplace_back();
+                        cand_v.back().st = 2;
+                        cand_v.back().event_seq_ptrs_ptr = &train_event_seq_ptrs;
+                        cand_v.back().m_name = m_name_0 + "+" + m_name_1;
+                        cand_v.back().m_key = m_name_key;
+                        cand_v.back().model_ptrs = {{ &models.at(m_name_0), &models.at(m_name_1) }};
+                        cand_v.back().pm_params_ptr = &read_summary.pm_params_m.at(m_name_key);
+                        cand_v.back().st_params_ptr = &read_summary.st_params_m.at(m_name_key);
+                        cand_v.back().fit_ptr = &model_fit[m_name_key];
+                    }
+                }
+                train_candidates(read_summary, default_transitions, cand_v, 2u * opts::scaling_max_rounds, team, pool_ptr);
                 if (opts::scaling_select_threshold.get() < INFINITY)
                 {
                     auto it_max = alg::max_of(
@@ -453,113 +617,55 @@ void train_reads(const Pore_Model_Dict_Type& models,
             }
             else // not scale_strands_together
             {
+                // the candidates of both strands are trained together, so that their
+                // forward-backward passes share batches; selection is per strand
+                array< vector< pair< const Event_Sequence_Type*, unsigned > >, 2 > train_event_seq_ptrs;
+                array< map< string, FLOAT_TYPE >, 2 > model_fit;
+                vector< Train_Candidate > cand_v;
                 for (unsigned st = 0; st < 2; ++st)
                 {
                     // if not enough events, ignore strand
                     if (read_summary.events(st).size() < opts::min_ed_events) continue;
                     // prepare vector of event sequences
-                    vector< pair< const Event_Sequence_Type*, unsigned > > train_event_seq_ptrs;
                     for (const auto& events : train_event_seqs[st])
                     {
-                        train_event_seq_ptrs.push_back(make_pair(&events, st));
+                        train_event_seq_ptrs[st].push_back(make_pair(&events, st));
                     }
-                    map< string, FLOAT_TYPE > model_fit;
                     for (const auto& m_name : model_list[st])
                     {
                         array< string, 2 > m_name_key;
                         m_name_key[st] = m_name;
-                        unsigned round = 0;
-                        auto& crt_pm_params = read_summary.pm_params_m.at(m_name_key);
-                        auto& crt_st_params = read_summary.st_params_m.at(m_name_key);
-                        auto& crt_fit = model_fit[m_name];
-                        crt_fit = -INFINITY;
-                        while (true)
-                        {
-                            Pore_Model_Parameters_Type old_pm_params(crt_pm_params);
-                            array< State_Transition_Parameters_Type, 2 > old_st_params(crt_st_params);
-                            auto old_fit = crt_fit;
-                            bool done;
-
-                            Parameter_Trainer_Type::train_one_round(
-                                train_event_seq_ptrs,
-                                {{ &models.at(m_name), &models.at(m_name) }},
-                                default_transitions,
-                                old_pm_params, old_st_params,
-                                crt_pm_params, crt_st_params, crt_fit, done,
-                                not opts::no_train_scaling, not opts::no_train_transitions);
-
-                            LOG(debug)
-                                << "scaling_round read [" << read_summary.read_id
-                                << "] strand [" << st
-                                << "] model [" << m_name
-                                << "] old_pm_params [" << old_pm_params
-                                << "] old_st_params [" << old_st_params[st]
-                                << "] old_fit [" << old_fit
-                                << "] crt_pm_params [" << crt_pm_params
-                                << "] crt_st_params [" << crt_st_params[st]
-                                << "] crt_fit [" << crt_fit
-                                << "] round [" << round << "]" << endl;
-
-                            if (done)
-                            {
-                                // singularity detected; stop
-                                break;
-                            }
-
-                            if (crt_fit < old_fit)
-                            {
-                                LOG(info) << "scaling_regression read [" << read_summary.read_id
-                                          << "] strand [" << st
-                                          << "] model [" << m_name
-                                          << "] old_pm_params [" << old_pm_params
-                                          << "] old_st_params [" << old_st_params[st]
-                                          << "] old_fit [" << old_fit
-                                          << "] crt_pm_params [" << crt_pm_params
-                                          << "] crt_st_params [" << crt_st_params[st]
-                                          << "] crt_fit [" << crt_fit
-                                          << "] round [" << round << "]" << endl;
-                                crt_pm_params = old_pm_params;
-                                crt_st_params = old_st_params;
-                                crt_fit = old_fit;
-                                break;
-                            }
-
-                            ++round;
-                            // stop condition
-                            if (round >= opts::scaling_max_rounds
-                                or (round > 1 and crt_fit < old_fit + opts::scaling_min_progress))
-                            {
-                                break;
-                            }
-
-                        }; // while true
+                        cand_v.emplace_back();
+                        cand_v.back().st = st;
+                        cand_v.back().event_seq_ptrs_ptr = &train_event_seq_ptrs[st];
+                        cand_v.back().m_name = m_name;
+                        cand_v.back().m_key = m_name_key;
+                        cand_v.back().model_ptrs = {{ &models.at(m_name), &models.at(m_name) }};
+                        cand_v.back().pm_params_ptr = &read_summary.pm_params_m.at(m_name_key);
+                        cand_v.back().st_params_ptr = &read_summary.st_params_m.at(m_name_key);
+                        cand_v.back().fit_ptr = &model_fit[st][m_name];
+                    }
+                }
+                train_candidates(read_summary, default_transitions, cand_v,
+                                 opts::scaling_max_rounds, team, pool_ptr);
+                for (unsigned st = 0; st < 2; ++st)
+                {
+                    if (model_fit[st].empty() or opts::scaling_select_threshold.get() == INFINITY) continue;
+                    auto it_max = alg::max_of(
+                        model_fit[st],
+                        [] (const map< string, FLOAT_TYPE >::value_type& p) { return p.second; });
+                    if (alg::all_of(
+                            model_fit[st],
+                            [&] (const map< string, FLOAT_TYPE >::value_type& p) {
+                                return &p == &*it_max
+                                    or p.second + opts::scaling_select_threshold.get() < it_max->second;
+                            }))
+                    {
+                        read_summary.preferred_model[st][st] = it_max->first;
                         LOG(info)
-                            << "scaling_result read [" << read_summary.read_id
+                            << "selected_model read [" << read_summary.read_id
                             << "] strand [" << st
-                            << "] model [" << m_name
-                            << "] pm_params [" << crt_pm_params
-                            << "] st_params [" << crt_st_params[st]
-                            << "] fit [" << crt_fit
-                            << "] rounds [" << round << "]" << endl;
-                    } // for m_name
-                    if (opts::scaling_select_threshold.get() < INFINITY)
-                    {
-                        auto it_max = alg::max_of(
-                            model_fit,
-                            [] (const decltype(model_fit)::value_type& p) { return p.second; });
-                        if (alg::all_of(
-                                model_fit,
-                                [&] (const decltype(model_fit)::value_type& p) {
-                                    return &p == &*it_max
-                                        or p.second + opts::scaling_select_threshold.get() < it_max->second;
-                                }))
-                        {
-                            read_summary.preferred_model[st][st] = it_max->first;
-                            LOG(info)
-                                << "selected_model read [" << read_summary.read_id
-                                << "] strand [" << st
-                                << "] model [" << it_max->first << "]" << endl;
-                        }
+                            << "] model [" << it_max->first << "]" << endl;
                     }
                 } // for st
             } // if not scale_strands_together
@@ -601,12 +707,22 @@ void basecall_reads(const Pore_Model_Dict_Type& models,
     }
 
     unsigned crt_idx = 0;
+    // once the queue is empty, threads without work lend themselves to the teams of reads in progress
+    set< std::thread::id > idle_thread_ids;
+    Thread_Team::spare_threads() = 0;
     pfor::pfor< unsigned, ostringstream >(
         opts::num_threads,
         opts::chunk_size,
         // get_item
         [&] (unsigned& i) {
-            if (crt_idx >= reads.size()) return false;
+            if (crt_idx >= reads.size())
+            {
+                if (idle_thread_ids.insert(std::this_thread::get_id()).second)
+                {
+                    Thread_Team::add_spare_threads(1);
+                }
+                return false;
+            }
             i = crt_idx++;
             return true;
         },
@@ -614,6 +730,8 @@ void basecall_reads(const Pore_Model_Dict_Type& models,
         [&] (unsigned& i, ostringstream& oss) {
             Fast5_Summary_Type& read_summary = reads[i];
             if (read_summary.num_ed_events == 0) return;
+            // starts with this thread only, grows as spare threads become available
+            Thread_Team team(opts::num_threads);
             global_assert::global_msg() = read_summary.read_id;
             read_summary.load_events();
 
@@ -633,25 +751,13 @@ void basecall_reads(const Pore_Model_Dict_Type& models,
                     << "] ev_stdv=[" << r_stats[st].second << "]" << endl;
             }
 
-            // basecalling functor
-            // returns: (path_prob, base_seq)
-            auto basecall_strand = [&] (unsigned st, string m_name,
-                                        const Pore_Model_Parameters_Type& pm_params,
-                                        const State_Transition_Parameters_Type& st_params) {
-                // scale model
-                Pore_Model_Type pm(models.at(m_name));
+            // scale model
+            auto prepare_model = [&] (unsigned st, const string& m_name,
+                                      const Pore_Model_Parameters_Type& pm_params,
+                                      const State_Transition_Parameters_Type& st_params,
+                                      Pore_Model_Type& pm) {
+                pm = models.at(m_name);
                 pm.scale(pm_params);
-                State_Transitions_Type custom_transitions;
-                const State_Transitions_Type* transitions_ptr;
-                if (not st_params.is_default())
-                {
-                    custom_transitions.compute_transitions_fast(st_params);
-                    transitions_ptr = &custom_transitions;
-                }
-                else
-                {
-                    transitions_ptr = &default_transitions;
-                }
                 LOG(info)
                     << "basecalling read [" << read_summary.read_id
                     << "] strand [" << st
@@ -674,10 +780,91 @@ void basecall_reads(const Pore_Model_Dict_Type& models,
                         << "] events_mean=[" << r_stats[st].first
                         << "]" << endl;
                 }
+            };
+
+            // compute custom transitions, if needed
+            // returns: pointer to the transitions to use
+            auto prepare_transitions = [&] (const State_Transition_Parameters_Type& st_params,
+                                            State_Transitions_Type& custom_transitions) {
+                if (not st_params.is_default())
+                {
+                    custom_transitions.compute_transitions_fast(st_params);
+                    return static_cast< const State_Transitions_Type* >(&custom_transitions);
+                }
+                return &default_transitions;
+            };
+
+            // scoring functor, used to select the model
+            // candidates: (strand, model name, pm_params, st_params)
+            // identical candidates are scored once, and the candidates of a strand with the same
+            // transitions are scored in a single pass
+            // returns: path_prob of every candidate
+            typedef tuple< unsigned, string, Pore_Model_Parameters_Type, State_Transition_Parameters_Type > Strand_Candidate;
+            auto score_strands = [&] (const vector< Strand_Candidate >& cand_v) {
+                vector< FLOAT_TYPE > res(cand_v.size());
+                // index of the first identical candidate
+                vector< unsigned > first_idx(cand_v.size());
+                for (unsigned c = 0; c < cand_v.size(); ++c)
+                {
+                    first_idx[c] = find(cand_v.begin(), cand_v.begin() + c, cand_v[c]) - cand_v.begin();
+                }
+                vector< bool > done(cand_v.size(), false);
+                for (unsigned c = 0; c < cand_v.size(); ++c)
+                {
+                    if (first_idx[c] != c or done[c]) continue;
+                    unsigned st = get<0>(cand_v[c]);
+                    const auto& st_params = get<3>(cand_v[c]);
+                    vector< unsigned > group;
+                    for (unsigned c2 = c; c2 < cand_v.size(); ++c2)
+                    {
+                        if (first_idx[c2] == c2 and get<0>(cand_v[c2]) == st and get<3>(cand_v[c2]) == st_params)
+                        {
+                            group.push_back(c2);
+                            done[c2] = true;
+                        }
+                    }
+                    vector< Pore_Model_Type > pm_v(group.size());
+                    vector< const Pore_Model_Type* > pm_ptr_v;
+                    vector< FLOAT_TYPE > drift_v;
+                    for (unsigned k = 0; k < group.size(); ++k)
+                    {
+                        const auto& cand = cand_v[group[k]];
+                        prepare_model(st, get<1>(cand), get<2>(cand), get<3>(cand), pm_v[k]);
+                        pm_ptr_v.push_back(&pm_v[k]);
+                        // drift is corrected on the fly, no need to copy the events
+                        drift_v.push_back(get<2>(cand).drift);
+                    }
+                    State_Transitions_Type custom_transitions;
+                    auto transitions_ptr = prepare_transitions(st_params, custom_transitions);
+                    Multi_Viterbi_Type mvit;
+                    mvit.set_thread_team(&team);
+                    mvit.fill_score(pm_ptr_v, drift_v, *transitions_ptr, read_summary.events(st));
+                    for (unsigned k = 0; k < group.size(); ++k)
+                    {
+                        res[group[k]] = mvit.path_probability(k);
+                    }
+                }
+                for (unsigned c = 0; c < cand_v.size(); ++c)
+                {
+                    res[c] = res[first_idx[c]];
+                }
+                return res;
+            };
+
+            // basecalling functor
+            // returns: (path_prob, corrected_events)
+            auto basecall_strand = [&] (unsigned st, const string& m_name,
+                                        const Pore_Model_Parameters_Type& pm_params,
+                                        const State_Transition_Parameters_Type& st_params) {
+                Pore_Model_Type pm;
+                prepare_model(st, m_name, pm_params, st_params, pm);
+                State_Transitions_Type custom_transitions;
+                auto transitions_ptr = prepare_transitions(st_params, custom_transitions);
                 // correct drift
                 Event_Sequence_Type corrected_events = read_summary.events(st);
                 corrected_events.apply_drift_correction(pm_params.drift);
                 Viterbi_Type vit;
+                vit.set_thread_team(&team);
                 vit.fill(pm, *transitions_ptr, corrected_events);
                 return std::make_tuple(vit.path_probability(), std::move(corrected_events));
             };
@@ -700,20 +887,45 @@ void basecall_reads(const Pore_Model_Dict_Type& models,
                         model_sublist.push_back(p.first);
                     }
                 }
-                // basecall using applicable models
+                // with several candidates, score them all, then decode only with the best one;
+                // beam search scores are only available from a full decode
+                bool decode_all = model_sublist.size() == 1 or Viterbi_Type::use_beam();
                 deque< tuple< FLOAT_TYPE,
                               FLOAT_TYPE, FLOAT_TYPE,
                               string, string,
                               Event_Sequence_Type, Event_Sequence_Type > > results;
+                vector< FLOAT_TYPE > score_v;
+                if (not decode_all)
+                {
+                    vector< Strand_Candidate > cand_v;
+                    for (const auto& m_name : model_sublist)
+                    {
+                        for (unsigned st = 0; st < 2; ++st)
+                        {
+                            cand_v.emplace_back(st, m_name[st],
+                                                read_summary.pm_params_m.at(m_name),
+                                                read_summary.st_params_m.at(m_name)[st]);
+                        }
+                    }
+                    score_v = score_strands(cand_v);
+                }
+                unsigned crt_cand = 0;
                 for (const auto& m_name : model_sublist)
                 {
                     array< tuple< FLOAT_TYPE, Event_Sequence_Type >, 2 > part_results;
                     for (unsigned st = 0; st < 2; ++st)
                     {
-                        part_results[st] = basecall_strand(
-                            st, m_name[st],
-                            read_summary.pm_params_m.at(m_name),
-                            read_summary.st_params_m.at(m_name)[st]);
+                        if (decode_all)
+                        {
+                            part_results[st] = basecall_strand(
+                                st, m_name[st],
+                                read_summary.pm_params_m.at(m_name),
+                                read_summary.st_params_m.at(m_name)[st]);
+                        }
+                        else
+                        {
+                            get<0>(part_results[st]) = score_v[crt_cand++];
+                        }
                     }
                     results.emplace_back(get<0>(part_results[0]) + get<0>(part_results[1]),
                                          get<0>(part_results[0]),
@@ -729,6 +941,18 @@ void basecall_reads(const Pore_Model_Dict_Type& models,
                      [] (const decltype(results)::value_type& lhs, const decltype(results)::value_type& rhs) {
                          return get<0>(lhs) < get<0>(rhs);
                      });
+                if (not decode_all)
+                {
+                    array< string, 2 > m_name{{ get<3>(results.back()), get<4>(results.back()) }};
+                    for (unsigned st = 0; st < 2; ++st)
+                    {
+                        auto r = basecall_strand(
+                            st, m_name[st],
+                            read_summary.pm_params_m.at(m_name),
+                            read_summary.st_params_m.at(m_name)[st]);
+                        (st == 0? get<5>(results.back()) : get<6>(results.back())) = std::move(get<1>(r));
+                    }
+                }
                 array< FLOAT_TYPE, 2 > best_log_path_prob{{ get<1>(results.back()), get<2>(results.back()) }};
                 array< string, 2 > best_m_name{{ get<3>(results.back()), get<4>(results.back()) }};
                 array< const Event_Sequence_Type*, 2 > event_seq_ptr = {
@@ -797,23 +1021,57 @@ void basecall_reads(const Pore_Model_Dict_Type& models,
                             }
                         }
                     }
+                    // with several candidates, score them all, then decode only with the best one
+                    bool decode_all = model_sublist.size() == 1 or Viterbi_Type::use_beam();
                     // deque of results
                     deque< tuple< FLOAT_TYPE, string, Event_Sequence_Type > > results;
+                    vector< FLOAT_TYPE > score_v;
+                    if (not decode_all)
+                    {
+                        vector< Strand_Candidate > cand_v;
+                        for (const auto& m_name : model_sublist)
+                        {
+                            cand_v.emplace_back(st, m_name[st],
+                                                read_summary.pm_params_m.at(m_name),
+                                                read_summary.st_params_m.at(m_name)[st]);
+                        }
+                        score_v = score_strands(cand_v);
+                    }
+                    unsigned crt_cand = 0;
                     for (const auto& m_name : model_sublist)
                     {
-                        auto r = basecall_strand(
-                            st, m_name[st],
-                            read_summary.pm_params_m.at(m_name),
-                            read_summary.st_params_m.at(m_name)[st]);
-                        results.emplace_back(get<0>(r),
-                                             string(m_name[st]),
-                                             std::move(get<1>(r)));
+                        if (decode_all)
+                        {
+                            auto r = basecall_strand(
+                                st, m_name[st],
+                                read_summary.pm_params_m.at(m_name),
+                                read_summary.st_params_m.at(m_name)[st]);
+                            results.emplace_back(get<0>(r),
+                                                 string(m_name[st]),
+                                                 std::move(get<1>(r)));
+                        }
+                        else
+                        {
+                            results.emplace_back(score_v[crt_cand++],
+                                                 string(m_name[st]),
+                                                 Event_Sequence_Type());
+                        }
                     }
                     sort(results.begin(),
                          results.end(),
                          [] (const decltype(results)::value_type& lhs, const decltype(results)::value_type& rhs) {
                              return get<0>(lhs) < get<0>(rhs);
                          });
+                    if (not decode_all)
+                    {
+                        array< string, 2 > m_name;
+                        m_name[st] = get<1>(results.back());
+                        auto r = basecall_strand(
+                            st, m_name[st],
+                            read_summary.pm_params_m.at(m_name),
+                            read_summary.st_params_m.at(m_name)[st]);
+                        get<2>(results.back()) = std::move(get<1>(r));
+                    }
                     const string& best_m_name = get<1>(results.back());
                     const Event_Sequence_Type& event_seq = get<2>(results.back());
                     string base_seq = event_seq.get_base_seq();
@@ -918,6 +1176,21 @@ int main(int argc, char * argv[])
     Fast5_Summary_Type::min_ed_events() = opts::min_ed_events;
     Fast5_Summary_Type::max_ed_events() = opts::max_ed_events;
     Fast5_Summary_Type::eventdetection_group() = opts::ed_group;
+    Viterbi_Type::beam_width() = opts::viterbi_beam;
+    Viterbi_Type::beam_margin() = opts::viterbi_beam_margin;
+    Viterbi_Type::checkpointing() = opts::viterbi_checkpoint;
+    Viterbi_Type::quantized() = opts::viterbi_quantized;
+    Viterbi_Type::window_size() = opts::viterbi_window;
+    Viterbi_Type::window_overlap() = opts::viterbi_window_overlap;
+    Forward_Backward_Type::scaled() = opts::scaled_fwbw;
+    Forward_Backward_Type::prune_margin() = opts::prune_margin;
+    Forward_Backward_Type::concurrent() = opts::concurrent_fwbw;
+    Forward_Backward_Type::task_parallel() = opts::task_parallel_training;
+    Forward_Backward_Type::factorized() = opts::factorized_fwbw;
+    Forward_Backward_Type::checkpointing() = opts::checkpoint_fwbw;
+    Log_Sum_Type::fast() = opts::fast_log_sum;
+    Parameter_Trainer_Type::fused() = opts::fused_training;
+    Parameter_Trainer_Type::viterbi_training() = opts::scaling_method.get() == "viterbi";
     //
     // set training option
     //
@@ -959,12 +1232,36 @@ int main(int argc, char * argv[])
             << "invalid scaling_select_threshold: " << opts::scaling_select_threshold.get() << endl;
         return EXIT_FAILURE;
     }
+    if (opts::scaling_race_margin.get() < 0.0)
+    {
+        LOG(error)
+            << "invalid scaling_race_margin: " << opts::scaling_race_margin.get() << endl;
+        return EXIT_FAILURE;
+    }
     if (opts::scaling_min_progress < 0.0)
     {
         LOG(error)
             << "invalid scaling_min_progress: " << opts::scaling_min_progress.get() << endl;
         return EXIT_FAILURE;
     }
+    if (opts::scaling_method.get() != "fwbw" and opts::scaling_method.get() != "viterbi")
+    {
+        LOG(error)
+            << "invalid scaling_method: " << opts::scaling_method.get() << endl;
+        return EXIT_FAILURE;
+    }
+    if (opts::prune_margin.get() < 0.0)
+    {
+        LOG(error)
+            << "invalid prune_margin: " << opts::prune_margin.get() << endl;
+        return EXIT_FAILURE;
+    }
+    if (opts::viterbi_beam_margin.get() < 0.0)
+    {
+        LOG(error)
+            << "invalid viterbi_beam_margin: " << opts::viterbi_beam_margin.get() << endl;
+        return EXIT_FAILURE;
+    }
     if (not opts::output_fn.get().empty() and opts::write_fast5)
     {
         LOG(error)
@@ -974,6 +1271,15 @@ int main(int argc, char * argv[])
     //
     // print training options
     //
+    if (Viterbi_Type::use_beam())
+    {
+        LOG(info) << "viterbi_beam=" << opts::viterbi_beam.get() << endl;
+        LOG(info) << "viterbi_beam_margin=" << opts::viterbi_beam_margin.get() << endl;
+    }
+    else
+    {
+        LOG(info) << "viterbi_checkpoint=" << opts::viterbi_checkpoint.get() << endl;
+    }
     LOG(info) << "train=" << opts::train.get() << endl;
     if (opts::train)
     {
@@ -983,10 +1289,13 @@ int main(int argc, char * argv[])
         if (not opts::no_train_scaling)
         {
             LOG(info) << "double_strands_scaling=" << opts::double_strand_scaling.get() << endl;
+            LOG(info) << "scaling_method=" << opts::scaling_method.get() << endl;
+            LOG(info) << "scaling_warm_start=" << opts::scaling_warm_start.get() << endl;
             LOG(info) << "scaling_num_events=" << opts::scaling_num_events.get() << endl;
             LOG(info) << "scaling_max_rounds=" << opts::scaling_max_rounds.get() << endl;
             LOG(info) << "scaling_min_progress=" << opts::scaling_min_progress.get() << endl;
             LOG(info) << "scaling_select_threshold=" << opts::scaling_select_threshold.get() << endl;
+            LOG(info) << "scaling_race_margin=" << opts::scaling_race_margin.get() << endl;
         }
     }
     return real_main();
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <tclap/CmdLine.h>
@@ -7,6 +8,7 @@
 #include "Event.hpp"
 #include "Forward_Backward.hpp"
 #include "Forward_Backward_Custom.hpp"
+#include "Log_Sum.hpp"
 #include "logger.hpp"
 #include "zstr.hpp"
 
@@ -24,6 +26,7 @@ typedef Event< FLOAT_TYPE, KMER_SIZE> Event_Type;
 typedef Event_Sequence< FLOAT_TYPE, KMER_SIZE > Event_Sequence_Type;
 typedef Forward_Backward< FLOAT_TYPE, KMER_SIZE > Forward_Backward_Type;
 typedef Forward_Backward_Custom< FLOAT_TYPE, KMER_SIZE > Forward_Backward_Custom_Type;
+typedef Log_Sum< FLOAT_TYPE > Log_Sum_Type;
 
 namespace opts
 {
@@ -38,6 +41,13 @@ namespace opts
     ValueArg< string > ev_file_name("e", "events", "Events file name.", true, "", "file", cmd_parser);
     ValueArg< string > output_file_name("o", "output", "Output file name.", false, "", "file", cmd_parser);
     SwitchArg custom_fwbw("", "custom-fwbw", "Use custom fwbw.", cmd_parser);
+    SwitchArg scaled("", "scaled", "Use scaled probabilities instead of log probabilities.", cmd_parser);
+    ValueArg< float > prune_margin("", "prune-margin", "Drop states whose forward probability is this log margin below the best state of the event (inf: off).", false, INFINITY, "float", cmd_parser);
+    SwitchArg concurrent("", "concurrent", "Run the forward and backward passes at the same time (log space, 2 or more threads).", cmd_parser);
+    SwitchArg factorized("", "factorized", "Sum over the de Bruijn groups of predecessors once per group.", cmd_parser);
+    SwitchArg checkpoint("", "checkpoint", "Streaming fill keeping rows for ~sqrt(n) events at a time (no output file).", cmd_parser);
+    SwitchArg fast_log_sum("", "fast-log-sum", "Use polynomial approximations of exp and log in log-space sums.", cmd_parser);
+    ValueArg< unsigned > num_threads("t", "threads", "Number of threads used within the read.", false, 1, "int", cmd_parser);
 } // namespace opts
 
 void real_main()
@@ -57,24 +67,57 @@ void real_main()
         }
     }
 
+    if (opts::checkpoint and not opts::output_file_name.get().empty())
+    {
+        LOG(error) << "--checkpoint does not keep the tables needed by --output" << endl;
+        exit(EXIT_FAILURE);
+    }
+    Forward_Backward_Type::n_threads() = std::max(opts::num_threads.get(), 1u);
+    Forward_Backward_Type::scaled() = opts::scaled;
+    Forward_Backward_Type::prune_margin() = opts::prune_margin;
+    Forward_Backward_Type::concurrent() = opts::concurrent;
+    Forward_Backward_Type::factorized() = opts::factorized;
+    Forward_Backward_Type::checkpointing() = opts::checkpoint;
+    Log_Sum_Type::fast() = opts::fast_log_sum;
     Forward_Backward_Type fwbw;
     Forward_Backward_Custom_Type fwbw_custom;
-    if (not opts::custom_fwbw)
+    unsigned i_mid = ev.size() / 2;
+    vector< FLOAT_TYPE > log_posterior_mid(pm.n_states);
+    if (opts::custom_fwbw)
     {
-        fwbw.fill(pm, st, ev);
+        fwbw_custom.fill(pm, st, ev);
+        for (unsigned j = 0; j < pm.n_states; ++j)
+        {
+            log_posterior_mid[j] = fwbw_custom.log_posterior(i_mid, j);
+        }
     }
     else
     {
-        fwbw_custom.fill(pm, st, ev);
+        auto save_mid = [&] (unsigned i) {
+            if (i != i_mid) return;
+            for (unsigned j = 0; j < pm.n_states; ++j)
+            {
+                log_posterior_mid[j] = fwbw.log_posterior(i, j);
+            }
+        };
+        if (opts::checkpoint)
+        {
+            fwbw.fill_streaming(pm, st, ev, save_mid);
+        }
+        else
+        {
+            fwbw.fill(pm, st, ev);
+            save_mid(i_mid);
+        }
+        LOG(info) << "log_pr_data [" << fwbw.log_pr_data() << "] scaled [" << fwbw.is_scaled()
+                  << "] sparse [" << fwbw.is_sparse() << "]" << endl;
     }
 
     // print all kmers with posterior >= .1 for the middle event
     multiset< pair< FLOAT_TYPE, unsigned > > s;
     for (unsigned j = 0; j < pm.n_states; ++j)
     {
-        FLOAT_TYPE v = exp(not opts::custom_fwbw
-                           ? fwbw.log_posterior(ev.size() / 2, j)
-                           : fwbw_custom.log_posterior(ev.size() / 2, j));
+        FLOAT_TYPE v = exp(log_posterior_mid[j]);
         if (v >= .1)
         {
             s.insert(make_pair(v, j));
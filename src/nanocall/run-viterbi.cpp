@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <tclap/CmdLine.h>
@@ -6,6 +7,7 @@
 #include "State_Transitions.hpp"
 #include "Event.hpp"
 #include "Viterbi.hpp"
+#include "Multi_Viterbi.hpp"
 #include "logger.hpp"
 #include "zstr.hpp"
 
@@ -22,6 +24,7 @@ typedef Pore_Model< FLOAT_TYPE, KMER_SIZE > Pore_Model_Type;
 typedef Event< FLOAT_TYPE, KMER_SIZE > Event_Type;
 typedef Event_Sequence< FLOAT_TYPE, KMER_SIZE > Event_Sequence_Type;
 typedef Viterbi< FLOAT_TYPE, KMER_SIZE > Viterbi_Type;
+typedef Multi_Viterbi< FLOAT_TYPE, KMER_SIZE > Multi_Viterbi_Type;
 
 namespace opts
 {
@@ -33,6 +36,19 @@ namespace opts
     ValueArg< string > pm_file_name("p", "pore-model", "Scaled pore model file name.", true, "", "file", cmd_parser);
     ValueArg< string > st_file_name("s", "state-transitions", "State transitions file name.", true, "", "file", cmd_parser);
     ValueArg< string > ev_file_name("e", "events", "Events file name.", true, "", "file", cmd_parser);
+    ValueArg< unsigned > beam_width("", "beam", "Beam width (0: exhaustive).", false, 0, "int", cmd_parser);
+    ValueArg< float > beam_margin("", "beam-margin", "Beam log score margin.", false, INFINITY, "float", cmd_parser);
+    SwitchArg checkpointing("", "checkpoint", "Keep only sqrt(n) alpha rows, recompute during traceback.", cmd_parser);
+    SwitchArg quantized("", "quantized", "Use int16 scores.", cmd_parser);
+    ValueArg< float > quantization_scale("", "quantization-scale", "Quantized score units per nat.", false, 256, "float", cmd_parser);
+    ValueArg< unsigned > window_size("", "window", "Decode reads longer than twice this many events in overlapping windows (0: off).", false, 0, "int", cmd_parser);
+    ValueArg< unsigned > window_overlap("", "window-overlap", "Initial window overlap.", false, 256, "int", cmd_parser);
+    SwitchArg scalar("", "scalar", "Use the reference scalar kernel.", cmd_parser);
+    ValueArg< unsigned > simd_level("", "simd-level", "Maximum SIMD level (0: none, 1: AVX2, 2: AVX-512).", false, 2, "int", cmd_parser);
+    SwitchArg score_only("", "score-only", "Output only the log path probability.", cmd_parser);
+    MultiArg< string > extra_pm_file_name("", "extra-pore-model", "Additional scaled pore model, scored in the same pass (implies --score-only).", false, "file", cmd_parser);
+    ValueArg< unsigned > num_threads("t", "threads", "Number of threads used within the read.", false, 1, "int", cmd_parser);
+    SwitchArg compare("", "compare", "Report agreement with exhaustive search using the scalar kernel.", cmd_parser);
 } // namespace opts
 
 void real_main()
@@ -51,9 +67,79 @@ void real_main()
         }
     }
 
+    Viterbi_Type::beam_width() = opts::beam_width;
+    Viterbi_Type::beam_margin() = opts::beam_margin;
+    Viterbi_Type::checkpointing() = opts::checkpointing;
+    Viterbi_Type::quantized() = opts::quantized;
+    Viterbi_Type::window_size() = opts::window_size;
+    Viterbi_Type::window_overlap() = opts::window_overlap;
+    Viterbi_Type::quantization_scale() = opts::quantization_scale;
+    Viterbi_Type::scalar_kernel() = opts::scalar;
+    Viterbi_Type::n_threads() = std::max(opts::num_threads.get(), 1u);
+    Viterbi_Type::Viterbi_Kernel_Type::simd_level() =
+        std::min(Viterbi_Type::Viterbi_Kernel_Type::simd_level(), opts::simd_level.get());
+    LOG(info) << "kernel [" << (opts::scalar? "scalar" : "pattern")
+              << "] simd_level [" << Viterbi_Type::Viterbi_Kernel_Type::simd_level()
+              << "] has_pattern [" << st.has_pattern()
+              << "] has_groups [" << st.has_groups() << "]" << endl;
+    if (not opts::extra_pm_file_name.get().empty())
+    {
+        // one path probability per model, in the order given
+        vector< Pore_Model_Type > pm_v(1, pm);
+        for (const auto& fn : opts::extra_pm_file_name.get())
+        {
+            pm_v.emplace_back();
+            zstr::ifstream(fn) >> pm_v.back();
+        }
+        vector< const Pore_Model_Type* > pm_ptr_v;
+        for (const auto& pm_crt : pm_v)
+        {
+            pm_ptr_v.push_back(&pm_crt);
+        }
+        Multi_Viterbi_Type::n_threads() = Viterbi_Type::n_threads();
+        Multi_Viterbi_Type mvit;
+        mvit.fill_score(pm_ptr_v, vector< FLOAT_TYPE >(pm_v.size(), 0), st, ev);
+        for (unsigned m = 0; m < mvit.n_models(); ++m)
+        {
+            cout << mvit.path_probability(m) << std::endl;
+        }
+        return;
+    }
     Viterbi_Type vit;
+    if (opts::score_only)
+    {
+        vit.fill_score(pm, st, ev);
+        cout << vit.path_probability() << std::endl;
+        return;
+    }
     vit.fill(pm, st, ev);
     cout << ev.get_base_seq() << std::endl;
+
+    if (opts::compare)
+    {
+        Event_Sequence_Type ev_full(ev);
+        Viterbi_Type vit_full;
+        Viterbi_Type::scalar_kernel() = true;
+        Viterbi_Type::quantized() = false;
+        Viterbi_Type::window_size() = 0;
+        vit_full.fill_full(pm, st, ev_full);
+        unsigned n_agree = 0;
+        for (unsigned i = 0; i < ev.size(); ++i)
+        {
+            n_agree += (ev[i].model_state_idx == ev_full[i].model_state_idx);
+        }
+        LOG(info)
+            << "agreement kernel [" << (opts::scalar? "scalar" : "pattern")
+            << "] quantized [" << opts::quantized.get()
+            << "] window [" << opts::window_size.get()
+            << "] beam [" << opts::beam_width.get()
+            << "] margin [" << opts::beam_margin.get()
+            << "] states [" << n_agree << "/" << ev.size()
+            << "] rate [" << (ev.empty()? 1.0 : (double)n_agree / ev.size())
+            << "] base_seq_identical [" << (ev.get_base_seq() == ev_full.get_base_seq())
+            << "] log_path_prob [" << vit.path_probability()
+            << "] full_log_path_prob [" << vit_full.path_probability() << "]" << endl;
+    }
 }
 
 int main(int argc, char * argv[])